@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <netinet/ip.h>
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -18,25 +19,108 @@
 
 static http_server_socket_t hss;
 static http_handoff_server_socket_t hhss;
+static phttp_stats_server_t pss;
 static http_server_handoff_data_t *conn_pool;
 static struct global_config gconf;
 static struct phttp_args phttp_args;
 static uint32_t rr_factor = 0;
 static uint32_t nconnection = 0;
+static struct http_shared_buf *objbuf;
+
+#define BENCH_CHUNK_SIZE (64 * 1024)
+
+/*
+ * Object streamed in chunks ("/chunked/<size>"), one per response
+ */
+struct bench_stream {
+  struct http_shared_buf *obj;
+  uint64_t ofs;
+  uint64_t len;
+};
 
 static int
-bench_backend_request_handler(struct http_request *req,
-                              struct http_response *res, bool imported)
+bench_stream_produce(struct http_response *res, int status)
+{
+  int error;
+  uint64_t n;
+  struct bench_stream *bs = (struct bench_stream *)res->stream_data;
+
+  if (status == 0) {
+    while (bs->ofs < bs->len && phttp_stream_writable(res)) {
+      n = std::min((uint64_t)BENCH_CHUNK_SIZE, bs->len - bs->ofs);
+      error = phttp_stream_write(res, bs->obj->buf + bs->ofs, n);
+      assert(error == 0);
+      bs->ofs += n;
+    }
+
+    if (bs->ofs < bs->len) {
+      return 0;
+    }
+
+    error = phttp_stream_end(res);
+    assert(error == 0);
+  }
+
+  http_shared_buf_unref(bs->obj);
+  free(bs);
+
+  return 0;
+}
+
+static int
+bench_stream_start(struct http_request *req, struct http_response *res,
+                   uint64_t objsize)
 {
   int error;
+  struct bench_stream *bs;
 
+  bs = (struct bench_stream *)malloc(sizeof(*bs));
+  assert(bs != NULL);
+
+  error = phttp_stream_begin(req, res, bench_stream_produce, bs);
+  if (error != 0) {
+    free(bs);
+    return error;
+  }
+
+  http_shared_buf_ref(objbuf);
+  bs->obj = objbuf;
+  bs->ofs = 0;
+  bs->len = objsize;
+
+  return bench_stream_produce(res, 0);
+}
+
+static int
+bench_backend_request_handler(struct http_request *req,
+                              struct http_response *res, bool imported)
+{
   if (imported) {
     uint64_t objsize;
-    sscanf(req->path, "/%lu", &objsize);
+    bool chunked = sscanf(req->path, "/chunked/%lu", &objsize) == 1;
+    if (!chunked) {
+      sscanf(req->path, "/%lu", &objsize);
+    }
     res->status = 200;
     res->reason = "OK";
-    error = membuf_consume(&res->body_mem, objsize);
-    assert(error == 0);
+
+    /*
+     * Every response refers to the same object, in-flight responses
+     * keep the old one alive when it is replaced by a larger one.
+     */
+    if (objbuf == NULL || objbuf->len < objsize) {
+      if (objbuf != NULL) {
+        http_shared_buf_unref(objbuf);
+      }
+      objbuf = http_shared_buf_create(objsize);
+      assert(objbuf != NULL);
+    }
+
+    if (chunked && bench_stream_start(req, res, objsize) == 0) {
+      return 0;
+    }
+
+    http_response_set_body_shared(res, objbuf, 0, objsize);
   } else {
     res->status = 600;
     res->reason = "Handoff";
@@ -104,6 +188,9 @@ main(int argc, char **argv)
   error = setrlimit(RLIMIT_NOFILE, &lim);
   assert(error == 0);
 
+  error = phttp_stats_init();
+  assert(error == 0);
+
   /*
    * Main
    */
@@ -130,6 +217,12 @@ main(int argc, char **argv)
       error = phttp_handoff_server_init(loop, &hhss);
       assert(error == 0);
 
+      if (phttp_args.stats_port != 0) {
+        init_stats_server_conf(&phttp_args, &pss);
+        error = phttp_stats_server_init(loop, &pss);
+        assert(error == 0);
+      }
+
       error = start_connect_to_proxy(loop, proxy_addr, proxy_port, i);
       assert(error == 0);
 
@@ -137,8 +230,6 @@ main(int argc, char **argv)
       uv_signal_init(loop, &sig);
       uv_signal_start(&sig, on_sig, SIGINT);
 
-      make_dummy_work(loop);
-
       printf("Starting event loop... using libuv version %s\n",
              uv_version_string());
       uv_run(loop, UV_RUN_DEFAULT);
@@ -148,6 +239,7 @@ main(int argc, char **argv)
       }
 
       prism_switch_client_destroy(gconf.sw_client);
+      mempool_destroy(gconf.pool);
       free(loop);
 
       return EXIT_SUCCESS;
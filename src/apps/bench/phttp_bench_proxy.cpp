@@ -10,6 +10,7 @@
 
 static http_server_socket_t hss;
 static http_handoff_server_socket_t hhss;
+static phttp_stats_server_t pss;
 static http_server_handoff_data_t *backends;
 static struct global_config gconf;
 static struct phttp_args phttp_args;
@@ -121,6 +122,9 @@ main(int argc, char **argv)
   error = setrlimit(RLIMIT_NOFILE, &lim);
   assert(error == 0);
 
+  error = phttp_stats_init();
+  assert(error == 0);
+
   /*
    * Main
    */
@@ -147,6 +151,12 @@ main(int argc, char **argv)
       error = phttp_handoff_server_init(loop, &hhss);
       assert(error == 0);
 
+      if (phttp_args.stats_port != 0) {
+        init_stats_server_conf(&phttp_args, &pss);
+        error = phttp_stats_server_init(loop, &pss);
+        assert(error == 0);
+      }
+
       error = start_connect_to_backends(loop, bes_arg, i);
       assert(error == 0);
 
@@ -154,8 +164,6 @@ main(int argc, char **argv)
       uv_signal_init(loop, &sig);
       uv_signal_start(&sig, on_sig, SIGINT);
 
-      make_dummy_work(loop);
-
       printf("Starting event loop... using libuv version %s\n",
              uv_version_string());
       uv_run(loop, UV_RUN_DEFAULT);
@@ -182,6 +190,7 @@ main(int argc, char **argv)
   }
 
   prism_switch_client_destroy(gconf.sw_client);
+  mempool_destroy(gconf.pool);
   free(backends);
   free(workers);
 
@@ -11,6 +11,7 @@
 
 static http_server_socket_t hss;
 static http_handoff_server_socket_t hhss;
+static phttp_stats_server_t pss;
 static http_server_handoff_data_t *backends;
 static struct global_config gconf;
 static struct phttp_args phttp_args;
@@ -112,6 +113,7 @@ main(int argc, char **argv)
   auto nworkers = args.get<uint32_t>("nworkers");
 
   hss.request_handler = kvs_proxy_request_handler;
+  hss.headers_handler = kvs_proxy_request_handler;
 
   struct rlimit lim;
   lim.rlim_cur = 10000;
@@ -119,6 +121,9 @@ main(int argc, char **argv)
   error = setrlimit(RLIMIT_NOFILE, &lim);
   assert(error == 0);
 
+  error = phttp_stats_init();
+  assert(error == 0);
+
   /*
    * Main
    */
@@ -145,6 +150,12 @@ main(int argc, char **argv)
       error = phttp_handoff_server_init(loop, &hhss);
       assert(error == 0);
 
+      if (phttp_args.stats_port != 0) {
+        init_stats_server_conf(&phttp_args, &pss);
+        error = phttp_stats_server_init(loop, &pss);
+        assert(error == 0);
+      }
+
       error = start_connect_to_backends(loop, bes_arg, i);
       assert(error == 0);
 
@@ -155,8 +166,6 @@ main(int argc, char **argv)
       uv_signal_init(loop, &sig);
       uv_signal_start(&sig, on_sig, SIGINT);
 
-      make_dummy_work(loop);
-
       printf("Starting event loop... using libuv version %s\n",
              uv_version_string());
       uv_run(loop, UV_RUN_DEFAULT);
@@ -183,6 +192,7 @@ main(int argc, char **argv)
   }
 
   prism_switch_client_destroy(gconf.sw_client);
+  mempool_destroy(gconf.pool);
   free(backends);
   free(workers);
 
@@ -18,6 +18,13 @@ http_handoff_server_close(uv_tcp_t *server)
   return 0;
 }
 
+static int
+stats_server_close(uv_tcp_t *server)
+{
+  uv_close((uv_handle_t *)server, NULL);
+  return 0;
+}
+
 static int
 read_from_file(const char *fname, void *buf, int max_len)
 {
@@ -59,11 +66,21 @@ tweak_phttp_args(struct phttp_args *args, uint32_t workerid)
 static void
 init_server_conf(struct phttp_args *args, http_server_socket_t *hss)
 {
+  int error;
+
   hss->hs.close = http_server_close;
   hss->backlog = args->backlog;
   hss->server_addr = inet_addr(args->addr.c_str());
   hss->server_port = htons(args->port);
+  if (!args->addr6.empty()) {
+    hss->server_ipv6 = true;
+    error = inet_pton(AF_INET6, args->addr6.c_str(), &hss->server_addr6);
+    assert(error == 1);
+  }
   memcpy(hss->server_mac, args->mac, 6);
+  hss->zerocopy_threshold = args->zerocopy_threshold;
+  hss->max_headers = args->max_headers;
+  hss->max_body = args->max_body;
   if (args->tls) {
     hss->tls = tls_create_context(1, TLS_V12);
     assert(hss->tls != NULL);
@@ -83,12 +100,28 @@ init_handoff_server_conf(struct phttp_args *args,
   hhss->server_socket = hss;
 }
 
+static void
+init_stats_server_conf(struct phttp_args *args, phttp_stats_server_t *pss)
+{
+  pss->hs.close = stats_server_close;
+  pss->backlog = args->backlog;
+  pss->addr = inet_addr(args->stats_addr.c_str());
+  pss->port = htons(args->stats_port);
+}
+
 static void
 init_global_conf(struct phttp_args *args, struct global_config *gconf,
                  uv_loop_t *loop)
 {
   std::string host = args->sw_addr + ":" + args->sw_port;
   gconf->sw_client = prism_switch_client_create(loop, host.c_str());
+  prism_switch_client_set_coalesce(gconf->sw_client, args->sw_batch);
+  prism_switch_client_set_max_inflight(gconf->sw_client,
+                                       args->sw_max_inflight);
+  gconf->pool = mempool_create();
+  gconf->ho_batch_max = args->ho_batch_max;
+  gconf->ho_batch_delay_us = args->ho_batch_delay;
+  gconf->ho_import_pool = args->ho_import_pool;
 }
 
 static void
@@ -101,30 +134,6 @@ init_all_conf(uv_loop_t *loop, struct phttp_args *args,
   init_global_conf(args, gconf, loop);
 }
 
-static void
-dummy_work(uv_work_t *work)
-{
-  printf("Dummy work for initialize thread pool\n");
-}
-
-static void
-dummy_work_done(uv_work_t *work, int status)
-{
-  assert(status == 0);
-  printf("Dummy work done\n");
-  free(work);
-}
-
-static void
-make_dummy_work(uv_loop_t *loop)
-{
-  int error;
-  uv_work_t *work = (uv_work_t *)malloc(sizeof(*work));
-  assert(work != NULL);
-  error = uv_queue_work(loop, work, dummy_work, dummy_work_done);
-  assert(error == 0);
-}
-
 static void
 on_walk(uv_handle_t *handle, void *arg)
 {
@@ -138,6 +147,7 @@ on_walk(uv_handle_t *handle, void *arg)
 
   if (handle->type == UV_UDP) {
     uv_close(handle, NULL);
+    return;
   }
 
   if (handle->type == UV_TCP) {
@@ -163,6 +173,7 @@ static void
 on_prepare(uv_prepare_t *handle)
 {
   if (end) {
+    phttp_import_pool_stop(handle->loop);
     uv_walk(handle->loop, on_walk, NULL);
   }
 }
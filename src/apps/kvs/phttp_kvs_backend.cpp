@@ -22,6 +22,7 @@ static uint32_t nworkers;
 static thread_local struct phttp_args thread_args;
 static thread_local http_server_socket_t hss;
 static thread_local http_handoff_server_socket_t hhss;
+static thread_local phttp_stats_server_t pss;
 static thread_local http_server_handoff_data_t *conn_pool;
 static thread_local struct global_config gconf;
 static thread_local uint32_t rr_factor = 0;
@@ -65,8 +66,7 @@ kvs_backend_request_handler(struct http_request *req, struct http_response *res,
     }
 
     if (membuf_avail(&res->body_mem) < val.size()) {
-      printf("Warning: Memory growing occured\n");
-      membuf_grow(&res->body_mem, val.size() - membuf_avail(&res->body_mem));
+      membuf_grow(&res->body_mem, val.size());
     }
 
     memcpy(res->body_mem.begin, val.c_str(), val.size());
@@ -190,14 +190,18 @@ worker_main(void *args)
   error = phttp_handoff_server_init(loop, &hhss);
   assert(error == 0);
 
+  if (thread_args.stats_port != 0) {
+    init_stats_server_conf(&thread_args, &pss);
+    error = phttp_stats_server_init(loop, &pss);
+    assert(error == 0);
+  }
+
   error = start_connect_to_proxy(loop, proxy_addr, proxy_port, id);
   assert(error == 0);
 
   error = init_signal_handling(loop);
   assert(error == 0);
 
-  make_dummy_work(loop);
-
   printf("Starting event loop... using libuv version %s\n",
          uv_version_string());
   uv_run(loop, UV_RUN_DEFAULT);
@@ -207,6 +211,7 @@ worker_main(void *args)
   }
 
   prism_switch_client_destroy(gconf.sw_client);
+  mempool_destroy(gconf.pool);
   free(loop);
 
   return NULL;
@@ -240,6 +245,9 @@ main(int argc, char **argv)
   leveldb::Status status = leveldb::DB::Open(options, dbdir, &db);
   assert(status.ok());
 
+  error = phttp_stats_init();
+  assert(error == 0);
+
   /*
    * Main
    */
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+
+#include <phttp_prof.h>
+
+/*
+ * Offline analyzer of the profiler output. Joins the records of all given
+ * files (export side and import side, possibly from different hosts) per
+ * flow and prints latency percentiles of each stage. Latency of a stage is
+ * the time from the previous record of the same flow. A flow restarts at
+ * PROF_RECEIVE_HTTP_REQ (next request on the keep-alive connection).
+ *
+ * Records of different hosts are aligned with CLOCK_REALTIME, so the
+ * stages crossing the hosts (HANDOFF, CHOWN after the handoff) include
+ * the clock offset between them. Synchronize clocks (e.g. PTP) for
+ * meaningful numbers.
+ */
+
+struct record {
+  uint64_t ts;
+  uint8_t type;
+  uint8_t id;
+};
+
+static std::unordered_map<uint64_t, std::vector<struct record>> flows;
+static std::vector<uint64_t> stage_lat[PROF_NR_IDS];
+static std::vector<uint64_t> total_lat;
+
+static int
+load_file(const char *fname)
+{
+  FILE *f;
+  struct prof_file_header hdr;
+  struct prof_record rec;
+  int64_t offset;
+  uint64_t n = 0;
+
+  f = fopen(fname, "rb");
+  if (f == NULL) {
+    perror(fname);
+    return -1;
+  }
+
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, PROF_FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != PROF_FILE_VERSION) {
+    fprintf(stderr, "%s: not a profiler output\n", fname);
+    fclose(f);
+    return -1;
+  }
+
+  offset = (int64_t)hdr.realtime_ns - (int64_t)hdr.mono_ns;
+
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    uint64_t key = ((uint64_t)rec.peer_addr << 16) | rec.peer_port;
+    struct record r;
+    r.ts = rec.tstamp_ns + offset;
+    r.type = rec.type;
+    r.id = rec.id;
+    flows[key].push_back(r);
+    n++;
+  }
+
+  fprintf(stderr, "%s: pid %u, %lu records\n", fname, hdr.pid, n);
+
+  fclose(f);
+
+  return 0;
+}
+
+static void
+join_flows(void)
+{
+  for (auto &it : flows) {
+    auto &recs = it.second;
+    uint64_t start = 0;
+    bool started = false;
+
+    std::stable_sort(recs.begin(), recs.end(),
+                     [](const struct record &a, const struct record &b) {
+                       return a.ts < b.ts;
+                     });
+
+    for (size_t i = 0; i < recs.size(); i++) {
+      if (recs[i].id >= PROF_NR_IDS) {
+        continue;
+      }
+
+      if (recs[i].id == PROF_RECEIVE_HTTP_REQ) {
+        start = recs[i].ts;
+        started = true;
+        continue;
+      }
+
+      if (!started || i == 0) {
+        continue;
+      }
+
+      stage_lat[recs[i].id].push_back(recs[i].ts - recs[i - 1].ts);
+
+      if (recs[i].id == PROF_HTTP_RES) {
+        total_lat.push_back(recs[i].ts - start);
+        started = false;
+      }
+    }
+  }
+}
+
+static double
+percentile(std::vector<uint64_t> &v, double p)
+{
+  size_t idx = (size_t)(p / 100.0 * (v.size() - 1) + 0.5);
+  return v[idx] / 1000.0;
+}
+
+static void
+print_row(const char *name, std::vector<uint64_t> &v)
+{
+  if (v.empty()) {
+    printf("%-20s %10d\n", name, 0);
+    return;
+  }
+
+  std::sort(v.begin(), v.end());
+  printf("%-20s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, v.size(),
+         percentile(v, 50), percentile(v, 90), percentile(v, 99),
+         percentile(v, 99.9), v.back() / 1000.0);
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s /tmp/prism_prof_<pid>.bin ...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (load_file(argv[i]) != 0) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  join_flows();
+
+  printf("%zu flows, latency in usec\n", flows.size());
+  printf("%-20s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "p50",
+         "p90", "p99", "p99.9", "max");
+
+  for (int i = 0; i < PROF_NR_IDS; i++) {
+    if (i == PROF_RECEIVE_HTTP_REQ) {
+      continue;
+    }
+    print_row(prof_id_name((enum prof_ids)i), stage_lat[i]);
+  }
+
+  print_row("TOTAL", total_lat);
+
+  return 0;
+}
@@ -0,0 +1,250 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <phttp_clock.h>
+#include <tcp_export.h>
+
+/*
+ * Microbenchmark of the TCP repair export and import. Opens connections
+ * on the loopback, optionally leaves data in the receive queue of the
+ * server side, then moves every server side socket to a new socket with
+ * tcp_export_state_into and tcp_import_state, as the handoff does. Prints
+ * the time and the syscalls per export and import. Connections are over
+ * 127.0.0.1, or ::1 with -6. Needs CAP_NET_ADMIN.
+ */
+
+struct conn {
+  int client;
+  int server;
+  struct in6_addr self_addr;
+  uint32_t self_port;
+  struct in6_addr peer_addr;
+  uint32_t peer_port;
+};
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-n connections] [-r recvq bytes] [-u] [-6]\n"
+          "  -u : don't pass the cached addresses to the export\n"
+          "  -6 : connect over IPv6\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+static void
+die(const char *what)
+{
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+static void
+open_conns(std::vector<struct conn> &conns, size_t recvq_len, int family)
+{
+  int l, error;
+  struct sockaddr_storage addr, peer;
+  socklen_t addr_len;
+  struct in6_addr loopback;
+  std::vector<char> data(recvq_len);
+
+  for (size_t i = 0; i < recvq_len; i++) {
+    data[i] = (char)i;
+  }
+
+  l = socket(family, SOCK_STREAM, 0);
+  if (l == -1) {
+    die("socket");
+  }
+
+  if (family == AF_INET) {
+    tcp_addr_set_ipv4(&loopback, htonl(INADDR_LOOPBACK));
+  } else {
+    loopback = in6addr_loopback;
+  }
+
+  addr_len = tcp_addr_to_sockaddr(&loopback, 0, &addr);
+
+  error = bind(l, (struct sockaddr *)&addr, addr_len);
+  if (error == -1) {
+    die("bind");
+  }
+
+  error = listen(l, 1024);
+  if (error == -1) {
+    die("listen");
+  }
+
+  error = getsockname(l, (struct sockaddr *)&addr, &addr_len);
+  if (error == -1) {
+    die("getsockname");
+  }
+
+  for (struct conn &c : conns) {
+    c.client = socket(family, SOCK_STREAM, 0);
+    if (c.client == -1) {
+      die("socket");
+    }
+
+    error = connect(c.client, (struct sockaddr *)&addr, addr_len);
+    if (error == -1) {
+      die("connect");
+    }
+
+    socklen_t peer_len = sizeof(peer);
+    c.server = accept(l, (struct sockaddr *)&peer, &peer_len);
+    if (c.server == -1) {
+      die("accept");
+    }
+
+    tcp_addr_from_sockaddr((struct sockaddr *)&addr, &c.self_addr,
+                           &c.self_port);
+    tcp_addr_from_sockaddr((struct sockaddr *)&peer, &c.peer_addr,
+                           &c.peer_port);
+
+    if (recvq_len != 0 &&
+        write(c.client, data.data(), recvq_len) != (ssize_t)recvq_len) {
+      die("write");
+    }
+  }
+
+  /*
+   * The imported sockets bind to the listening port. Repair mode forces
+   * the reuse, but there is no point in keeping the listener anyway.
+   */
+  close(l);
+}
+
+/*
+ * The moved socket must deliver the receive queue and carry new data
+ */
+static void
+check_conn(const struct conn &c, size_t recvq_len)
+{
+  ssize_t ret;
+  std::vector<char> buf(recvq_len + 1);
+
+  if (recvq_len != 0) {
+    ret = recv(c.server, buf.data(), recvq_len, MSG_WAITALL);
+    if (ret != (ssize_t)recvq_len) {
+      die("recv");
+    }
+
+    for (size_t i = 0; i < recvq_len; i++) {
+      if (buf[i] != (char)i) {
+        fprintf(stderr, "receive queue corrupted at %zu\n", i);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (write(c.server, "x", 1) != 1 || read(c.client, buf.data(), 1) != 1 ||
+      buf[0] != 'x') {
+    die("ping");
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int opt, error, sock, family = AF_INET;
+  size_t nconns = 1000, recvq_len = 0;
+  bool cached = true;
+  uint64_t start, export_ns = 0, import_ns = 0;
+  struct tcp_state state;
+  struct tcp_export_opts eopts;
+  struct tcp_export_counters counters;
+
+  while ((opt = getopt(argc, argv, "n:r:u6")) != -1) {
+    switch (opt) {
+    case 'n':
+      nconns = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      recvq_len = strtoul(optarg, NULL, 0);
+      break;
+    case 'u':
+      cached = false;
+      break;
+    case '6':
+      family = AF_INET6;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (nconns == 0) {
+    usage(argv[0]);
+  }
+
+  std::vector<struct conn> conns(nconns);
+  open_conns(conns, recvq_len, family);
+
+  for (struct conn &c : conns) {
+    memset(&eopts, 0, sizeof(eopts));
+    if (cached) {
+      eopts.self_addr = c.self_addr;
+      eopts.self_port = c.self_port;
+      eopts.peer_addr = c.peer_addr;
+      eopts.peer_port = c.peer_port;
+    }
+
+    start = phttp_clock_ns();
+    error = tcp_export_state_into(c.server, &state, &eopts);
+    export_ns += phttp_clock_ns() - start;
+    if (error != 0) {
+      errno = error;
+      die("tcp_export_state_into");
+    }
+
+    /*
+     * Closing in the repair mode doesn't send anything to the peer
+     */
+    close(c.server);
+
+    sock = socket(family, SOCK_STREAM, 0);
+    if (sock == -1) {
+      die("socket");
+    }
+
+    start = phttp_clock_ns();
+    error = tcp_import_state(sock, &state);
+    import_ns += phttp_clock_ns() - start;
+    if (error != 0) {
+      errno = error;
+      die("tcp_import_state");
+    }
+
+    tcp_state_release(&state);
+    c.server = sock;
+
+    check_conn(c, recvq_len);
+  }
+
+  tcp_export_get_counters(&counters);
+
+  printf("connections: %zu, recvq: %zu bytes, addresses: %s, %s\n", nconns,
+         recvq_len, cached ? "cached" : "queried",
+         family == AF_INET ? "IPv4" : "IPv6");
+  printf("%-8s %10s %10s\n", "", "ns/conn", "syscalls");
+  printf("%-8s %10.1f %10.2f\n", "export", (double)export_ns / nconns,
+         (double)counters.export_syscalls / counters.nexports);
+  printf("%-8s %10.1f %10.2f\n", "import", (double)import_ns / nconns,
+         (double)counters.import_syscalls / counters.nimports);
+
+  for (struct conn &c : conns) {
+    close(c.client);
+    close(c.server);
+  }
+
+  return 0;
+}
@@ -34,6 +34,22 @@
 #include <x86intrin.h>
 #endif
 #endif
+
+/*
+ * Prism: the parser is built once per ISA level (see the Makefile) and
+ * picked at run time, PHR_VARIANT gives the entry points of a variant
+ * their own names, e.g. phr_parse_request_avx2.
+ */
+#ifdef PHR_VARIANT
+#define PHR_CAT2(a, b) a##_##b
+#define PHR_CAT(a, b) PHR_CAT2(a, b)
+#define phr_parse_request PHR_CAT(phr_parse_request, PHR_VARIANT)
+#define phr_parse_response PHR_CAT(phr_parse_response, PHR_VARIANT)
+#define phr_parse_headers PHR_CAT(phr_parse_headers, PHR_VARIANT)
+#define phr_decode_chunked PHR_CAT(phr_decode_chunked, PHR_VARIANT)
+#define phr_decode_chunked_is_in_data PHR_CAT(phr_decode_chunked_is_in_data, PHR_VARIANT)
+#endif
+
 #include "picohttpparser.h"
 
 /* $Id$ */
@@ -73,9 +89,9 @@
 #define ADVANCE_TOKEN(tok, toklen)                                                                                                 \
     do {                                                                                                                           \
         const char *tok_start = buf;                                                                                               \
-        static const char ALIGNED(16) ranges2[] = "\000\040\177\177";                                                              \
+        static const char ALIGNED(16) ranges2[16] = "\000\040\177\177";                                                            \
         int found2;                                                                                                                \
-        buf = findchar_fast(buf, buf_end, ranges2, sizeof(ranges2) - 1, &found2);                                                  \
+        buf = findchar_fast(buf, buf_end, ranges2, 4, &found2);                                                                    \
         if (!found2) {                                                                                                             \
             CHECK_EOF();                                                                                                           \
         }                                                                                                                          \
@@ -104,9 +120,49 @@ static const char *token_char_map = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
 
-static const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+#if __AVX2__
+/*
+ * Prism: 32 bytes at a time. There is no AVX2 version of pcmpestri, so each
+ * range is matched with a subtract and an unsigned compare. ranges are
+ * constant at the call sites, the loop over them is unrolled. Worth it only
+ * for a few ranges (token and header value), header names (8 ranges) stay
+ * with pcmpestri.
+ */
+static inline int findchar_avx2_mask(__m256i b32, const char *ranges, size_t ranges_size)
+{
+    __m256i hit = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i < ranges_size; i += 2) {
+        __m256i lo = _mm256_set1_epi8(ranges[i]);
+        __m256i span = _mm256_set1_epi8((char)(ranges[i + 1] - ranges[i]));
+        __m256i ofs = _mm256_sub_epi8(b32, lo);
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_min_epu8(ofs, span), ofs));
+    }
+
+    return _mm256_movemask_epi8(hit);
+}
+
+/* Prism: inlined so that the ranges become constants */
+#define FINDCHAR_FAST_INLINE inline __attribute__((always_inline))
+#else
+#define FINDCHAR_FAST_INLINE
+#endif
+
+static FINDCHAR_FAST_INLINE const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
 {
     *found = 0;
+#if __AVX2__
+    while (ranges_size <= 6 && likely(buf_end - buf >= 32)) {
+        int mask = findchar_avx2_mask(_mm256_loadu_si256((const __m256i *)buf), ranges, ranges_size);
+        if (unlikely(mask != 0)) {
+            buf += __builtin_ctz(mask);
+            *found = 1;
+            return buf;
+        }
+        buf += 32;
+    }
+#endif
 #if __SSE4_2__
     if (likely(buf_end - buf >= 16)) {
         __m128i ranges16 = _mm_loadu_si128((const __m128i *)ranges);
@@ -138,7 +194,7 @@ static const char *get_token_to_eol(const char *buf, const char *buf_end, const
     const char *token_start = buf;
 
 #ifdef __SSE4_2__
-    static const char ranges1[] = "\0\010"
+    static const char ALIGNED(16) ranges1[16] = "\0\010"
                                   /* allow HT */
                                   "\012\037"
                                   /* allow SP and up to but not including DEL */
@@ -146,7 +202,7 @@ static const char *get_token_to_eol(const char *buf, const char *buf_end, const
         /* allow chars w. MSB set */
         ;
     int found;
-    buf = findchar_fast(buf, buf_end, ranges1, sizeof(ranges1) - 1, &found);
+    buf = findchar_fast(buf, buf_end, ranges1, 6, &found);
     if (found)
         goto FOUND_CTL;
 #else
@@ -287,7 +343,7 @@ static const char *parse_headers(const char *buf, const char *buf_end, struct ph
             /* parsing name, but do not discard SP before colon, see
              * http://www.mozilla.org/security/announce/2006/mfsa2006-33.html */
             headers[*num_headers].name = buf;
-            static const char ALIGNED(16) ranges1[] = "\x00 "  /* control chars and up to SP */
+            static const char ALIGNED(16) ranges1[16] = "\x00 "  /* control chars and up to SP */
                                                       "\"\""   /* 0x22 */
                                                       "()"     /* 0x28,0x29 */
                                                       ",,"     /* 0x2c */
@@ -296,7 +352,7 @@ static const char *parse_headers(const char *buf, const char *buf_end, struct ph
                                                       "[]"     /* 0x5b-0x5d */
                                                       "{\377"; /* 0x7b-0xff */
             int found;
-            buf = findchar_fast(buf, buf_end, ranges1, sizeof(ranges1) - 1, &found);
+            buf = findchar_fast(buf, buf_end, ranges1, 16, &found);
             if (!found) {
                 CHECK_EOF();
             }
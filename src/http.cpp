@@ -1,13 +1,19 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <strings.h>
 #include <cassert>
 #include <algorithm>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <extern/picohttpparser.h>
 #include <uv.h>
 
 #include <http.h>
+#include <http_parser.h>
 
 void
 http_header_reset(struct http_header *header)
@@ -19,22 +25,35 @@ http_header_reset(struct http_header *header)
 }
 
 int
-http_request_init(struct http_request *req)
+http_request_init(struct http_request *req, struct mempool *pool)
 {
-  membuf_init(&req->mem, 5000000);
+  membuf_init_pool(&req->mem, pool, HTTP_REQ_MEM_SIZE);
+  req->ofs = 0;
+  req->len = 0;
+  req->header_len = 0;
   req->minor_version = 0;
   req->method = NULL;
   req->method_len = 0;
   req->path = NULL;
   req->path_len = 0;
 
-  for (uint32_t i = 0; i < HTTP_HEADERS_MAX; i++) {
+  req->headers = req->headers_inline;
+  req->headers_cap = HTTP_HEADERS_INLINE;
+  req->max_headers = HTTP_HEADERS_DEFAULT;
+
+  for (uint32_t i = 0; i < HTTP_HEADERS_INLINE; i++) {
     http_header_reset(req->headers + i);
   }
 
-  req->nheaders = HTTP_HEADERS_MAX;
+  req->nheaders = 0;
+  memset(req->header_index, 0, sizeof(req->header_index));
   req->body = NULL;
   req->body_len = 0;
+  req->body_recv = 0;
+  req->chunked = false;
+  req->body_pending = false;
+  req->body_cb = NULL;
+  req->body_data = NULL;
 
   return 0;
 }
@@ -42,35 +61,386 @@ http_request_init(struct http_request *req)
 void
 http_request_deinit(struct http_request *req)
 {
+  if (req->headers != req->headers_inline) {
+    mempool_free(req->mem.pool, req->headers,
+                 req->headers_cap * sizeof(*req->headers));
+  }
+
   membuf_deinit(&req->mem);
 }
 
+/*
+ * Move the request into another struct (e.g. from a temporary one into
+ * the client socket). src must not be used afterwards.
+ */
+void
+http_request_move(struct http_request *dst, struct http_request *src)
+{
+  memcpy(dst, src, sizeof(*dst));
+
+  if (src->headers == src->headers_inline) {
+    dst->headers = dst->headers_inline;
+  }
+}
+
+/*
+ * Limit of the headers of a request, 0 for the default. Requests with
+ * more headers fail to parse.
+ */
+void
+http_request_set_max_headers(struct http_request *req, uint64_t max)
+{
+  if (max == 0) {
+    max = HTTP_HEADERS_DEFAULT;
+  }
+
+  req->max_headers = std::min(max, (uint64_t)HTTP_HEADERS_MAX);
+}
+
+/*
+ * Make room for n headers. The headers parsed so far are kept, the
+ * larger array stays with the request until it is deinitialized.
+ */
+int
+http_request_reserve_headers(struct http_request *req, uint64_t n)
+{
+  struct http_header *headers;
+
+  if (n <= req->headers_cap) {
+    return 0;
+  }
+
+  if (n > HTTP_HEADERS_MAX) {
+    return -E2BIG;
+  }
+
+  headers = (struct http_header *)mempool_alloc(req->mem.pool,
+                                                n * sizeof(*headers));
+  assert(headers != NULL);
+  memcpy(headers, req->headers, req->nheaders * sizeof(*headers));
+
+  if (req->headers != req->headers_inline) {
+    mempool_free(req->mem.pool, req->headers,
+                 req->headers_cap * sizeof(*req->headers));
+  }
+
+  req->headers = headers;
+  req->headers_cap = n;
+
+  return 0;
+}
+
 void
 http_request_reset(struct http_request *req)
 {
   membuf_reset(&req->mem);
+  req->ofs = 0;
+  req->len = 0;
+  req->header_len = 0;
   req->minor_version = 0;
   req->method = NULL;
   req->method_len = 0;
   req->path = NULL;
   req->path_len = 0;
 
-  for (uint32_t i = 0; i < HTTP_HEADERS_MAX; i++) {
+  for (uint64_t i = 0; i < req->nheaders; i++) {
     http_header_reset(req->headers + i);
   }
 
-  req->nheaders = HTTP_HEADERS_MAX;
+  req->nheaders = 0;
+  memset(req->header_index, 0, sizeof(req->header_index));
   req->body = NULL;
   req->body_len = 0;
+  req->body_recv = 0;
+  req->chunked = false;
+  req->body_pending = false;
+  req->body_cb = NULL;
+  req->body_data = NULL;
+}
+
+static void
+http_request_rebase(struct http_request *req, ptrdiff_t delta)
+{
+#define REBASE(_ptr)                                                           \
+  if ((_ptr) != NULL) {                                                        \
+    (_ptr) += delta;                                                           \
+  }
+
+  REBASE(req->method);
+  REBASE(req->path);
+  REBASE(req->body);
+
+  for (uint32_t i = 0; i < req->nheaders; i++) {
+    REBASE(req->headers[i].name);
+    REBASE(req->headers[i].val);
+  }
+
+#undef REBASE
+}
+
+/*
+ * Grow the request buffer. Since the buffer may move, all pointers
+ * to the parsed request are rebased to the new buffer.
+ */
+void
+http_request_grow(struct http_request *req, size_t grow_size)
+{
+  char *old_begin = req->mem.begin;
+  ptrdiff_t delta;
+
+  membuf_grow(&req->mem, grow_size);
+
+  delta = req->mem.begin - old_begin;
+  if (delta == 0) {
+    return;
+  }
+
+  http_request_rebase(req, delta);
+}
+
+/*
+ * Move the current request (and the pipelined ones after it) to the
+ * beginning of the buffer. Only done when the buffer runs out of room,
+ * not for every request.
+ */
+void
+http_request_compact(struct http_request *req)
+{
+  struct membuf *mem = &req->mem;
+  char *start = mem->begin + req->ofs;
+  ptrdiff_t prev_ofs = mem->prev - start;
+
+  if (req->ofs == 0) {
+    return;
+  }
+
+  memmove(mem->begin, start, mem->cur - start);
+  mem->cur -= req->ofs;
+  mem->prev = prev_ofs < 0 ? mem->begin : mem->begin + prev_ofs;
+
+  http_request_rebase(req, -(ptrdiff_t)req->ofs);
+  req->ofs = 0;
+}
+
+/*
+ * Make sure there is room for size more bytes
+ */
+void
+http_request_reserve(struct http_request *req, size_t size)
+{
+  if (membuf_avail(&req->mem) >= size) {
+    return;
+  }
+
+  http_request_compact(req);
+
+  if (membuf_avail(&req->mem) < size) {
+    http_request_grow(req, size);
+  }
+}
+
+/*
+ * Done with the current request, move on to the next pipelined one.
+ * The buffer is rewound only when nothing is left in it.
+ */
+void
+http_request_next(struct http_request *req)
+{
+  struct membuf *mem = &req->mem;
+
+  req->ofs += req->len;
+  assert(req->ofs <= membuf_used(mem));
+
+  if (req->ofs == membuf_used(mem)) {
+    membuf_reset(mem);
+    req->ofs = 0;
+  }
+
+  req->len = 0;
+  req->header_len = 0;
+  req->minor_version = 0;
+  req->method = NULL;
+  req->method_len = 0;
+  req->path = NULL;
+  req->path_len = 0;
+
+  for (uint64_t i = 0; i < req->nheaders; i++) {
+    http_header_reset(req->headers + i);
+  }
+
+  req->nheaders = 0;
+  memset(req->header_index, 0, sizeof(req->header_index));
+  req->body = NULL;
+  req->body_len = 0;
+  req->body_recv = 0;
+  req->chunked = false;
+  req->body_pending = false;
+  req->body_cb = NULL;
+  req->body_data = NULL;
+}
+
+/*
+ * Names of the well-known headers by the perfect hash below, NULL
+ * for the unused slots.
+ */
+#define HTTP_HDR_HASH_SIZE 32
+
+static const struct {
+  const char *name;
+  uint32_t len;
+  enum http_header_id id;
+} known_headers[HTTP_HDR_HASH_SIZE] = {
+  /*  0 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /*  1 */ {"If-None-Match", 13, HTTP_HDR_IF_NONE_MATCH},
+  /*  2 */ {"Cookie", 6, HTTP_HDR_COOKIE},
+  /*  3 */ {"Connection", 10, HTTP_HDR_CONNECTION},
+  /*  4 */ {"Host", 4, HTTP_HDR_HOST},
+  /*  5 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /*  6 */ {"Content-Type", 12, HTTP_HDR_CONTENT_TYPE},
+  /*  7 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /*  8 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /*  9 */ {"Transfer-Encoding", 17, HTTP_HDR_TRANSFER_ENCODING},
+  /* 10 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 11 */ {"Accept", 6, HTTP_HDR_ACCEPT},
+  /* 12 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 13 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 14 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 15 */ {"Authorization", 13, HTTP_HDR_AUTHORIZATION},
+  /* 16 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 17 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 18 */ {"Keep-Alive", 10, HTTP_HDR_KEEP_ALIVE},
+  /* 19 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 20 */ {"Accept-Encoding", 15, HTTP_HDR_ACCEPT_ENCODING},
+  /* 21 */ {"Content-Length", 14, HTTP_HDR_CONTENT_LENGTH},
+  /* 22 */ {"If-Modified-Since", 17, HTTP_HDR_IF_MODIFIED_SINCE},
+  /* 23 */ {"Expect", 6, HTTP_HDR_EXPECT},
+  /* 24 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 25 */ {"Range", 5, HTTP_HDR_RANGE},
+  /* 26 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 27 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 28 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 29 */ {NULL, 0, HTTP_HDR_NKNOWN},
+  /* 30 */ {"Upgrade", 7, HTTP_HDR_UPGRADE},
+  /* 31 */ {"User-Agent", 10, HTTP_HDR_USER_AGENT},
+};
+
+/*
+ * Collision free for the names above. Letters are folded to lower case
+ * by setting 0x20, other bytes only make a miss.
+ */
+static inline uint32_t
+header_hash(const char *name, uint64_t len)
+{
+  uint32_t first = (unsigned char)name[0] | 0x20;
+  uint32_t last = (unsigned char)name[len - 1] | 0x20;
+
+  return (len * 6 + first * 19 + last) & (HTTP_HDR_HASH_SIZE - 1);
+}
+
+#ifdef __SSE2__
+/*
+ * Lower case the ASCII letters of 16 bytes
+ */
+static inline __m128i
+fold16(__m128i v)
+{
+  __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - 'A')));
+  __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + 26)));
+  return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+/*
+ * Case-insensitive comparison of two header names of the same length.
+ * Compares 16 bytes at a time, the tail goes through a zero padded
+ * copy so that nothing past the names is read.
+ */
+static inline bool
+header_name_eq(const char *a, const char *b, uint64_t len)
+{
+#ifdef __SSE2__
+  __m128i va, vb;
+  char ta[16], tb[16];
+
+  for (; len >= 16; a += 16, b += 16, len -= 16) {
+    va = fold16(_mm_loadu_si128((const __m128i *)a));
+    vb = fold16(_mm_loadu_si128((const __m128i *)b));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) {
+      return false;
+    }
+  }
+
+  if (len == 0) {
+    return true;
+  }
+
+  memset(ta, 0, sizeof(ta));
+  memset(tb, 0, sizeof(tb));
+  memcpy(ta, a, len);
+  memcpy(tb, b, len);
+  va = fold16(_mm_loadu_si128((const __m128i *)ta));
+  vb = fold16(_mm_loadu_si128((const __m128i *)tb));
+
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xffff;
+#else
+  return strncasecmp(a, b, len) == 0;
+#endif
+}
+
+/*
+ * Returns the id of a well-known header name, -1 for the others
+ */
+int
+http_header_lookup_id(const char *name, uint64_t name_len)
+{
+  uint32_t h;
+
+  if (name_len == 0) {
+    return -1;
+  }
+
+  h = header_hash(name, name_len);
+  if (known_headers[h].name == NULL || known_headers[h].len != name_len ||
+      !header_name_eq(known_headers[h].name, name, name_len)) {
+    return -1;
+  }
+
+  return known_headers[h].id;
+}
+
+/*
+ * Record the first header of each well-known name. Done once the
+ * headers are parsed (or imported), the index survives the buffer
+ * moving since it refers to the header table.
+ */
+void
+http_request_index_headers(struct http_request *req)
+{
+  int id;
+
+  memset(req->header_index, 0, sizeof(req->header_index));
+
+  for (uint64_t i = req->nheaders; i-- > 0;) {
+    id = http_header_lookup_id(req->headers[i].name, req->headers[i].name_len);
+    if (id >= 0) {
+      req->header_index[id] = i + 1;
+    }
+  }
 }
 
 struct http_header *
 http_request_find_header(struct http_request *req, const char *name,
-    uint64_t name_len)
+                         uint64_t name_len)
 {
-  for (uint32_t i = 0; i < req->nheaders; i++) {
-    if (strncmp(req->headers[i].name, name,
-                std::min(req->headers[i].name_len, name_len)) == 0) {
+  int id = http_header_lookup_id(name, name_len);
+
+  if (id >= 0) {
+    return http_request_get_header(req, (enum http_header_id)id);
+  }
+
+  for (uint64_t i = 0; i < req->nheaders; i++) {
+    if (req->headers[i].name_len == name_len &&
+        header_name_eq(req->headers[i].name, name, name_len)) {
       return req->headers + i;
     }
   }
@@ -78,37 +448,185 @@ http_request_find_header(struct http_request *req, const char *name,
   return NULL;
 }
 
-uint64_t
-http_request_determine_body_len(struct http_request *req)
+/*
+ * Next header of the same name as h, for the repeated ones
+ */
+struct http_header *
+http_request_next_header(struct http_request *req, struct http_header *h)
 {
-  char *endptr;
-  struct http_header *h = http_request_find_header(req, "Content-Length", 14);
-  uint64_t ret;
-  
+  for (struct http_header *n = h + 1; n < req->headers + req->nheaders; n++) {
+    if (n->name_len == h->name_len &&
+        header_name_eq(n->name, h->name, h->name_len)) {
+      return n;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Content-Length, 0 without one. Only plain decimal digits are taken,
+ * -1 is returned for anything else. Values that don't fit are reported
+ * as UINT64_MAX, they are over any limit anyway.
+ */
+int
+http_request_determine_body_len(struct http_request *req, uint64_t *len)
+{
+  struct http_header *h = http_request_get_header(req, HTTP_HDR_CONTENT_LENGTH);
+  uint64_t val = 0, digit;
+
+  *len = 0;
+
   if (h == NULL) {
     return 0;
   }
 
-  ret = strtoll(h->val, &endptr, 0);
+  if (h->val_len == 0) {
+    return -1;
+  }
 
-  if (endptr != h->val + h->val_len) {
-    return 0;
+  for (uint64_t i = 0; i < h->val_len; i++) {
+    if (h->val[i] < '0' || h->val[i] > '9') {
+      return -1;
+    }
+
+    digit = h->val[i] - '0';
+    if (val > (UINT64_MAX - digit) / 10) {
+      val = UINT64_MAX;
+    } else {
+      val = val * 10 + digit;
+    }
   }
 
-  return ret;
+  *len = val;
+
+  return 0;
+}
+
+/*
+ * Transfer-Encoding overrides Content-Length. Only chunked as the sole
+ * (or final) coding is understood, others are left to the handler.
+ */
+bool
+http_request_is_chunked(struct http_request *req)
+{
+  struct http_header *h =
+      http_request_get_header(req, HTTP_HDR_TRANSFER_ENCODING);
+
+  return h != NULL && h->val_len >= 7 &&
+         strncasecmp(h->val + h->val_len - 7, "chunked", 7) == 0;
+}
+
+/*
+ * Body starts right after the headers, empty until decoded
+ */
+void
+http_request_start_chunked(struct http_request *req)
+{
+  memset(&req->chunked_decoder, 0, sizeof(req->chunked_decoder));
+  req->chunked_decoder.consume_trailer = 1;
+  req->chunked = true;
+  req->body = req->mem.begin + req->ofs + req->header_len;
+  req->body_len = 0;
 }
 
+/*
+ * Decode what has arrived of a chunked body in place, right after the
+ * part decoded so far. data and len tell the newly decoded bytes.
+ * Returns 0 when the body is complete, -2 when more is needed and -1
+ * on malformed input. Bytes after the body (the next pipelined request)
+ * are moved to follow the decoded body.
+ */
 int
-http_response_init(struct http_response *res)
+http_request_decode_chunked(struct http_request *req, char **data,
+                            uint64_t *len)
+{
+  struct membuf *mem = &req->mem;
+  char *raw = req->body + req->body_len;
+  size_t size = mem->cur - raw;
+  ssize_t ret;
+
+  ret = phr_decode_chunked(&req->chunked_decoder, raw, &size);
+  if (ret == -1) {
+    return -1;
+  }
+
+  *data = raw;
+  *len = size;
+  req->body_len += size;
+
+  /*
+   * Buffer shrank, positions of the last parse are gone
+   */
+  mem->cur = raw + size + (ret >= 0 ? ret : 0);
+  mem->prev = mem->begin;
+
+  return ret >= 0 ? 0 : -2;
+}
+
+/*
+ * Drop the first len bytes of the body (already passed to body_cb),
+ * the rest of the buffer moves down.
+ */
+void
+http_request_drop_body(struct http_request *req, uint64_t len)
+{
+  struct membuf *mem = &req->mem;
+  char *rest = req->body + len;
+
+  assert(rest <= mem->cur);
+
+  memmove(req->body, rest, mem->cur - rest);
+  mem->cur -= len;
+  mem->prev = mem->begin;
+}
+
+/*
+ * HTTP/1.1 connections are persistent unless the client says close,
+ * HTTP/1.0 ones only when the client asks for keep-alive.
+ */
+bool
+http_request_keep_alive(struct http_request *req)
 {
-  membuf_init(&res->mem, 4096);
-  membuf_init(&res->body_mem, 5000000);
+  struct http_header *h = http_request_get_header(req, HTTP_HDR_CONNECTION);
+
+  for (; h != NULL; h = http_request_next_header(req, h)) {
+    if (h->val_len == 5 && strncasecmp(h->val, "close", 5) == 0) {
+      return false;
+    }
+
+    if (h->val_len == 10 && strncasecmp(h->val, "keep-alive", 10) == 0) {
+      return true;
+    }
+  }
+
+  return req->minor_version >= 1;
+}
+
+int
+http_response_init(struct http_response *res, struct mempool *pool)
+{
+  membuf_init_pool(&res->mem, pool, HTTP_RES_MEM_SIZE);
+  membuf_init_pool(&res->body_mem, pool, HTTP_RES_BODY_MEM_SIZE);
   res->status = 0;
   res->reason = "Uninitialized";
-  for (uint32_t i = 0; i < HTTP_HEADERS_MAX; i++) {
+  res->headers = res->headers_inline;
+  res->headers_cap = HTTP_HEADERS_INLINE;
+  for (uint32_t i = 0; i < HTTP_HEADERS_INLINE; i++) {
     http_header_reset(res->headers + i);
   }
   res->nheaders = 0;
+  res->header_set = NULL;
+  res->body_kind = HTTP_BODY_MEM;
+  res->body_fd = -1;
+  res->body_shared = NULL;
+  res->body_ofs = 0;
+  res->body_len = 0;
+  res->chunked = false;
+  res->chunked_done = false;
+  res->stream_cb = NULL;
+  res->stream_data = NULL;
+  res->conn = NULL;
   res->after_res = NULL;
   return 0;
 }
@@ -116,8 +634,29 @@ http_response_init(struct http_response *res)
 void
 http_response_deinit(struct http_response *res)
 {
+  if (res->headers != res->headers_inline) {
+    mempool_free(res->mem.pool, res->headers,
+                 res->headers_cap * sizeof(*res->headers));
+  }
+
   membuf_deinit(&res->mem);
   membuf_deinit(&res->body_mem);
+  if (res->body_shared != NULL) {
+    http_shared_buf_unref(res->body_shared);
+  }
+}
+
+/*
+ * Same as http_request_move
+ */
+void
+http_response_move(struct http_response *dst, struct http_response *src)
+{
+  memcpy(dst, src, sizeof(*dst));
+
+  if (src->headers == src->headers_inline) {
+    dst->headers = dst->headers_inline;
+  }
 }
 
 void
@@ -127,10 +666,23 @@ http_response_reset(struct http_response *res)
   membuf_reset(&res->body_mem);
   res->status = 0;
   res->reason = "Uninitialized";
-  for (uint32_t i = 0; i < HTTP_HEADERS_MAX; i++) {
+  for (uint64_t i = 0; i < res->nheaders; i++) {
     http_header_reset(res->headers + i);
   }
   res->nheaders = 0;
+  res->header_set = NULL;
+  if (res->body_shared != NULL) {
+    http_shared_buf_unref(res->body_shared);
+  }
+  res->body_kind = HTTP_BODY_MEM;
+  res->body_fd = -1;
+  res->body_shared = NULL;
+  res->body_ofs = 0;
+  res->body_len = 0;
+  res->chunked = false;
+  res->chunked_done = false;
+  res->stream_cb = NULL;
+  res->stream_data = NULL;
   res->after_res = NULL;
 }
 
@@ -138,8 +690,22 @@ int
 http_response_add_header(struct http_response *res, char *name,
                          uint64_t name_len, char *val, uint64_t val_len)
 {
-  if (res->nheaders == HTTP_HEADERS_MAX) {
-    return -EBUSY;
+  struct http_header *headers;
+
+  /*
+   * Out of the inline array, move to the largest one at once
+   */
+  if (res->nheaders == res->headers_cap) {
+    if (res->headers_cap == HTTP_HEADERS_MAX) {
+      return -EBUSY;
+    }
+
+    headers = (struct http_header *)mempool_alloc(
+        res->mem.pool, HTTP_HEADERS_MAX * sizeof(*headers));
+    assert(headers != NULL);
+    memcpy(headers, res->headers, res->nheaders * sizeof(*headers));
+    res->headers = headers;
+    res->headers_cap = HTTP_HEADERS_MAX;
   }
 
   res->headers[res->nheaders].name = name;
@@ -151,16 +717,267 @@ http_response_add_header(struct http_response *res, char *name,
   return 0;
 }
 
+/*
+ * Body is len bytes of fd from ofs. Replaces whatever is in body_mem.
+ */
+void
+http_response_set_body_file(struct http_response *res, int fd, uint64_t ofs,
+                            uint64_t len)
+{
+  if (res->body_shared != NULL) {
+    http_shared_buf_unref(res->body_shared);
+    res->body_shared = NULL;
+  }
+
+  res->body_kind = HTTP_BODY_FILE;
+  res->body_fd = fd;
+  res->body_ofs = ofs;
+  res->body_len = len;
+}
+
+/*
+ * Body is len bytes of sbuf from ofs. Takes a reference of sbuf.
+ */
+void
+http_response_set_body_shared(struct http_response *res,
+                              struct http_shared_buf *sbuf, uint64_t ofs,
+                              uint64_t len)
+{
+  assert(ofs + len <= sbuf->len);
+
+  http_shared_buf_ref(sbuf);
+  if (res->body_shared != NULL) {
+    http_shared_buf_unref(res->body_shared);
+  }
+
+  res->body_kind = HTTP_BODY_SHARED;
+  res->body_fd = -1;
+  res->body_shared = sbuf;
+  res->body_ofs = ofs;
+  res->body_len = len;
+}
+
+uint64_t
+http_response_body_len(struct http_response *res)
+{
+  if (res->body_kind == HTTP_BODY_MEM) {
+    return membuf_used(&res->body_mem);
+  }
+
+  return res->body_len;
+}
+
+/*
+ * Created with a single reference owned by the caller
+ */
+struct http_shared_buf *
+http_shared_buf_create(uint64_t len)
+{
+  struct http_shared_buf *sbuf;
+
+  sbuf = (struct http_shared_buf *)malloc(sizeof(*sbuf) + len);
+  if (sbuf == NULL) {
+    return NULL;
+  }
+
+  sbuf->buf = (char *)(sbuf + 1);
+  sbuf->len = len;
+  sbuf->refcnt = 1;
+
+  return sbuf;
+}
+
+/*
+ * Not atomic, a shared buffer belongs to a single loop
+ */
+void
+http_shared_buf_ref(struct http_shared_buf *sbuf)
+{
+  sbuf->refcnt++;
+}
+
+void
+http_shared_buf_unref(struct http_shared_buf *sbuf)
+{
+  assert(sbuf->refcnt > 0);
+  if (--sbuf->refcnt == 0) {
+    free(sbuf);
+  }
+}
+
+#define STATUS_LINE(_code, _reason)                                            \
+  {                                                                            \
+    _code, _reason,                                                            \
+        "HTTP/1.1 " #_code " " _reason "\r\nServer: Prism\r\n",                \
+        sizeof("HTTP/1.1 " #_code " " _reason "\r\nServer: Prism\r\n") - 1,    \
+        sizeof("HTTP/1.1 " #_code " " _reason "\r\n") - 1                      \
+  }
+
+static const struct http_status_line status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(100, "Continue"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(204, "No Content"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(301, "Moved Permanently"),
+    STATUS_LINE(302, "Found"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(408, "Request Timeout"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(503, "Service Unavailable"),
+};
+
+#undef STATUS_LINE
+
+/*
+ * Returns the pre-rendered status line, or NULL when the handler used a
+ * status or a reason phrase which is not in the table.
+ */
+const struct http_status_line *
+http_status_line_lookup(uint32_t status, const char *reason)
+{
+  const struct http_status_line *sl;
+
+  for (size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+    sl = status_lines + i;
+    if (sl->status != status) {
+      continue;
+    }
+
+    if (reason == sl->reason || strcmp(reason, sl->reason) == 0) {
+      return sl;
+    }
+
+    return NULL;
+  }
+
+  return NULL;
+}
+
+struct http_header_set *
+http_header_set_create(const struct http_header *headers, uint64_t nheaders)
+{
+  uint64_t len = 0;
+  char *p;
+  struct http_header_set *set;
+
+  for (uint64_t i = 0; i < nheaders; i++) {
+    len += headers[i].name_len + 2 + headers[i].val_len + 2;
+  }
+
+  set = (struct http_header_set *)malloc(sizeof(*set) + len);
+  if (set == NULL) {
+    return NULL;
+  }
+
+  set->buf = (char *)(set + 1);
+  set->len = len;
+
+  p = set->buf;
+  for (uint64_t i = 0; i < nheaders; i++) {
+    memcpy(p, headers[i].name, headers[i].name_len);
+    p += headers[i].name_len;
+    memcpy(p, ": ", 2);
+    p += 2;
+    memcpy(p, headers[i].val, headers[i].val_len);
+    p += headers[i].val_len;
+    memcpy(p, "\r\n", 2);
+    p += 2;
+  }
+
+  return set;
+}
+
+void
+http_header_set_destroy(struct http_header_set *set)
+{
+  free(set);
+}
+
+static const char digits2[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/*
+ * Two digits at a time, dst must have room for 20 characters. Returns
+ * the number of characters written, no NUL termination.
+ */
+size_t
+http_u64toa(uint64_t val, char *dst)
+{
+  char tmp[20];
+  char *p = tmp + sizeof(tmp);
+  size_t len;
+
+  while (val >= 100) {
+    p -= 2;
+    memcpy(p, digits2 + (val % 100) * 2, 2);
+    val /= 100;
+  }
+
+  if (val >= 10) {
+    p -= 2;
+    memcpy(p, digits2 + val * 2, 2);
+  } else {
+    *--p = '0' + val;
+  }
+
+  len = tmp + sizeof(tmp) - p;
+  memcpy(dst, p, len);
+
+  return len;
+}
+
+/*
+ * Parse the headers of the current request. Returns the length of the
+ * headers from the beginning of the request, -1 on error, or -2 when
+ * the headers are incomplete.
+ */
+static int
+parse_request(struct http_request *req, char *start, size_t last_len)
+{
+  req->nheaders = req->headers_cap;
+  return http_parser_parse_request(
+      start, req->mem.cur - start, (const char **)&req->method,
+      &req->method_len, (const char **)&req->path, &req->path_len,
+      &req->minor_version, (struct phr_header *)req->headers, &req->nheaders,
+      last_len);
+}
+
 int
 http_parse_request(struct http_request *req)
 {
+  int error, ret;
   struct membuf *mem = &req->mem;
-  req->nheaders = HTTP_HEADERS_MAX;
-  return phr_parse_request(
-      mem->begin, mem->cur - mem->begin, (const char **)&req->method,
-      &req->method_len, (const char **)&req->path, &req->path_len,
-      &req->minor_version, (struct phr_header *)req->headers, &req->nheaders,
-      mem->prev - mem->begin);
+  char *start = mem->begin + req->ofs;
+  size_t last_len = mem->prev > start ? mem->prev - start : 0;
+
+  ret = parse_request(req, start, last_len);
+
+  /*
+   * The parser fails the same way when the headers don't fit, try
+   * again with the room for as many as allowed.
+   */
+  if (ret == -1 && req->headers_cap < req->max_headers) {
+    error = http_request_reserve_headers(req, req->max_headers);
+    assert(error == 0);
+    ret = parse_request(req, start, last_len);
+  }
+
+  if (ret > 0) {
+    http_request_index_headers(req);
+  }
+
+  return ret;
 }
 
 void
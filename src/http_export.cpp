@@ -1,75 +1,223 @@
 #include <http.pb.h>
 
 #include <http.h>
+#include <http_export.h>
+
+static inline bool
+range_ok(uint64_t ofs, uint64_t len, uint64_t buf_len)
+{
+  return ofs <= buf_len && len <= buf_len - ofs;
+}
 
 int
-http_request_export(struct http_request *req, prism::HTTPReq *ex)
+http_request_export_state(struct http_request *req,
+                          struct http_request_state *ex)
 {
   if (req == NULL || ex == NULL) {
     return -EINVAL;
   }
 
   struct membuf *mem = &req->mem;
+  char *start = mem->begin + req->ofs;
 
-  ex->set_buf(mem->begin, mem->cur - mem->begin);
-  ex->set_minor_version(req->minor_version);
-  ex->set_method_ofs(req->method - mem->begin);
-  ex->set_method_len(req->method_len);
-  ex->set_path_ofs(req->path - mem->begin);
-  ex->set_path_len(req->path_len);
+  ex->buf = start;
+  ex->buf_len = mem->cur - start;
+  ex->req_len = req->len;
+  ex->body_pending = req->body_pending;
+  ex->minor_version = req->minor_version;
+  ex->method_ofs = req->method - start;
+  ex->method_len = req->method_len;
+  ex->path_ofs = req->path - start;
+  ex->path_len = req->path_len;
 
-  if (req->body != NULL) {
-    ex->set_body_ofs(req->body - mem->begin);
-    ex->set_body_len(req->body_len);
+  if (req->body_pending) {
+    ex->req_len = req->header_len;
+    ex->body_ofs = req->header_len;
+    ex->body_len = 0;
+  } else if (req->body != NULL) {
+    ex->body_ofs = req->body - start;
+    ex->body_len = req->body_len;
   } else {
-    ex->set_body_ofs(0);
-    ex->set_body_len(0);
+    ex->body_ofs = 0;
+    ex->body_len = 0;
   }
 
-  ex->set_nheaders(req->nheaders);
+  ex->nheaders = req->nheaders;
 
   for (uint64_t i = 0; i < req->nheaders; i++) {
-    prism::HTTPHeader *h = ex->add_headers();
-    h->set_name_ofs(req->headers[i].name - mem->begin);
-    h->set_name_len(req->headers[i].name_len);
-    h->set_val_ofs(req->headers[i].val - mem->begin);
-    h->set_val_len(req->headers[i].val_len);
+    ex->headers[i].name_ofs = req->headers[i].name - start;
+    ex->headers[i].name_len = req->headers[i].name_len;
+    ex->headers[i].val_ofs = req->headers[i].val - start;
+    ex->headers[i].val_len = req->headers[i].val_len;
   }
 
   return 0;
 }
 
 int
-http_request_import(struct http_request *req, const prism::HTTPReq *ex)
+http_request_import_state(struct http_request *req,
+                          const struct http_request_state *ex)
 {
-  if (req == NULL || ex == NULL) {
+  int error;
+
+  if (req == NULL || ex == NULL || ex->nheaders > HTTP_HEADERS_MAX) {
     return -EINVAL;
   }
 
+  if (ex->req_len > ex->buf_len || (ex->body_pending && ex->req_len == 0) ||
+      !range_ok(ex->method_ofs, ex->method_len, ex->buf_len) ||
+      !range_ok(ex->path_ofs, ex->path_len, ex->buf_len) ||
+      !range_ok(ex->body_ofs, ex->body_len, ex->buf_len)) {
+    return -EINVAL;
+  }
+
+  for (uint64_t i = 0; i < ex->nheaders; i++) {
+    if (!range_ok(ex->headers[i].name_ofs, ex->headers[i].name_len,
+                  ex->buf_len) ||
+        !range_ok(ex->headers[i].val_ofs, ex->headers[i].val_len,
+                  ex->buf_len)) {
+      return -EINVAL;
+    }
+  }
+
+  error = http_request_reserve_headers(req, ex->nheaders);
+  if (error != 0) {
+    return error;
+  }
+
   struct membuf *mem = &req->mem;
-  if (membuf_avail(mem) < ex->buf().length()) {
-    fprintf(stderr, "Warning: Memory growing occured\n");
-    membuf_grow(mem, ex->buf().length() - membuf_avail(mem));
+  if (membuf_avail(mem) < ex->buf_len) {
+    membuf_grow(mem, ex->buf_len);
+  }
+
+  memcpy(mem->cur, ex->buf, ex->buf_len);
+  membuf_consume(mem, ex->buf_len);
+
+  /*
+   * Senders which don't know about pipelining don't set req_len, the
+   * whole buffer is the request then.
+   */
+  req->ofs = 0;
+  req->len = ex->req_len != 0 ? ex->req_len : ex->buf_len;
+
+  req->minor_version = ex->minor_version;
+  req->method = mem->begin + ex->method_ofs;
+  req->method_len = ex->method_len;
+  req->path = mem->begin + ex->path_ofs;
+  req->path_len = ex->path_len;
+  req->body = ex->body_len == 0 ? NULL : mem->begin + ex->body_ofs;
+  req->body_len = ex->body_len;
+  req->body_pending = ex->body_pending;
+  req->header_len = ex->body_pending ? ex->req_len : 0;
+  req->nheaders = ex->nheaders;
+
+  for (uint64_t i = 0; i < ex->nheaders; i++) {
+    req->headers[i].name = mem->begin + ex->headers[i].name_ofs;
+    req->headers[i].name_len = ex->headers[i].name_len;
+    req->headers[i].val = mem->begin + ex->headers[i].val_ofs;
+    req->headers[i].val_len = ex->headers[i].val_len;
+  }
+
+  http_request_index_headers(req);
+
+  return 0;
+}
+
+void
+http_request_state_to_proto(const struct http_request_state *st,
+                            prism::HTTPReq *ex)
+{
+  ex->set_buf(st->buf, st->buf_len);
+  ex->set_minor_version(st->minor_version);
+  ex->set_method_ofs(st->method_ofs);
+  ex->set_method_len(st->method_len);
+  ex->set_path_ofs(st->path_ofs);
+  ex->set_path_len(st->path_len);
+  ex->set_body_ofs(st->body_ofs);
+  ex->set_body_len(st->body_len);
+  ex->set_nheaders(st->nheaders);
+  ex->set_req_len(st->req_len);
+  ex->set_body_pending(st->body_pending);
+
+  for (uint64_t i = 0; i < st->nheaders; i++) {
+    prism::HTTPHeader *h = ex->add_headers();
+    h->set_name_ofs(st->headers[i].name_ofs);
+    h->set_name_len(st->headers[i].name_len);
+    h->set_val_ofs(st->headers[i].val_ofs);
+    h->set_val_len(st->headers[i].val_len);
   }
+}
 
-  memcpy(mem->cur, ex->buf().c_str(), ex->buf().size());
-  membuf_consume(mem, ex->buf().size());
+/*
+ * buf of the resulting state points into the protobuf message, so it
+ * must outlive the state.
+ */
+int
+http_request_state_from_proto(const prism::HTTPReq *ex,
+                              struct http_request_state *st)
+{
+  if (ex->nheaders() > HTTP_HEADERS_MAX ||
+      (uint64_t)ex->headers_size() < ex->nheaders()) {
+    return -EINVAL;
+  }
 
-  req->minor_version = ex->minor_version();
-  req->method = mem->begin + ex->method_ofs();
-  req->method_len = ex->method_len();
-  req->path = mem->begin + ex->path_ofs();
-  req->path_len = ex->path_len();
-  req->body = ex->body_len() == 0 ? NULL : mem->begin + ex->body_ofs();
-  req->body_len = ex->body_len();
-  req->nheaders = ex->nheaders();
+  st->buf = ex->buf().c_str();
+  st->buf_len = ex->buf().size();
+  st->minor_version = ex->minor_version();
+  st->method_ofs = ex->method_ofs();
+  st->method_len = ex->method_len();
+  st->path_ofs = ex->path_ofs();
+  st->path_len = ex->path_len();
+  st->body_ofs = ex->body_ofs();
+  st->body_len = ex->body_len();
+  st->nheaders = ex->nheaders();
+  st->req_len = ex->req_len();
+  st->body_pending = ex->body_pending();
 
-  for (uint64_t i = 0; i < ex->nheaders(); i++) {
-    req->headers[i].name = mem->begin + ex->headers(i).name_ofs();
-    req->headers[i].name_len = ex->headers(i).name_len();
-    req->headers[i].val = mem->begin + ex->headers(i).val_ofs();
-    req->headers[i].val_len = ex->headers(i).val_len();
+  for (uint64_t i = 0; i < st->nheaders; i++) {
+    st->headers[i].name_ofs = ex->headers(i).name_ofs();
+    st->headers[i].name_len = ex->headers(i).name_len();
+    st->headers[i].val_ofs = ex->headers(i).val_ofs();
+    st->headers[i].val_len = ex->headers(i).val_len();
   }
 
   return 0;
 }
+
+int
+http_request_export(struct http_request *req, prism::HTTPReq *ex)
+{
+  int error;
+  struct http_request_state st;
+
+  if (ex == NULL) {
+    return -EINVAL;
+  }
+
+  error = http_request_export_state(req, &st);
+  if (error) {
+    return error;
+  }
+
+  http_request_state_to_proto(&st, ex);
+
+  return 0;
+}
+
+int
+http_request_import(struct http_request *req, const prism::HTTPReq *ex)
+{
+  int error;
+  struct http_request_state st;
+
+  if (ex == NULL) {
+    return -EINVAL;
+  }
+
+  error = http_request_state_from_proto(ex, &st);
+  if (error) {
+    return error;
+  }
+
+  return http_request_import_state(req, &st);
+}
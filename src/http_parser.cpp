@@ -0,0 +1,110 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <http_parser.h>
+
+#ifdef PHTTP_PARSER_VARIANTS
+extern "C" {
+int phr_parse_request_sse42(const char *buf, size_t len, const char **method,
+                            size_t *method_len, const char **path,
+                            size_t *path_len, int *minor_version,
+                            struct phr_header *headers, size_t *num_headers,
+                            size_t last_len);
+int phr_parse_request_avx2(const char *buf, size_t len, const char **method,
+                           size_t *method_len, const char **path,
+                           size_t *path_len, int *minor_version,
+                           struct phr_header *headers, size_t *num_headers,
+                           size_t last_len);
+}
+#endif
+
+static const char *isa_names[HTTP_PARSER_NR_ISAS] = {
+  "scalar",
+  "sse42",
+  "avx2",
+};
+
+static enum http_parser_isa current_isa = HTTP_PARSER_SCALAR;
+
+const char *
+http_parser_isa_name(enum http_parser_isa isa)
+{
+  return isa < HTTP_PARSER_NR_ISAS ? isa_names[isa] : "unknown";
+}
+
+/*
+ * Parser of the given ISA level, NULL when it is not built in or the
+ * CPU doesn't support it.
+ */
+http_parse_request_fn_t
+http_parser_get(enum http_parser_isa isa)
+{
+  switch (isa) {
+  case HTTP_PARSER_SCALAR:
+    return phr_parse_request;
+#ifdef PHTTP_PARSER_VARIANTS
+  case HTTP_PARSER_SSE42:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") ? phr_parse_request_sse42 : NULL;
+  case HTTP_PARSER_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? phr_parse_request_avx2 : NULL;
+#endif
+  default:
+    return NULL;
+  }
+}
+
+enum http_parser_isa
+http_parser_current(void)
+{
+  return current_isa;
+}
+
+int
+http_parser_select(enum http_parser_isa isa)
+{
+  http_parse_request_fn_t fn = http_parser_get(isa);
+
+  if (fn == NULL) {
+    return -ENOTSUP;
+  }
+
+  http_parser_parse_request = fn;
+  current_isa = isa;
+
+  return 0;
+}
+
+/*
+ * Runs at the load time, before anything is parsed
+ */
+static http_parse_request_fn_t
+resolve_parser(void)
+{
+  const char *env = getenv("PHTTP_PARSER");
+  int isa;
+
+  if (env != NULL) {
+    for (isa = 0; isa < HTTP_PARSER_NR_ISAS; isa++) {
+      if (strcmp(env, isa_names[isa]) == 0 &&
+          http_parser_get((enum http_parser_isa)isa) != NULL) {
+        current_isa = (enum http_parser_isa)isa;
+        return http_parser_get(current_isa);
+      }
+    }
+  }
+
+  for (isa = HTTP_PARSER_NR_ISAS - 1; isa > HTTP_PARSER_SCALAR; isa--) {
+    if (http_parser_get((enum http_parser_isa)isa) != NULL) {
+      break;
+    }
+  }
+
+  current_isa = (enum http_parser_isa)isa;
+
+  return http_parser_get(current_isa);
+}
+
+http_parse_request_fn_t http_parser_parse_request = resolve_parser();
@@ -2,8 +2,35 @@
 
 #include <membuf.h>
 #include <stdint.h>
+#include <extern/picohttpparser.h>
 
-#define HTTP_HEADERS_MAX 16
+/*
+ * Headers are kept in a small array inside the request (or the response)
+ * and move to a pool allocated one when there are more. The limit of a
+ * request is set by the server (max_headers), HTTP_HEADERS_MAX is the
+ * upper bound of it and of the handoff formats.
+ */
+#define HTTP_HEADERS_INLINE 16
+#define HTTP_HEADERS_DEFAULT 64
+#define HTTP_HEADERS_MAX 128
+
+/*
+ * Initial buffer sizes. Buffers are taken from the per-loop memory pool
+ * and grown to the larger size class only when the request or the response
+ * doesn't fit.
+ */
+#define HTTP_REQ_MEM_SIZE 16384
+#define HTTP_RES_MEM_SIZE 4096
+#define HTTP_RES_BODY_MEM_SIZE 16384
+
+/*
+ * Request body of a known length is made room for at once up to
+ * HTTP_BODY_RESERVE_MAX, the buffer grows with the rest as it arrives.
+ * Bodies longer than the limit of the server (HTTP_BODY_DEFAULT_MAX
+ * unless set) are refused.
+ */
+#define HTTP_BODY_RESERVE_MAX (1UL << 20)
+#define HTTP_BODY_DEFAULT_MAX (64UL << 20)
 
 struct http_header {
   char *name;
@@ -12,41 +39,206 @@ struct http_header {
   uint64_t val_len;
 };
 
+/*
+ * Well-known request headers. They are indexed while parsing, so looking
+ * them up doesn't depend on the number of headers.
+ */
+enum http_header_id {
+  HTTP_HDR_HOST,
+  HTTP_HDR_CONNECTION,
+  HTTP_HDR_KEEP_ALIVE,
+  HTTP_HDR_CONTENT_LENGTH,
+  HTTP_HDR_CONTENT_TYPE,
+  HTTP_HDR_TRANSFER_ENCODING,
+  HTTP_HDR_EXPECT,
+  HTTP_HDR_UPGRADE,
+  HTTP_HDR_ACCEPT,
+  HTTP_HDR_ACCEPT_ENCODING,
+  HTTP_HDR_AUTHORIZATION,
+  HTTP_HDR_COOKIE,
+  HTTP_HDR_USER_AGENT,
+  HTTP_HDR_RANGE,
+  HTTP_HDR_IF_NONE_MATCH,
+  HTTP_HDR_IF_MODIFIED_SINCE,
+  HTTP_HDR_NKNOWN,
+};
+
+struct http_request;
+
+/*
+ * Takes the body incrementally instead of having it buffered. Called
+ * with last set for the final part (which may be empty). Non-zero
+ * return aborts the connection.
+ */
+typedef int (*http_body_cb_t)(struct http_request *req, const char *data,
+                              uint64_t len, bool last);
+
+/*
+ * A request buffer may hold several pipelined requests. The current
+ * request starts at ofs, bytes after its len belong to the next ones.
+ * len is valid once the request (including the body) is complete.
+ *
+ * A chunked body is decoded in place, body and body_len are of the
+ * decoded body. With body_cb set the body is passed on as it arrives
+ * and dropped from the buffer, body is NULL and body_len is the total
+ * length once the request is complete.
+ *
+ * body_pending is set when the request is handed off on its headers,
+ * the body (beyond what is in the buffer) follows on the connection.
+ */
 struct http_request {
   struct membuf mem;
+  uint64_t ofs;
+  uint64_t len;
+  uint64_t header_len;
   int32_t minor_version;
   char *method;
   uint64_t method_len;
   char *path;
   uint64_t path_len;
-  struct http_header headers[HTTP_HEADERS_MAX];
+  struct http_header *headers; /* headers_inline or from the pool */
   uint64_t nheaders;
+  uint64_t headers_cap;
+  uint64_t max_headers;
+  uint16_t header_index[HTTP_HDR_NKNOWN]; /* first one + 1, 0 if absent */
   char *body;
   uint64_t body_len;
+  uint64_t body_recv; /* bytes already passed to body_cb */
+  bool chunked;
+  bool body_pending;
+  struct phr_chunked_decoder chunked_decoder;
+  http_body_cb_t body_cb;
+  void *body_data;
+  struct http_header headers_inline[HTTP_HEADERS_INLINE];
+};
+
+/*
+ * Pre-rendered status line followed by the boiler plate headers. The
+ * first status_len bytes are the status line alone.
+ */
+struct http_status_line {
+  uint32_t status;
+  const char *reason;
+  const char *line;
+  uint32_t len;
+  uint32_t status_len;
 };
 
+/*
+ * Constant headers rendered once ("Name: Value\r\n" ...) and sent as is
+ * with every response which refers to it. Create at start up, the set
+ * must outlive the responses.
+ */
+struct http_header_set {
+  char *buf;
+  uint64_t len;
+};
+
+/*
+ * Read-only buffer shared by many responses without copying, e.g. a
+ * cached object. Each response referring to it holds a reference until
+ * its body is written, so the owner may drop its own reference at any
+ * time.
+ */
+struct http_shared_buf {
+  char *buf;
+  uint64_t len;
+  uint32_t refcnt;
+};
+
+/*
+ * Where the response body comes from. MEM is the default, the body is
+ * in body_mem. FILE is sent with sendfile(2) from body_fd, which is
+ * not closed by the server (use after_res, it runs also when the
+ * connection goes away mid-response). SHARED is written straight from
+ * the shared buffer.
+ */
+enum http_body_kind { HTTP_BODY_MEM, HTTP_BODY_FILE, HTTP_BODY_SHARED };
+
 struct http_response;
 struct http_response {
   struct membuf mem;
   struct membuf body_mem;
   uint32_t status;
   char *reason;
-  struct http_header headers[HTTP_HEADERS_MAX];
+  struct http_header *headers; /* headers_inline or from the pool */
   uint64_t nheaders;
+  uint64_t headers_cap;
+  const struct http_header_set *header_set;
+  enum http_body_kind body_kind;
+  int body_fd;
+  struct http_shared_buf *body_shared;
+  uint64_t body_ofs;
+  uint64_t body_len;
+
+  /*
+   * Chunked streaming (see phttp_stream_begin). conn is the connection
+   * of the response, set by the server.
+   */
+  bool chunked;
+  bool chunked_done;
+  int (*stream_cb)(struct http_response *, int);
+  void *stream_data;
+  void *conn;
   int (*after_res)(struct http_response *);
   void *handoff_data;
+  struct http_header headers_inline[HTTP_HEADERS_INLINE];
 };
 
-int http_request_init(struct http_request *req);
+int http_request_init(struct http_request *req, struct mempool *pool);
 void http_request_deinit(struct http_request *req);
+void http_request_move(struct http_request *dst, struct http_request *src);
+void http_request_set_max_headers(struct http_request *req, uint64_t max);
+int http_request_reserve_headers(struct http_request *req, uint64_t n);
 void http_request_reset(struct http_request *req);
+void http_request_grow(struct http_request *req, size_t grow_size);
+void http_request_compact(struct http_request *req);
+void http_request_reserve(struct http_request *req, size_t size);
+void http_request_next(struct http_request *req);
+bool http_request_keep_alive(struct http_request *req);
 struct http_header *http_request_find_header(struct http_request *req,
-    const char *name,uint64_t name_len);
-uint64_t http_request_determine_body_len(struct http_request *req);
+                                             const char *name,
+                                             uint64_t name_len);
+struct http_header *http_request_next_header(struct http_request *req,
+                                             struct http_header *h);
+void http_request_index_headers(struct http_request *req);
+int http_header_lookup_id(const char *name, uint64_t name_len);
+int http_request_determine_body_len(struct http_request *req, uint64_t *len);
+bool http_request_is_chunked(struct http_request *req);
+void http_request_start_chunked(struct http_request *req);
+int http_request_decode_chunked(struct http_request *req, char **data,
+                                uint64_t *len);
+void http_request_drop_body(struct http_request *req, uint64_t len);
 int http_parse_request(struct http_request *req);
 void http_print_request(struct http_request *req);
-int http_response_init(struct http_response *res);
+int http_response_init(struct http_response *res, struct mempool *pool);
 void http_response_deinit(struct http_response *res);
+void http_response_move(struct http_response *dst, struct http_response *src);
 void http_response_reset(struct http_response *res);
 int http_response_add_header(struct http_response *res, char *name,
                              uint64_t name_len, char *val, uint64_t val_len);
+void http_response_set_body_file(struct http_response *res, int fd,
+                                 uint64_t ofs, uint64_t len);
+void http_response_set_body_shared(struct http_response *res,
+                                   struct http_shared_buf *sbuf, uint64_t ofs,
+                                   uint64_t len);
+uint64_t http_response_body_len(struct http_response *res);
+struct http_shared_buf *http_shared_buf_create(uint64_t len);
+void http_shared_buf_ref(struct http_shared_buf *sbuf);
+void http_shared_buf_unref(struct http_shared_buf *sbuf);
+const struct http_status_line *http_status_line_lookup(uint32_t status,
+                                                       const char *reason);
+struct http_header_set *
+http_header_set_create(const struct http_header *headers, uint64_t nheaders);
+void http_header_set_destroy(struct http_header_set *set);
+size_t http_u64toa(uint64_t val, char *dst);
+
+/*
+ * First header of the well-known name, NULL if the request has none
+ */
+static inline struct http_header *
+http_request_get_header(struct http_request *req, enum http_header_id id)
+{
+  uint16_t i = req->header_index[id];
+  return i == 0 ? NULL : req->headers + i - 1;
+}
@@ -3,5 +3,51 @@
 #include <http.h>
 #include <http.pb.h>
 
+/*
+ * Serialization format independent HTTP request state. All offsets are
+ * relative to buf. On export, buf points to the request's own buffer, so
+ * the request must outlive the state. On import, buf is copied into the
+ * request buffer.
+ *
+ * buf starts at the current request. The first req_len bytes are the
+ * request, the rest are the pipelined requests received after it.
+ *
+ * With body_pending, the request is handed off on its headers alone.
+ * req_len and body_ofs are the length of the headers, body_len is zero
+ * and the rest of buf is the beginning of the body. The importer takes
+ * the rest of the body from the connection.
+ */
+struct http_header_state {
+  uint64_t name_ofs;
+  uint64_t name_len;
+  uint64_t val_ofs;
+  uint64_t val_len;
+};
+
+struct http_request_state {
+  const char *buf;
+  uint64_t buf_len;
+  uint32_t minor_version;
+  uint64_t method_ofs;
+  uint64_t method_len;
+  uint64_t path_ofs;
+  uint64_t path_len;
+  uint64_t body_ofs;
+  uint64_t body_len;
+  uint64_t nheaders;
+  uint64_t req_len;
+  bool body_pending;
+  struct http_header_state headers[HTTP_HEADERS_MAX];
+};
+
+int http_request_export_state(struct http_request *req,
+                              struct http_request_state *ex);
+int http_request_import_state(struct http_request *req,
+                              const struct http_request_state *ex);
+void http_request_state_to_proto(const struct http_request_state *st,
+                                 prism::HTTPReq *ex);
+int http_request_state_from_proto(const prism::HTTPReq *ex,
+                                  struct http_request_state *st);
+
 int http_request_export(struct http_request *req, prism::HTTPReq *ex);
 int http_request_import(struct http_request *req, const prism::HTTPReq *ex);
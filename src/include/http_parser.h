@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <extern/picohttpparser.h>
+
+/*
+ * picohttpparser is built for several ISA levels (PHTTP_PARSER_VARIANTS
+ * in the Makefile, x86-64 only). The best one the CPU supports is
+ * picked at start up, PHTTP_PARSER in the environment (scalar, sse42,
+ * avx2) overrides it. Without the variants only the scalar one exists.
+ */
+enum http_parser_isa {
+  HTTP_PARSER_SCALAR,
+  HTTP_PARSER_SSE42,
+  HTTP_PARSER_AVX2,
+  HTTP_PARSER_NR_ISAS,
+};
+
+typedef int (*http_parse_request_fn_t)(const char *buf, size_t len,
+                                       const char **method,
+                                       size_t *method_len, const char **path,
+                                       size_t *path_len, int *minor_version,
+                                       struct phr_header *headers,
+                                       size_t *num_headers, size_t last_len);
+
+extern http_parse_request_fn_t http_parser_parse_request;
+
+const char *http_parser_isa_name(enum http_parser_isa isa);
+http_parse_request_fn_t http_parser_get(enum http_parser_isa isa);
+enum http_parser_isa http_parser_current(void);
+int http_parser_select(enum http_parser_isa isa);
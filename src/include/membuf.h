@@ -4,12 +4,16 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <assert.h>
+#include <string.h>
+
+#include <mempool.h>
 
 struct membuf {
   char *begin;
   char *cur;
   char *prev;
   char *end;
+  struct mempool *pool;
 };
 
 inline void
@@ -20,6 +24,23 @@ membuf_init(struct membuf *buf, size_t initial_size)
   buf->cur = buf->begin;
   buf->prev = buf->begin;
   buf->end = buf->begin + initial_size;
+  buf->pool = NULL;
+}
+
+/*
+ * Same as membuf_init, but takes the memory from the pool. The buffer
+ * is rounded up to the size class, so it may be larger than requested.
+ */
+inline void
+membuf_init_pool(struct membuf *buf, struct mempool *pool, size_t initial_size)
+{
+  size_t size = mempool_roundup(pool, initial_size);
+  buf->begin = (char *)mempool_alloc(pool, size);
+  assert(buf->begin != NULL);
+  buf->cur = buf->begin;
+  buf->prev = buf->begin;
+  buf->end = buf->begin + size;
+  buf->pool = pool;
 }
 
 inline void
@@ -29,11 +50,17 @@ membuf_init_from_mem(struct membuf *buf, uint8_t *mem, size_t mem_size)
   buf->cur = buf->begin;
   buf->prev = buf->begin;
   buf->end = buf->begin + mem_size;
+  buf->pool = NULL;
 }
 
 inline void
 membuf_deinit(struct membuf *buf)
 {
+  if (buf->pool != NULL) {
+    mempool_free(buf->pool, buf->begin, buf->end - buf->begin);
+    return;
+  }
+
   free(buf->begin);
 }
 
@@ -44,8 +71,25 @@ membuf_grow(struct membuf *buf, size_t grow_size)
   ptrdiff_t prev_ofs = buf->prev - buf->begin;
   size_t new_size = buf->cur - buf->begin + grow_size;
 
-  buf->begin = (char *)realloc(buf->begin, new_size);
-  assert(buf->begin != NULL);
+  if (buf->pool != NULL) {
+    /*
+     * Move to the larger size class. Only the used part is copied.
+     */
+    char *new_begin;
+    new_size = mempool_roundup(buf->pool, new_size);
+    if (new_size <= (size_t)(buf->end - buf->begin)) {
+      return;
+    }
+
+    new_begin = (char *)mempool_alloc(buf->pool, new_size);
+    assert(new_begin != NULL);
+    memcpy(new_begin, buf->begin, cur_ofs);
+    mempool_free(buf->pool, buf->begin, buf->end - buf->begin);
+    buf->begin = new_begin;
+  } else {
+    buf->begin = (char *)realloc(buf->begin, new_size);
+    assert(buf->begin != NULL);
+  }
 
   buf->cur = buf->begin + cur_ofs;
   buf->prev = buf->begin + prev_ofs;
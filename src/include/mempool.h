@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Per-loop, size-classed memory pool. Blocks are rounded up to the power
+ * of two size class and recycled through per-class free lists instead of
+ * going back to malloc/free (and for large classes, mmap/munmap) on every
+ * connection. A pool is not thread safe, use one pool per event loop.
+ *
+ * Passing NULL as a pool is allowed everywhere and falls back to plain
+ * malloc/free, so code paths which don't have a loop at hand still work.
+ */
+
+#define MEMPOOL_MIN_SHIFT 8    /* 256B */
+#define MEMPOOL_MAX_SHIFT 26   /* 64MB */
+#define MEMPOOL_NCLASSES (MEMPOOL_MAX_SHIFT - MEMPOOL_MIN_SHIFT + 1)
+
+/*
+ * Maximum amount of memory cached in each size class and in the whole
+ * pool. Blocks freed beyond either limit are returned to the system, so
+ * the classes larger than the per-class limit are never cached.
+ */
+#define MEMPOOL_CLASS_CACHE_BYTES (4UL << 20)
+#define MEMPOOL_CACHE_BYTES (16UL << 20)
+
+struct mempool_block {
+  struct mempool_block *next;
+};
+
+struct mempool_class {
+  struct mempool_block *free;
+  uint32_t nfree;
+  uint32_t max_free;
+};
+
+struct mempool {
+  struct mempool_class classes[MEMPOOL_NCLASSES];
+  size_t cached; /* bytes on the free lists */
+};
+
+struct mempool *mempool_create(void);
+void mempool_destroy(struct mempool *pool);
+size_t mempool_roundup(struct mempool *pool, size_t size);
+void *mempool_alloc(struct mempool *pool, size_t size);
+void mempool_free(struct mempool *pool, void *ptr, size_t size);
@@ -3,3 +3,4 @@
 #include <phttp_server.h>
 #include <phttp_handoff_server.h>
 #include <phttp_argparse.h>
+#include <phttp_stats.h>
@@ -6,17 +6,28 @@
 
 struct phttp_args {
   std::string addr;
+  std::string addr6; /* empty for no IPv6 listener */
   uint32_t port;
   uint8_t mac[6];
   int backlog;
+  uint64_t zerocopy_threshold;
+  uint64_t max_headers;
+  uint64_t max_body;
   bool tls;
   std::string tls_crt;
   std::string tls_key;
   std::string ho_addr;
   uint32_t ho_port;
   int ho_backlog;
+  uint32_t ho_batch_max;
+  uint64_t ho_batch_delay;
+  uint32_t ho_import_pool;
   std::string sw_addr;
   std::string sw_port;
+  bool sw_batch;
+  uint32_t sw_max_inflight;
+  std::string stats_addr;
+  uint32_t stats_port;
 };
 
 void phttp_argparse_set_all_args(argparse::ArgumentParser *parser);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <uv.h>
+
+/*
+ * Clocks for the hot path. All of them are served by the vDSO (or by
+ * the loop), none of them enters the kernel.
+ *
+ * phttp_clock_ns       : CLOCK_MONOTONIC, for the intervals (profiler)
+ * phttp_clock_coarse_ns: CLOCK_MONOTONIC_COARSE, tick resolution (1-4ms)
+ *                        but cheaper, for timeouts and rough ages
+ * phttp_loop_now_ms    : loop time, updated once per loop iteration
+ */
+static inline uint64_t
+phttp_clock_read_ns(clockid_t clk)
+{
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline uint64_t
+phttp_clock_ns(void)
+{
+  return phttp_clock_read_ns(CLOCK_MONOTONIC);
+}
+
+static inline uint64_t
+phttp_clock_coarse_ns(void)
+{
+  return phttp_clock_read_ns(CLOCK_MONOTONIC_COARSE);
+}
+
+static inline uint64_t
+phttp_loop_now_ms(uv_loop_t *loop)
+{
+  return uv_now(loop);
+}
+
+/*
+ * Per-loop "Date: <IMF-fixdate>\r\n" header line, re-rendered by a timer
+ * at every second boundary. Zero-filled state is ready to use, it is
+ * initialized on the first phttp_loop_date call of the loop.
+ */
+#define PHTTP_DATE_LEN (sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n") - 1)
+
+struct phttp_date {
+  bool initialized;
+  uv_timer_t timer;
+  char buf[PHTTP_DATE_LEN + 1];
+};
+
+const struct phttp_date *phttp_loop_date(uv_loop_t *loop);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * Coalescing of handoff messages going to the same destination. Messages
+ * queued during one loop iteration are written with a single uv_write
+ * (writev) from a uv_check hook, instead of one write per handoff.
+ *
+ * A batch is flushed when it reaches ho_batch_max messages, or at the end
+ * of the loop iteration once the oldest message waited for
+ * ho_batch_delay_us (both in struct global_config). A timer makes sure the
+ * batch is flushed even if the loop goes idle.
+ */
+
+#define PHTTP_HO_BATCH_MAX_DEFAULT 64
+
+struct phttp_ho_pending;
+typedef void (*phttp_ho_pending_cb)(struct phttp_ho_pending *, int status);
+
+struct phttp_ho_pending {
+  struct phttp_ho_pending *next;
+  uv_buf_t *bufs;
+  unsigned int nbufs;
+  phttp_ho_pending_cb done;
+};
+
+struct phttp_ho_batch {
+  bool initialized;
+  uv_check_t check;
+  uv_timer_t timer;
+  struct phttp_ho_pending *head;
+  struct phttp_ho_pending **tail;
+  uint32_t npending;
+  uint32_t nbufs;
+  uint64_t first_ts; /* uv_hrtime() of the oldest pending message */
+};
+
+struct http_server_handoff_data;
+
+/*
+ * Queue the message for the destination. bufs must stay valid until done
+ * is called with the status of the write.
+ */
+int phttp_ho_batch_write(struct http_server_handoff_data *ho_data,
+                         struct phttp_ho_pending *p);
+int phttp_ho_batch_flush(struct http_server_handoff_data *ho_data);
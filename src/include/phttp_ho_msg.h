@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <uv.h>
+
+#include <mempool.h>
+#include <tcp_export.h>
+#include <http_export.h>
+
+/*
+ * Handoff message exchanged between the servers. The message is framed by
+ * phttp_ho_header (payload length in network byte order) followed by the
+ * zero padding to make the total frame length multiple of 8, then the
+ * payload. The payload format is selected at build time (HO_FORMAT in the
+ * Makefile), both ends must be built with the same format.
+ */
+struct phttp_ho_header {
+  uint32_t length;
+  uint8_t pad[0];
+} __attribute__((packed));
+
+static inline uint32_t
+phttp_ho_padlen(uint32_t len)
+{
+  return len % 8 == 0 ? 0 : 8 - len % 8;
+}
+
+/*
+ * Format independent view of the handoff message. On encode, all pointers
+ * refer to the exporter's buffers and must stay valid until the write
+ * completes. On decode, they point into the receive buffer (or decoder),
+ * and are valid until the next decode.
+ */
+struct phttp_ho_msg {
+  struct tcp_state tcp;
+  const uint8_t *tls; /* NULL when the connection is not TLS */
+  uint32_t tls_len;
+  struct http_request_state http;
+
+  /*
+   * Raw payload the message was decoded from. Used for forwarding the
+   * message without re-encoding.
+   */
+  const char *raw;
+  size_t raw_len;
+};
+
+#define PHTTP_HO_OUT_NBUFS 10
+/*
+ * Room for the fixed part and the header table of the binary format
+ */
+#define PHTTP_HO_OUT_HEAD_MAX (256 + HTTP_HEADERS_MAX * 16)
+
+/*
+ * Encoded message ready for uv_write. Large blobs are not copied, bufs
+ * point to the buffers of the phttp_ho_msg they were encoded from.
+ *
+ * The TCP queues are captured into the out itself (phttp_ho_out_queue as
+ * the tcp_export_state_into allocator), into the blobs referenced by
+ * bufs (binary) or into the message being serialized (protobuf).
+ */
+struct phttp_ho_out {
+  uv_buf_t bufs[PHTTP_HO_OUT_NBUFS];
+  unsigned int nbufs;
+  size_t len;
+  uint8_t head[PHTTP_HO_OUT_HEAD_MAX] __attribute__((aligned(8)));
+  struct mempool *pool;
+  uint8_t *queues[TCP_STATE_NQUEUES];
+  size_t queue_size[TCP_STATE_NQUEUES];
+  void *priv;
+};
+
+struct phttp_ho_decoder {
+  void *priv;
+};
+
+void phttp_ho_out_init(struct phttp_ho_out *out, struct mempool *pool);
+uint8_t *phttp_ho_out_queue(void *out, enum tcp_state_queue queue,
+                            uint64_t len);
+int phttp_ho_encode(const struct phttp_ho_msg *msg, struct phttp_ho_out *out);
+void phttp_ho_out_release(struct phttp_ho_out *out);
+int phttp_ho_decoder_init(struct phttp_ho_decoder *dec);
+void phttp_ho_decoder_deinit(struct phttp_ho_decoder *dec);
+int phttp_ho_decode(struct phttp_ho_decoder *dec, const char *payload,
+                    size_t len, struct phttp_ho_msg *msg);
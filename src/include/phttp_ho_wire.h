@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Flat binary handoff payload.
+ *
+ * +--------------------------------+ 0
+ * | struct phttp_ho_wire_hdr       |
+ * | struct phttp_ho_wire_header[n] |
+ * +--------------------------------+ hdr_len (8 byte aligned)
+ * | blobs (sendq, recvq, tls,      |
+ * | http_buf), each 8 byte aligned |
+ * +--------------------------------+ total_len
+ *
+ * Blob offsets are relative to the beginning of the payload. Integers are
+ * in host byte order, the receiver rejects the payload when the magic
+ * doesn't match (e.g. different endianness) or the version is unknown.
+ * Addresses and ports are kept in network byte order like tcp_state,
+ * IPv4 addresses mapped into IPv6 ones.
+ */
+
+#define PHTTP_HO_WIRE_MAGIC 0x50484f57 /* "PHOW" */
+#define PHTTP_HO_WIRE_VERSION 6
+
+#define PHTTP_HO_WIRE_F_TLS 0x0001
+#define PHTTP_HO_WIRE_F_BODY_PENDING 0x0002 /* see http_request_state */
+
+struct phttp_ho_wire_blob {
+  uint32_t ofs;
+  uint32_t len;
+};
+
+struct phttp_ho_wire_header {
+  uint32_t name_ofs;
+  uint32_t name_len;
+  uint32_t val_ofs;
+  uint32_t val_len;
+};
+
+struct phttp_ho_wire_hdr {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t flags;
+  uint32_t hdr_len;
+  uint32_t total_len;
+
+  /* TCP */
+  uint32_t seq;
+  uint32_t ack;
+  uint32_t unsentq_len;
+  uint8_t self_addr[16];
+  uint8_t peer_addr[16];
+  uint32_t self_port;
+  uint32_t peer_port;
+  uint32_t mss;
+  uint32_t send_wscale;
+  uint32_t recv_wscale;
+  uint32_t timestamp;
+  uint32_t snd_wl1;
+  uint32_t snd_wnd;
+  uint32_t max_window;
+  uint32_t rcv_wnd;
+  uint32_t rcv_wup;
+  uint32_t options;
+  uint32_t reserved_tcp;
+  char congestion[16]; /* NUL padded, see tcp_state */
+
+  /* HTTP, offsets are relative to http_buf */
+  uint32_t minor_version;
+  uint32_t method_ofs;
+  uint32_t method_len;
+  uint32_t path_ofs;
+  uint32_t path_len;
+  uint32_t body_ofs;
+  uint32_t body_len;
+  uint32_t nheaders;
+  uint32_t req_len; /* rest of http_buf is pipelined requests */
+  uint32_t reserved;
+
+  struct phttp_ho_wire_blob sendq;
+  struct phttp_ho_wire_blob recvq;
+  struct phttp_ho_wire_blob tls;
+  struct phttp_ho_wire_blob http_buf;
+
+  struct phttp_ho_wire_header headers[0];
+};
+
+static_assert(sizeof(struct phttp_ho_wire_hdr) % 8 == 0,
+              "wire header must keep 8 byte alignment");
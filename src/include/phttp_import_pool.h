@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+struct http_client_socket;
+
+/*
+ * Per-loop pool of the objects an imported connection needs: a socket
+ * already in the TCP repair mode (tcp_repair_socket), an initialized
+ * libuv handle and a client socket. Taking from the pool only pops a
+ * slot, the socket creation and allocations happen in the refill, which
+ * runs from an idle handle, PHTTP_IMPORT_POOL_REFILL_BATCH slots per
+ * loop iteration. The refill runs in every iteration, I/O or not, and
+ * the loop polls without blocking until the pool is full.
+ *
+ * Zero-filled state is ready to use, it is initialized on the first
+ * phttp_import_pool_get of the loop. Pool size is ho_import_pool of the
+ * global config (0 for the default). When the pool runs dry, the slot is
+ * made on the spot.
+ *
+ * Sockets of each address family are pooled separately. The IPv4 ones
+ * are kept from the start, the IPv6 ones once the first IPv6 connection
+ * is imported, so IPv4 only deployments don't pay for them.
+ *
+ * phttp_import_pool_stop releases the pooled slots on shutdown, the
+ * pool makes slots on demand afterwards.
+ */
+#define PHTTP_IMPORT_POOL_DEFAULT 16
+#define PHTTP_IMPORT_POOL_MAX 256
+#define PHTTP_IMPORT_POOL_REFILL_BATCH 4
+
+struct phttp_import_slot {
+  int sock;
+  uv_tcp_t *tcp;
+  struct http_client_socket *hcs;
+};
+
+enum phttp_import_family {
+  PHTTP_IMPORT_IPV4,
+  PHTTP_IMPORT_IPV6,
+  PHTTP_IMPORT_NFAMILIES,
+};
+
+struct phttp_import_pool {
+  bool initialized;
+  bool stopped;
+  uv_idle_t idle;
+  uint32_t size;
+  bool active[PHTTP_IMPORT_NFAMILIES];
+  uint32_t nslots[PHTTP_IMPORT_NFAMILIES];
+  struct phttp_import_slot slots[PHTTP_IMPORT_NFAMILIES]
+                                [PHTTP_IMPORT_POOL_MAX];
+};
+
+/*
+ * Starts filling the pool ahead of the first handoff
+ */
+void phttp_import_pool_start(uv_loop_t *loop);
+
+/*
+ * Slot with a socket of the family, AF_INET or AF_INET6
+ */
+void phttp_import_pool_get(uv_loop_t *loop, int family,
+                           struct phttp_import_slot *slot);
+
+/*
+ * Closes the pooled sockets and handles and stops the refill
+ */
+void phttp_import_pool_stop(uv_loop_t *loop);
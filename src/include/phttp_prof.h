@@ -1,5 +1,6 @@
 #pragma once
 
+#include <netinet/in.h>
 #include <stdint.h>
 
 enum prof_types { PROF_TYPE_EXPORT, PROF_TYPE_IMPORT };
@@ -12,6 +13,7 @@ enum prof_ids {
   PROF_EXPORT_TCP,
   PROF_EXPORT_TLS,
   PROF_EXPORT_HTTP,
+  PROF_JOIN, /* both switch update and state export are done */
   PROF_TCP_CLOSE,
   PROF_SERIALIZE,
   PROF_SEND_PROTO_STATES,
@@ -24,15 +26,49 @@ enum prof_ids {
   PROF_IMPORT_TLS,
   PROF_CHOWN,
   PROF_FORWARDING,
-  PROF_HTTP_RES
+  PROF_HTTP_RES,
+
+  PROF_NR_IDS
+};
+
+/*
+ * Profiling output (built with -DPHTTP_PROF). Each thread records into its
+ * own preallocated ring without locks or syscalls, a background thread
+ * drains the rings into /tmp/prism_prof_<pid>.bin. The file starts with
+ * prof_file_header followed by prof_records. Timestamps are
+ * CLOCK_MONOTONIC, the header has a CLOCK_REALTIME anchor taken at the
+ * same time to put the records of different hosts on the same timeline.
+ * Use phttp-prof-report (apps/prof) to analyze.
+ */
+#define PROF_FILE_MAGIC "PHPROF01"
+#define PROF_FILE_VERSION 2
+
+struct prof_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t pid;
+  uint64_t realtime_ns;
+  uint64_t mono_ns;
 };
 
-struct prof {
-  enum prof_ids id;
+/*
+ * peer_addr identifies the flow together with peer_port. It is the
+ * address itself for IPv4 peers and a fold of it for IPv6 ones.
+ */
+struct prof_record {
+  uint64_t tstamp_ns;
   uint32_t peer_addr;
   uint16_t peer_port;
-  struct timeval tstamp;
+  uint8_t type;
+  uint8_t id;
 };
 
-void prof_tstamp(enum prof_types type, enum prof_ids id, uint32_t peer_addr,
-                 uint16_t peer_port);
+/* Per-thread ring size in records, must be a power of two */
+#define PROF_RING_SIZE (1U << 16)
+
+/* Interval of the background drain */
+#define PROF_DRAIN_INTERVAL_MS 10
+
+void prof_tstamp(enum prof_types type, enum prof_ids id,
+                 const struct in6_addr *peer_addr, uint16_t peer_port);
+const char *prof_id_name(enum prof_ids id);
@@ -1,12 +1,34 @@
 #pragma once
 
+#include <netinet/in.h>
+
 #include <http.h>
 #include <membuf.h>
+#include <mempool.h>
+#include <phttp_ho_batch.h>
+#include <phttp_clock.h>
+#include <phttp_import_pool.h>
 #include <uv_tcp_monitor.h>
 
 #include <prism_switch/prism_switch_client.h>
 
-enum http_state { HTTP_PARSING_HEADER, HTTP_RECEIVING_BODY };
+/*
+ * Status line, constant headers, per-response headers and body
+ */
+#define PHTTP_RES_MAX_BUFS 4
+
+/*
+ * Streaming response producers are asked to pause above the high
+ * watermark of unsent bytes and resumed below the low one.
+ */
+#define PHTTP_STREAM_HIGH_WATERMARK (256 * 1024)
+#define PHTTP_STREAM_LOW_WATERMARK (64 * 1024)
+
+enum http_state {
+  HTTP_PARSING_HEADER,
+  HTTP_RECEIVING_BODY,
+  HTTP_RECEIVING_CHUNKED
+};
 
 struct http_socket {
   int (*close)(uv_tcp_t *);
@@ -20,9 +42,30 @@ typedef struct http_server_socket {
   int backlog;
   uint32_t server_addr;
   uint32_t server_port;
+
+  /*
+   * IPv6 listener on server_addr6 and server_port (IPV6_V6ONLY) next to
+   * the IPv4 one, when server_ipv6 is set
+   */
+  bool server_ipv6;
+  struct in6_addr server_addr6;
   uint8_t server_mac[6];
   struct TLSContext *tls;
   request_handler_t request_handler;
+
+  /*
+   * Optional, called as soon as the headers of a request with a body
+   * are parsed. It may set req->body_cb to take the body as it arrives,
+   * or decide the handoff (status 600) without waiting for the body.
+   * The request is then handed off on its headers and the body is
+   * received by the importer, which calls its own headers_handler
+   * (imported set) in place of request_handler. request_handler runs
+   * once the body is complete.
+   */
+  request_handler_t headers_handler;
+  uint64_t zerocopy_threshold; /* min body size for MSG_ZEROCOPY, 0 is off */
+  uint64_t max_headers; /* per request, 0 for HTTP_HEADERS_DEFAULT */
+  uint64_t max_body;    /* bytes per request, 0 for HTTP_BODY_DEFAULT_MAX */
 } http_server_socket_t;
 
 typedef struct http_client_socket {
@@ -40,23 +83,73 @@ typedef struct http_client_socket {
   bool imported;
   uv_tcp_monitor_t monitor;
   void *export_data;
+  uint8_t ho_wait; /* handoff steps (switch update, export) in progress */
+  bool ho_request; /* current request came with the handoff */
+
+  /*
+   * Request processing state
+   */
+  bool reading;
+  bool res_pending; /* response of the current request is being written */
+  bool keep_alive;  /* current request allows the next one */
+  bool closing;
 
   /*
    * Buffers for sending response
    */
   uv_write_t wreq;
-  uv_buf_t wbufs[2];
+  uv_buf_t wbufs[PHTTP_RES_MAX_BUFS];
+
+  /*
+   * File body progress. body_poll waits for the socket to be writable
+   * again, it exists only while sendfile is blocked.
+   */
+  uint64_t body_sent;
+  uv_poll_t *body_poll;
+
+  /*
+   * MSG_ZEROCOPY state. zerocopy is for the current response, the
+   * counters are of the socket and the response completes when they
+   * meet.
+   */
+  bool zerocopy;
+  bool zc_enabled; /* SO_ZEROCOPY is set */
+  bool zc_off;     /* not supported or not effective on this socket */
+  uint32_t zc_nsent;
+  uint32_t zc_ncompleted;
 
   /*
-   * Peer address and peer port in network byte order.
-   * Should be set on accept handler or import handler.
+   * Chunked response state. streaming is set once the headers are out
+   * and the chunks go straight to the socket.
+   */
+  bool streaming;
+  bool stream_blocked; /* producer is waiting for the drain */
+
+  /*
+   * Peer address and peer port in network byte order, IPv4 addresses
+   * are mapped (see tcp_state). Should be set on accept handler or import
+   * handler.
    */
   struct {
-    uint32_t peer_addr;
+    struct in6_addr peer_addr;
     uint32_t peer_port;
   } peername_cache;
 
+  /*
+   * Local address, zero port when the listener is bound to the wildcard
+   * address
+   */
+  struct {
+    struct in6_addr self_addr;
+    uint32_t self_port;
+  } sockname_cache;
+
   http_server_socket_t *server_sock;
+
+  /*
+   * Per-loop pool which this socket and its buffers came from
+   */
+  struct mempool *pool;
 } http_client_socket_t;
 
 typedef struct http_server_handoff_data {
@@ -65,31 +158,101 @@ typedef struct http_server_handoff_data {
   uint32_t port;
   uv_write_t wreq;
   uv_buf_t wbuf;
+
+  /*
+   * Handoff messages waiting for the batched write. Initialized on the
+   * first handoff, so zero-filled handoff data is ready to use.
+   */
+  struct phttp_ho_batch batch;
 } http_server_handoff_data_t;
 
 struct global_config {
   prism_switch_client_t *sw_client;
+  struct mempool *pool;
+
+  /*
+   * Handoff batching. Max number of messages per write (0 for the
+   * default) and max time to hold the oldest message in microseconds
+   * (0 to flush at the end of every loop iteration).
+   */
+  uint32_t ho_batch_max;
+  uint64_t ho_batch_delay_us;
+
+  /*
+   * Cached Date header of the loop
+   */
+  struct phttp_date date;
+
+  /*
+   * Pre-created sockets for the imported connections. Number of them
+   * (0 for the default) and the pool itself.
+   */
+  uint32_t ho_import_pool;
+  struct phttp_import_pool import_pool;
 };
 
+static inline struct mempool *
+phttp_loop_pool(uv_loop_t *loop)
+{
+  return ((struct global_config *)loop->data)->pool;
+}
+
 /*
  * Initialize http server. Users need to provide libuv loop object and
  * configuration which contains following things.
  *
  * backlog         : Number of backlog which will be passed to listen(2)
  * server_addr     : Server's IPv4 address in network byte order
+ * server_addr6    : Server's IPv6 address, used when server_ipv6 is set
  * server_port     : Server's TCP port in network byte order. Only lower 16bits
  * are used. server_mac      : Server's MAC address. Required for handoff in L2
  * networks. request_handler : HTTP request handler
  */
 int phttp_server_init(uv_loop_t *loop, http_server_socket_t *conf);
-int http_client_socket_init(http_client_socket_t *hcs, bool import);
+
+/*
+ * Address of the server for the connections of the family (AF_INET
+ * ones mapped). EAFNOSUPPORT for AF_INET6 without the IPv6 listener.
+ */
+int phttp_server_addr(const http_server_socket_t *hss, int family,
+                      struct in6_addr *addr);
+int http_client_socket_init(http_client_socket_t *hcs, struct mempool *pool,
+                            bool import);
 void http_client_socket_deinit(http_client_socket_t *hcs);
 
+/*
+ * Allocate/free client socket and its libuv handle from the per-loop pool.
+ * http_client_socket_destroy also deinitializes the socket.
+ */
+http_client_socket_t *http_client_socket_create(uv_loop_t *loop, bool import);
+void http_client_socket_destroy(http_client_socket_t *hcs);
+uv_tcp_t *phttp_tcp_alloc(uv_loop_t *loop);
+void phttp_tcp_free(struct mempool *pool, uv_tcp_t *tcp);
+
 /*
  * For internal use only
  */
 void phttp_on_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
 void phttp_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+void phttp_process_requests(uv_tcp_t *client);
+void phttp_resume_request(uv_tcp_t *client);
 int phttp_start_handoff(uv_tcp_t *client);
 int phttp_send_http_res(uv_tcp_t *client, bool continue_res);
+void phttp_abort_res(http_client_socket_t *hcs);
+
+/*
+ * Streaming response API, for handlers that produce the body over time.
+ * phttp_stream_begin is called from the request handler and fails for
+ * HTTP/1.0 requests, fill body_mem instead then. Chunks written before
+ * the handler returns go out with the headers, the later ones are
+ * written as they come. cb is called with 0 when the stream became
+ * writable again after phttp_stream_writable said no, or with an error
+ * when the connection is gone, res must not be touched after that.
+ */
+int phttp_stream_begin(struct http_request *req, struct http_response *res,
+                       int (*cb)(struct http_response *, int), void *data);
+int phttp_stream_write(struct http_response *res, const char *buf,
+                       uint64_t len);
+bool phttp_stream_writable(struct http_response *res);
+int phttp_stream_end(struct http_response *res);
 int phttp_start_close(uv_tcp_t *client);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <uv.h>
+
+#include <phttp_prof.h>
+#include <phttp_server.h>
+
+/*
+ * Always-on latency histograms of the handoff stages. Every profiling
+ * point (prof_tstamp) records the time since the previous point of the
+ * same flow into the histogram of the stage. Export side flow starts at
+ * PROF_RECEIVE_HTTP_REQ and ends at PROF_SEND_PROTO_STATES, import side
+ * starts at PROF_HANDOFF and ends at PROF_HTTP_RES or PROF_FORWARDING.
+ * End to end time of each side goes to the total histograms.
+ *
+ * Histograms are log-linear (HDR style): 16 linear sub-buckets per power
+ * of two, i.e. within ~6% of the value, up to 2^PHTTP_HIST_MAX_EXP ns.
+ *
+ * Each worker (process or thread) records into its own slot of a shared
+ * memory region. Calling phttp_stats_init before forking the workers
+ * makes the region shared among them, so any worker can serve the merged
+ * view. Without it, each process has its own region.
+ */
+
+#define PHTTP_HIST_SUB_BITS 4
+#define PHTTP_HIST_SUB (1 << PHTTP_HIST_SUB_BITS)
+#define PHTTP_HIST_MAX_EXP 40 /* ~18 minutes */
+#define PHTTP_HIST_NBUCKETS                                                    \
+  ((PHTTP_HIST_MAX_EXP - PHTTP_HIST_SUB_BITS + 2) * PHTTP_HIST_SUB)
+
+#define PHTTP_STATS_MAX_SLOTS 256
+
+enum phttp_stats_hists {
+  PHTTP_STATS_EXPORT_TOTAL = PROF_NR_IDS,
+  PHTTP_STATS_IMPORT_TOTAL,
+  PHTTP_STATS_NR_HISTS
+};
+
+struct phttp_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t buckets[PHTTP_HIST_NBUCKETS];
+};
+
+struct phttp_stats_slot {
+  struct phttp_hist hists[PHTTP_STATS_NR_HISTS];
+};
+
+struct phttp_stats_shm {
+  uint32_t nslots;
+  uint32_t next_slot;
+  struct phttp_stats_slot slots[PHTTP_STATS_MAX_SLOTS];
+};
+
+typedef struct phttp_stats_server {
+  struct http_socket hs;
+  int backlog;
+  uint32_t addr;
+  uint32_t port;
+} phttp_stats_server_t;
+
+int phttp_stats_init(void);
+void phttp_stats_record(enum prof_ids id, uint32_t peer_addr,
+                        uint16_t peer_port, uint64_t now_ns);
+void phttp_stats_hist_add(struct phttp_hist *hist, uint64_t val);
+uint64_t phttp_stats_hist_quantile(const struct phttp_hist *hist, double q);
+
+/*
+ * Serve the merged histograms in Prometheus text format over HTTP. The
+ * listener uses SO_REUSEPORT, so every worker can call it with the same
+ * address.
+ */
+int phttp_stats_server_init(uv_loop_t *loop, phttp_stats_server_t *pss);
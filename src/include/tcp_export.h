@@ -1,11 +1,163 @@
 #pragma once
 
+#include <netinet/in.h>
 #include <stdint.h>
+#include <sys/socket.h>
 #include <tcp.pb.h>
 
 struct prism_tcp_state {
   prism::TCPState *state;
 };
 
+/*
+ * Values match TCPI_OPT_*. States without TCP_STATE_OPT_KNOWN (from the
+ * peers not exporting the options) are restored with SACK, timestamps
+ * and window scaling on, as they used to be.
+ */
+#define TCP_STATE_OPT_TIMESTAMPS 0x1
+#define TCP_STATE_OPT_SACK 0x2
+#define TCP_STATE_OPT_WSCALE 0x4
+#define TCP_STATE_OPT_KNOWN 0x80000000
+
+#define TCP_STATE_CA_NAME_MAX 16
+
+/*
+ * Addresses of both families are kept as IPv6 ones, IPv4 addresses are
+ * mapped (::ffff:a.b.c.d). The family of a connection is the family of
+ * its peer address.
+ */
+static inline void
+tcp_addr_set_ipv4(struct in6_addr *addr, uint32_t ipv4)
+{
+  addr->s6_addr32[0] = 0;
+  addr->s6_addr32[1] = 0;
+  addr->s6_addr32[2] = htonl(0xffff);
+  addr->s6_addr32[3] = ipv4;
+}
+
+static inline int
+tcp_addr_family(const struct in6_addr *addr)
+{
+  return IN6_IS_ADDR_V4MAPPED(addr) ? AF_INET : AF_INET6;
+}
+
+int tcp_addr_from_sockaddr(const struct sockaddr *sa, struct in6_addr *addr,
+                           uint32_t *port);
+socklen_t tcp_addr_to_sockaddr(const struct in6_addr *addr, uint32_t port,
+                               struct sockaddr_storage *ss);
+
+/*
+ * Serialization format independent TCP state. Addresses and ports are
+ * in network byte order. On export, queues are allocated by
+ * tcp_export_state and must be freed with tcp_state_release, or by the
+ * allocator of tcp_export_state_into and owned by its caller. On
+ * import, queues may point to any memory which outlives tcp_import_state.
+ */
+struct tcp_state {
+  uint32_t seq;
+  uint32_t ack;
+  uint8_t *sendq;
+  uint64_t sendq_len;
+  uint64_t unsentq_len;
+  uint8_t *recvq;
+  uint64_t recvq_len;
+  struct in6_addr self_addr;
+  uint32_t self_port;
+  struct in6_addr peer_addr;
+  uint32_t peer_port;
+  uint32_t mss;
+  uint32_t send_wscale;
+  uint32_t recv_wscale;
+  uint32_t timestamp;
+  uint32_t snd_wl1;
+  uint32_t snd_wnd;
+  uint32_t max_window;
+  uint32_t rcv_wnd;
+  uint32_t rcv_wup;
+
+  /*
+   * TCP_STATE_OPT_*, options negotiated on the connection
+   */
+  uint32_t options;
+
+  /*
+   * Congestion control algorithm of the connection (TCP_CONGESTION).
+   * cwnd, ssthresh and the RTT estimates are not carried: the kernel
+   * offers no way to set them from the user space (only a BPF sock_ops
+   * program can seed the initial cwnd with TCP_BPF_IW), so the imported
+   * connection starts them afresh.
+   */
+  char congestion[TCP_STATE_CA_NAME_MAX]; /* NUL terminated, "" unknown */
+};
+
+enum tcp_state_queue {
+  TCP_STATE_SENDQ,
+  TCP_STATE_RECVQ,
+  TCP_STATE_NQUEUES,
+};
+
+/*
+ * Returns len bytes for the queue contents, NULL on failure. Called
+ * only for non-empty queues, with the length taken from SIOCOUTQ and
+ * SIOCINQ, so the queues can be captured straight into the buffer the
+ * state is sent from.
+ */
+typedef uint8_t *(*tcp_queue_alloc_t)(void *arg, enum tcp_state_queue queue,
+                                      uint64_t len);
+
+/*
+ * Export parameters. Addresses the caller already knows (e.g. cached at
+ * accept) are taken as is instead of asking the socket, a zero port
+ * means unknown. Addresses are in network byte order.
+ */
+struct tcp_export_opts {
+  tcp_queue_alloc_t alloc; /* NULL for malloc */
+  void *arg;
+  struct in6_addr self_addr;
+  uint32_t self_port;
+  struct in6_addr peer_addr;
+  uint32_t peer_port;
+};
+
+/*
+ * Per-thread counters of the syscalls made on the sockets being exported
+ * and imported (queue peeks and sends included)
+ */
+struct tcp_export_counters {
+  uint64_t nexports;
+  uint64_t export_syscalls;
+  uint64_t nimports;
+  uint64_t import_syscalls;
+};
+
+int tcp_export_state(int sock, struct tcp_state *state);
+int tcp_export_state_into(int sock, struct tcp_state *state,
+                          const struct tcp_export_opts *opts);
+int tcp_import_state(int sock, const struct tcp_state *state);
+
+/*
+ * Import half of tcp_import_state prepared ahead of time.
+ * tcp_repair_socket returns a new socket of the family (AF_INET or
+ * AF_INET6) already in the repair mode with SO_REUSEADDR set (or
+ * -errno), tcp_import_state_prepared imports into such a socket. The
+ * socket must be of tcp_addr_family of the peer address.
+ */
+int tcp_repair_socket(int family);
+int tcp_import_state_prepared(int sock, const struct tcp_state *state);
+int tcp_export_recv_changed(int sock, const struct tcp_state *state,
+                            bool *changed);
+
+/*
+ * Takes the socket out of the repair mode tcp_export_state_into left it
+ * in, for the connection that stays after all
+ */
+int tcp_export_cancel(int sock);
+void tcp_state_release(struct tcp_state *state);
+void tcp_export_get_counters(struct tcp_export_counters *counters);
+void tcp_state_to_proto(const struct tcp_state *state, prism::TCPState *pb);
+void tcp_state_from_proto(const prism::TCPState *pb, struct tcp_state *state);
+uint8_t *tcp_state_proto_queue(void *pb, enum tcp_state_queue queue,
+                               uint64_t len);
+
 int tcp_export(int sock, prism::TCPState *state);
 int tcp_import(int sock, const prism::TCPState *state);
@@ -10,5 +10,11 @@ struct prism_tls_state {
   prism::TLSState *state;
 };
 
+/*
+ * Export TLS context into newly allocated buffer. Caller frees it.
+ */
+int tls_export_buf(struct TLSContext *tls, uint8_t **buf, uint32_t *len);
+int tls_import_buf(struct TLSContext *tls, const uint8_t *buf, uint32_t len);
+
 int tls_export(struct TLSContext *tls, prism::TLSState *ex);
 int tls_import(struct TLSContext *tls, const prism::TLSState *ex);
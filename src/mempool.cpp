@@ -0,0 +1,149 @@
+#include <cassert>
+#include <cstdlib>
+
+#include <mempool.h>
+
+static inline int
+mempool_class_idx(size_t size)
+{
+  int shift;
+
+  if (size <= (1UL << MEMPOOL_MIN_SHIFT)) {
+    return 0;
+  }
+
+  shift = 64 - __builtin_clzl(size - 1);
+  if (shift > MEMPOOL_MAX_SHIFT) {
+    return -1;
+  }
+
+  return shift - MEMPOOL_MIN_SHIFT;
+}
+
+struct mempool *
+mempool_create(void)
+{
+  struct mempool *pool = (struct mempool *)malloc(sizeof(*pool));
+  assert(pool != NULL);
+
+  for (int i = 0; i < MEMPOOL_NCLASSES; i++) {
+    size_t csize = 1UL << (i + MEMPOOL_MIN_SHIFT);
+    pool->classes[i].free = NULL;
+    pool->classes[i].nfree = 0;
+    pool->classes[i].max_free = MEMPOOL_CLASS_CACHE_BYTES / csize;
+  }
+
+  pool->cached = 0;
+
+  return pool;
+}
+
+void
+mempool_destroy(struct mempool *pool)
+{
+  struct mempool_block *b, *next;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < MEMPOOL_NCLASSES; i++) {
+    for (b = pool->classes[i].free; b != NULL; b = next) {
+      next = b->next;
+      free(b);
+    }
+  }
+
+  free(pool);
+}
+
+/*
+ * Returns the real size of the block which will be returned by
+ * mempool_alloc for the request of given size.
+ */
+size_t
+mempool_roundup(struct mempool *pool, size_t size)
+{
+  int idx;
+
+  if (pool == NULL) {
+    return size;
+  }
+
+  idx = mempool_class_idx(size);
+  if (idx < 0) {
+    return size;
+  }
+
+  return 1UL << (idx + MEMPOOL_MIN_SHIFT);
+}
+
+void *
+mempool_alloc(struct mempool *pool, size_t size)
+{
+  int idx;
+  struct mempool_class *c;
+  struct mempool_block *b;
+
+  if (pool == NULL) {
+    return malloc(size);
+  }
+
+  idx = mempool_class_idx(size);
+  if (idx < 0) {
+    return malloc(size);
+  }
+
+  c = pool->classes + idx;
+  if (c->free == NULL) {
+    return malloc(1UL << (idx + MEMPOOL_MIN_SHIFT));
+  }
+
+  b = c->free;
+  c->free = b->next;
+  c->nfree--;
+  pool->cached -= 1UL << (idx + MEMPOOL_MIN_SHIFT);
+
+  return b;
+}
+
+/*
+ * Size must be the same as the one passed to mempool_alloc (or the
+ * rounded up size returned by mempool_roundup).
+ */
+void
+mempool_free(struct mempool *pool, void *ptr, size_t size)
+{
+  int idx;
+  size_t csize;
+  struct mempool_class *c;
+  struct mempool_block *b;
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  if (pool == NULL) {
+    free(ptr);
+    return;
+  }
+
+  idx = mempool_class_idx(size);
+  if (idx < 0) {
+    free(ptr);
+    return;
+  }
+
+  c = pool->classes + idx;
+  csize = 1UL << (idx + MEMPOOL_MIN_SHIFT);
+  if (c->nfree == c->max_free || pool->cached + csize > MEMPOOL_CACHE_BYTES) {
+    free(ptr);
+    return;
+  }
+
+  b = (struct mempool_block *)ptr;
+  b->next = c->free;
+  c->free = b;
+  c->nfree++;
+  pool->cached += csize;
+}
@@ -6,9 +6,19 @@ void
 phttp_argparse_set_all_args(argparse::ArgumentParser *parser)
 {
   parser->addArgument({"--addr"}, "HTTP server IPv4 address");
+  parser->addArgument({"--addr6"},
+                      "HTTP server IPv6 address (default none, IPv4 only)");
   parser->addArgument({"--port"}, "HTTP server TCP port");
   parser->addArgument({"--mac"}, "HTTP server MAC address");
   parser->addArgument({"--backlog"}, "HTTP server backlog");
+  parser->addArgument({"--zerocopy-threshold"},
+                      "Min response body size in bytes sent with "
+                      "MSG_ZEROCOPY (default 0, disabled)");
+  parser->addArgument({"--max-headers"},
+                      "Max number of headers in a request (default 64, "
+                      "up to 128)");
+  parser->addArgument({"--max-body"},
+                      "Max request body size in bytes (default 64MB)");
 
   parser->addArgument({"--tls"}, "Enable TLS",
                       argparse::ArgumentType::StoreTrue);
@@ -18,9 +28,28 @@ phttp_argparse_set_all_args(argparse::ArgumentParser *parser)
   parser->addArgument({"--ho-addr"}, "HTTP handoff server IPv4 address");
   parser->addArgument({"--ho-port"}, "HTTP handoff server TCP port");
   parser->addArgument({"--ho-backlog"}, "HTTP handoff server backlog");
+  parser->addArgument({"--ho-batch-max"},
+                      "Max number of handoff messages per write (default 64)");
+  parser->addArgument({"--ho-batch-delay"},
+                      "Max time to hold handoff messages for batching in "
+                      "microseconds (default 0, flush every loop iteration)");
+  parser->addArgument({"--ho-import-pool"},
+                      "Number of pre-created sockets for the imported "
+                      "connections per loop (default 16)");
 
   parser->addArgument({"--sw-addr"}, "Switch daemon IPv4 address");
   parser->addArgument({"--sw-port"}, "Switch daemon TCP port");
+  parser->addArgument({"--sw-batch"},
+                      "Coalesce switch requests into batch messages",
+                      argparse::ArgumentType::StoreTrue);
+  parser->addArgument({"--sw-max-inflight"},
+                      "Max number of switch requests on the wire "
+                      "(default 256)");
+
+  parser->addArgument({"--stats-addr"},
+                      "Stats server IPv4 address (default 127.0.0.1)");
+  parser->addArgument({"--stats-port"},
+                      "Stats server TCP port (default 0, disabled)");
 }
 
 static void
@@ -33,8 +62,13 @@ phttp_argparse_parse_server_conf(argparse::Arguments *args,
   auto backlog = args->get<int>("backlog");
 
   phttp_args->addr = addr;
+  phttp_args->addr6 = args->safeGet<std::string>("addr6", std::string());
   phttp_args->port = port;
   phttp_args->backlog = backlog;
+  phttp_args->zerocopy_threshold =
+      args->safeGet<uint64_t>("zerocopy-threshold", 0);
+  phttp_args->max_headers = args->safeGet<uint64_t>("max-headers", 0);
+  phttp_args->max_body = args->safeGet<uint64_t>("max-body", 0);
 
   sscanf(mac.c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", phttp_args->mac + 0,
          phttp_args->mac + 1, phttp_args->mac + 2, phttp_args->mac + 3,
@@ -58,10 +92,16 @@ phttp_argparse_parse_handoff_server_conf(argparse::Arguments *args,
   auto ho_addr = args->get<std::string>("ho-addr");
   auto ho_port = args->get<uint16_t>("ho-port");
   auto ho_backlog = args->get<int>("ho-backlog");
+  auto ho_batch_max = args->safeGet<uint32_t>("ho-batch-max", 0);
+  auto ho_batch_delay = args->safeGet<uint64_t>("ho-batch-delay", 0);
+  auto ho_import_pool = args->safeGet<uint32_t>("ho-import-pool", 0);
 
   phttp_args->ho_addr = ho_addr;
   phttp_args->ho_port = ho_port;
   phttp_args->ho_backlog = ho_backlog;
+  phttp_args->ho_batch_max = ho_batch_max;
+  phttp_args->ho_batch_delay = ho_batch_delay;
+  phttp_args->ho_import_pool = ho_import_pool;
 }
 
 static void
@@ -73,6 +113,20 @@ phttp_argparse_parse_global_conf(argparse::Arguments *args,
 
   phttp_args->sw_addr = sw_addr;
   phttp_args->sw_port = sw_port;
+  phttp_args->sw_batch = args->has("sw-batch");
+  phttp_args->sw_max_inflight = args->safeGet<uint32_t>("sw-max-inflight", 0);
+}
+
+static void
+phttp_argparse_parse_stats_conf(argparse::Arguments *args,
+                                struct phttp_args *phttp_args)
+{
+  auto stats_addr =
+      args->safeGet<std::string>("stats-addr", std::string("127.0.0.1"));
+  auto stats_port = args->safeGet<uint16_t>("stats-port", 0);
+
+  phttp_args->stats_addr = stats_addr;
+  phttp_args->stats_port = stats_port;
 }
 
 void
@@ -82,4 +136,5 @@ phttp_argparse_parse_all(argparse::Arguments *args,
   phttp_argparse_parse_server_conf(args, phttp_args);
   phttp_argparse_parse_handoff_server_conf(args, phttp_args);
   phttp_argparse_parse_global_conf(args, phttp_args);
+  phttp_argparse_parse_stats_conf(args, phttp_args);
 }
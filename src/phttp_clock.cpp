@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <ctime>
+
+#include <phttp_clock.h>
+#include <phttp_server.h>
+
+static const char *wdays[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                               "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+static void on_date_timer(uv_timer_t *timer);
+
+/*
+ * Render the current time and arm the timer for the next second
+ * boundary, so the header never lags behind the wall clock by more
+ * than the loop latency.
+ */
+static void
+refresh_date(struct phttp_date *date)
+{
+  int error, year, len;
+  struct timespec ts;
+  struct tm tm;
+  uint64_t next_ms;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  gmtime_r(&ts.tv_sec, &tm);
+
+  /*
+   * Four digits keep the line PHTTP_DATE_LEN long
+   */
+  year = std::min(std::max(tm.tm_year + 1900, 0), 9999);
+
+  len = snprintf(date->buf, sizeof(date->buf),
+                 "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+                 wdays[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], year,
+                 tm.tm_hour, tm.tm_min, tm.tm_sec);
+  assert(len == (int)PHTTP_DATE_LEN);
+
+  next_ms = 1000 - ts.tv_nsec / 1000000;
+
+  error = uv_timer_start(&date->timer, on_date_timer, next_ms, 0);
+  assert(error == 0);
+}
+
+static void
+on_date_timer(uv_timer_t *timer)
+{
+  refresh_date((struct phttp_date *)timer->data);
+}
+
+const struct phttp_date *
+phttp_loop_date(uv_loop_t *loop)
+{
+  int error;
+  struct global_config *gconf = (struct global_config *)loop->data;
+  struct phttp_date *date = &gconf->date;
+
+  if (date->initialized) {
+    return date;
+  }
+
+  error = uv_timer_init(loop, &date->timer);
+  assert(error == 0);
+
+  date->timer.data = date;
+
+  /*
+   * Timer alone shouldn't keep the loop alive
+   */
+  uv_unref((uv_handle_t *)&date->timer);
+
+  refresh_date(date);
+  date->initialized = true;
+
+  return date;
+}
@@ -14,7 +14,7 @@ static void
 http_handoff_client_socket_deinit(http_handoff_client_socket_t *hhcs)
 {
   membuf_deinit(&hhcs->req_mem);
-  delete hhcs->req;
+  phttp_ho_decoder_deinit(&hhcs->dec);
 }
 
 static void
@@ -38,9 +38,12 @@ http_handoff_client_socket_close(uv_tcp_t *client)
 static int
 http_handoff_client_socket_init(http_handoff_client_socket_t *hhcs)
 {
+  int error;
+
   hhcs->hs.close = http_handoff_client_socket_close;
   membuf_init(&hhcs->req_mem, 5000000);
-  hhcs->req = new prism::HTTPHandoffReq();
+  error = phttp_ho_decoder_init(&hhcs->dec);
+  assert(error == 0);
   hhcs->hhss = NULL;
   return 0;
 }
@@ -108,7 +111,7 @@ on_read(uv_stream_t *_client, ssize_t nread, const uv_buf_t *buf)
   http_handoff_client_socket_t *conn =
       (http_handoff_client_socket_t *)client->data;
   struct membuf *req_mem = &conn->req_mem;
-  prism::HTTPHandoffReq *req = conn->req;
+  struct phttp_ho_msg msg;
 
   if (nread == 0) {
     return;
@@ -127,35 +130,51 @@ on_read(uv_stream_t *_client, ssize_t nread, const uv_buf_t *buf)
   uint32_t padlen;
   char *cursor = req_mem->begin;
   while (1) {
-    if ((uintptr_t)req_mem->cur - (uintptr_t)cursor < sizeof(uint32_t)) {
+    if ((size_t)(req_mem->cur - cursor) < sizeof(struct phttp_ho_header)) {
       break;
     }
 
     struct phttp_ho_header *header = (struct phttp_ho_header *)cursor;
     buflen = ntohl(header->length);
-    padlen = buflen % 8 == 0 ? 0 : 8 - buflen % 8;
+    padlen = phttp_ho_padlen(buflen);
 
-    if (req_mem->cur - cursor < buflen + padlen) {
+    if ((size_t)(req_mem->cur - cursor) <
+        sizeof(struct phttp_ho_header) + padlen + buflen) {
       break;
     }
 
-    cursor += sizeof(uint32_t) + padlen;
+    cursor += sizeof(struct phttp_ho_header) + padlen;
 
-    bool done = req->ParseFromString(std::string(cursor, buflen));
-    assert(done);
+    /*
+     * Decode in place, the message refers to req_mem until
+     * phttp_on_handoff returns.
+     */
+    error = phttp_ho_decode(&conn->dec, cursor, buflen, &msg);
+    assert(error == 0);
 
     cursor += buflen;
 
-    error = phttp_on_handoff(client, req);
+    error = phttp_on_handoff(client, &msg);
     assert(error == 0);
-
-    req->Clear();
   }
 
   size_t rem = req_mem->cur - cursor;
   memmove(req_mem->begin, cursor, rem);
   membuf_reset(req_mem);
   membuf_consume(req_mem, rem);
+
+  /*
+   * Make room for the rest of the partially received frame at once
+   * instead of growing the buffer on every read.
+   */
+  if (rem >= sizeof(struct phttp_ho_header)) {
+    buflen = ntohl(((struct phttp_ho_header *)req_mem->begin)->length);
+    size_t frame_len =
+        sizeof(struct phttp_ho_header) + phttp_ho_padlen(buflen) + buflen;
+    if (frame_len > (size_t)(req_mem->end - req_mem->begin)) {
+      membuf_grow(req_mem, frame_len - rem);
+    }
+  }
 }
 
 static void
@@ -253,5 +272,10 @@ phttp_handoff_server_init(uv_loop_t *loop, http_handoff_server_socket_t *hhss)
 
   server->data = hhss;
 
+  /*
+   * This loop imports the connections handed off to it
+   */
+  phttp_import_pool_start(loop);
+
   return 0;
 }
@@ -0,0 +1,185 @@
+#include <cassert>
+
+#include <phttp_server.h>
+#include <phttp_ho_batch.h>
+
+struct batch_write {
+  uv_write_t req;
+  struct phttp_ho_pending *head;
+  struct mempool *pool;
+};
+
+static void
+batch_write_done(uv_write_t *req, int status)
+{
+  struct batch_write *w = (struct batch_write *)req->data;
+  struct phttp_ho_pending *p, *next;
+
+  for (p = w->head; p != NULL; p = next) {
+    next = p->next;
+    p->done(p, status);
+  }
+
+  mempool_free(w->pool, w, sizeof(*w));
+}
+
+static void
+batch_stop(struct phttp_ho_batch *batch)
+{
+  int error;
+
+  error = uv_check_stop(&batch->check);
+  assert(error == 0);
+
+  error = uv_timer_stop(&batch->timer);
+  assert(error == 0);
+}
+
+int
+phttp_ho_batch_flush(struct http_server_handoff_data *ho_data)
+{
+  int error;
+  uv_buf_t *bufs;
+  unsigned int n = 0;
+  struct phttp_ho_batch *batch = &ho_data->batch;
+  struct phttp_ho_pending *p;
+  struct mempool *pool = phttp_loop_pool(ho_data->dest.loop);
+
+  if (batch->npending == 0) {
+    return 0;
+  }
+
+  struct batch_write *w = (struct batch_write *)mempool_alloc(pool, sizeof(*w));
+  assert(w != NULL);
+
+  /*
+   * uv_write copies the iovec array into the request, so it can be freed
+   * right after the call.
+   */
+  bufs = (uv_buf_t *)mempool_alloc(pool, sizeof(*bufs) * batch->nbufs);
+  assert(bufs != NULL);
+
+  for (p = batch->head; p != NULL; p = p->next) {
+    for (unsigned int i = 0; i < p->nbufs; i++) {
+      bufs[n++] = p->bufs[i];
+    }
+  }
+
+  assert(n == batch->nbufs);
+
+  w->head = batch->head;
+  w->pool = pool;
+  w->req.data = w;
+
+  batch->head = NULL;
+  batch->tail = &batch->head;
+  batch->npending = 0;
+  batch->nbufs = 0;
+  batch_stop(batch);
+
+  error = uv_write(&w->req, (uv_stream_t *)&ho_data->dest, bufs, n,
+                   batch_write_done);
+
+  mempool_free(pool, bufs, sizeof(*bufs) * n);
+
+  return error;
+}
+
+static bool
+batch_expired(struct http_server_handoff_data *ho_data)
+{
+  struct global_config *gconf =
+      (struct global_config *)ho_data->dest.loop->data;
+  uint64_t delay_ns = gconf->ho_batch_delay_us * 1000;
+
+  return uv_hrtime() - ho_data->batch.first_ts >= delay_ns;
+}
+
+static void
+on_check(uv_check_t *check)
+{
+  int error;
+  http_server_handoff_data_t *ho_data =
+      (http_server_handoff_data_t *)check->data;
+
+  if (!batch_expired(ho_data)) {
+    return;
+  }
+
+  error = phttp_ho_batch_flush(ho_data);
+  assert(error == 0);
+}
+
+static void
+on_timer(uv_timer_t *timer)
+{
+  int error;
+  http_server_handoff_data_t *ho_data =
+      (http_server_handoff_data_t *)timer->data;
+
+  error = phttp_ho_batch_flush(ho_data);
+  assert(error == 0);
+}
+
+static void
+batch_init(struct http_server_handoff_data *ho_data)
+{
+  int error;
+  struct phttp_ho_batch *batch = &ho_data->batch;
+
+  error = uv_check_init(ho_data->dest.loop, &batch->check);
+  assert(error == 0);
+
+  error = uv_timer_init(ho_data->dest.loop, &batch->timer);
+  assert(error == 0);
+
+  batch->check.data = ho_data;
+  batch->timer.data = ho_data;
+  batch->head = NULL;
+  batch->tail = &batch->head;
+  batch->npending = 0;
+  batch->nbufs = 0;
+  batch->initialized = true;
+}
+
+int
+phttp_ho_batch_write(struct http_server_handoff_data *ho_data,
+                     struct phttp_ho_pending *p)
+{
+  int error;
+  struct phttp_ho_batch *batch = &ho_data->batch;
+  struct global_config *gconf =
+      (struct global_config *)ho_data->dest.loop->data;
+  uint32_t max = gconf->ho_batch_max != 0 ? gconf->ho_batch_max
+                                          : PHTTP_HO_BATCH_MAX_DEFAULT;
+
+  if (!batch->initialized) {
+    batch_init(ho_data);
+  }
+
+  p->next = NULL;
+  *batch->tail = p;
+  batch->tail = &p->next;
+  batch->nbufs += p->nbufs;
+
+  if (batch->npending++ == 0) {
+    batch->first_ts = uv_hrtime();
+
+    error = uv_check_start(&batch->check, on_check);
+    assert(error == 0);
+
+    /*
+     * Flush even when nothing else wakes up the loop. Round up, the
+     * timer has millisecond resolution.
+     */
+    error = uv_timer_start(&batch->timer, on_timer,
+                           (gconf->ho_batch_delay_us + 999) / 1000, 0);
+    assert(error == 0);
+  }
+
+  if (batch->npending >= max) {
+    return phttp_ho_batch_flush(ho_data);
+  }
+
+  return 0;
+}
@@ -0,0 +1,317 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+
+#include <phttp_ho_msg.h>
+#include <phttp_ho_wire.h>
+
+static const uint8_t zeros[8] = {0};
+
+static_assert(sizeof(((struct phttp_ho_wire_hdr *)0)->congestion) ==
+                  TCP_STATE_CA_NAME_MAX,
+              "congestion algorithm name size mismatch");
+static_assert(sizeof(((struct phttp_ho_wire_hdr *)0)->self_addr) ==
+                  sizeof(struct in6_addr),
+              "address size mismatch");
+
+static inline uint32_t
+align8(uint32_t v)
+{
+  return (v + 7) & ~7U;
+}
+
+/*
+ * Append blob to the iovec array without copying. Blobs are aligned to 8
+ * bytes from the beginning of the payload.
+ */
+static void
+add_blob(struct phttp_ho_out *out, struct phttp_ho_wire_blob *blob,
+         const void *data, uint64_t len, uint64_t *cursor)
+{
+  uint32_t pad;
+
+  if (len == 0) {
+    blob->ofs = 0;
+    blob->len = 0;
+    return;
+  }
+
+  pad = align8(*cursor) - *cursor;
+  if (pad != 0) {
+    out->bufs[out->nbufs++] = uv_buf_init((char *)zeros, pad);
+    *cursor += pad;
+  }
+
+  blob->ofs = *cursor;
+  blob->len = len;
+  out->bufs[out->nbufs++] = uv_buf_init((char *)data, len);
+  *cursor += len;
+}
+
+static inline bool
+blob_ok(const struct phttp_ho_wire_blob *blob, uint32_t hdr_len, size_t len)
+{
+  if (blob->len == 0) {
+    return true;
+  }
+
+  return blob->ofs >= hdr_len && blob->ofs <= len &&
+         blob->len <= len - blob->ofs;
+}
+
+void
+phttp_ho_out_init(struct phttp_ho_out *out, struct mempool *pool)
+{
+  out->nbufs = 0;
+  out->len = 0;
+  out->pool = pool;
+  for (int i = 0; i < TCP_STATE_NQUEUES; i++) {
+    out->queues[i] = NULL;
+    out->queue_size[i] = 0;
+  }
+  out->priv = NULL;
+}
+
+/*
+ * Queues become the sendq/recvq blobs as is. A queue exported again
+ * (refresh before the write) reuses the buffer when it fits.
+ */
+uint8_t *
+phttp_ho_out_queue(void *_out, enum tcp_state_queue queue, uint64_t len)
+{
+  struct phttp_ho_out *out = (struct phttp_ho_out *)_out;
+
+  if (len > out->queue_size[queue]) {
+    mempool_free(out->pool, out->queues[queue], out->queue_size[queue]);
+    out->queue_size[queue] = mempool_roundup(out->pool, len);
+    out->queues[queue] =
+        (uint8_t *)mempool_alloc(out->pool, out->queue_size[queue]);
+    if (out->queues[queue] == NULL) {
+      out->queue_size[queue] = 0;
+    }
+  }
+
+  return out->queues[queue];
+}
+
+int
+phttp_ho_encode(const struct phttp_ho_msg *msg, struct phttp_ho_out *out)
+{
+  uint8_t *head;
+  uint32_t hdr_len, padlen;
+  uint64_t cursor;
+  struct phttp_ho_wire_hdr hdr;
+  struct phttp_ho_wire_header wh;
+  struct phttp_ho_header frame;
+  const struct tcp_state *tcp = &msg->tcp;
+  const struct http_request_state *http = &msg->http;
+
+  if (http->nheaders > HTTP_HEADERS_MAX) {
+    return -EINVAL;
+  }
+
+  hdr_len = sizeof(hdr) + http->nheaders * sizeof(wh);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = PHTTP_HO_WIRE_MAGIC;
+  hdr.version = PHTTP_HO_WIRE_VERSION;
+  hdr.flags = msg->tls != NULL ? PHTTP_HO_WIRE_F_TLS : 0;
+  if (http->body_pending) {
+    hdr.flags |= PHTTP_HO_WIRE_F_BODY_PENDING;
+  }
+  hdr.hdr_len = hdr_len;
+
+  hdr.seq = tcp->seq;
+  hdr.ack = tcp->ack;
+  hdr.unsentq_len = tcp->unsentq_len;
+  memcpy(hdr.self_addr, &tcp->self_addr, sizeof(hdr.self_addr));
+  hdr.self_port = tcp->self_port;
+  memcpy(hdr.peer_addr, &tcp->peer_addr, sizeof(hdr.peer_addr));
+  hdr.peer_port = tcp->peer_port;
+  hdr.mss = tcp->mss;
+  hdr.send_wscale = tcp->send_wscale;
+  hdr.recv_wscale = tcp->recv_wscale;
+  hdr.timestamp = tcp->timestamp;
+  hdr.snd_wl1 = tcp->snd_wl1;
+  hdr.snd_wnd = tcp->snd_wnd;
+  hdr.max_window = tcp->max_window;
+  hdr.rcv_wnd = tcp->rcv_wnd;
+  hdr.rcv_wup = tcp->rcv_wup;
+  hdr.options = tcp->options;
+  memcpy(hdr.congestion, tcp->congestion, sizeof(hdr.congestion));
+
+  hdr.minor_version = http->minor_version;
+  hdr.method_ofs = http->method_ofs;
+  hdr.method_len = http->method_len;
+  hdr.path_ofs = http->path_ofs;
+  hdr.path_len = http->path_len;
+  hdr.body_ofs = http->body_ofs;
+  hdr.body_len = http->body_len;
+  hdr.nheaders = http->nheaders;
+  hdr.req_len = http->req_len;
+
+  /*
+   * bufs[0] is the frame header, wire header and the header table,
+   * filled after the blob layout is known.
+   */
+  out->nbufs = 1;
+  cursor = hdr_len;
+
+  add_blob(out, &hdr.sendq, tcp->sendq, tcp->sendq_len, &cursor);
+  add_blob(out, &hdr.recvq, tcp->recvq, tcp->recvq_len, &cursor);
+  add_blob(out, &hdr.tls, msg->tls, msg->tls_len, &cursor);
+  add_blob(out, &hdr.http_buf, http->buf, http->buf_len, &cursor);
+
+  if (cursor > UINT32_MAX) {
+    return -E2BIG;
+  }
+
+  hdr.total_len = cursor;
+
+  padlen = phttp_ho_padlen(cursor);
+  frame.length = htonl(cursor);
+
+  head = out->head;
+  memcpy(head, &frame, sizeof(frame));
+  head += sizeof(frame);
+  memset(head, 0, padlen);
+  head += padlen;
+  memcpy(head, &hdr, sizeof(hdr));
+  head += sizeof(hdr);
+
+  for (uint64_t i = 0; i < http->nheaders; i++) {
+    wh.name_ofs = http->headers[i].name_ofs;
+    wh.name_len = http->headers[i].name_len;
+    wh.val_ofs = http->headers[i].val_ofs;
+    wh.val_len = http->headers[i].val_len;
+    memcpy(head, &wh, sizeof(wh));
+    head += sizeof(wh);
+  }
+
+  out->bufs[0] = uv_buf_init((char *)out->head, head - out->head);
+  out->len = sizeof(frame) + padlen + cursor;
+
+  return 0;
+}
+
+void
+phttp_ho_out_release(struct phttp_ho_out *out)
+{
+  for (int i = 0; i < TCP_STATE_NQUEUES; i++) {
+    mempool_free(out->pool, out->queues[i], out->queue_size[i]);
+    out->queues[i] = NULL;
+    out->queue_size[i] = 0;
+  }
+}
+
+int
+phttp_ho_decoder_init(struct phttp_ho_decoder *dec)
+{
+  dec->priv = NULL;
+  return 0;
+}
+
+void
+phttp_ho_decoder_deinit(struct phttp_ho_decoder *dec)
+{
+  (void)dec;
+}
+
+/*
+ * Decode the payload in place. Only the fixed size part is copied out,
+ * blobs are referenced directly from the payload.
+ */
+int
+phttp_ho_decode(struct phttp_ho_decoder *dec, const char *payload, size_t len,
+                struct phttp_ho_msg *msg)
+{
+  struct phttp_ho_wire_hdr hdr;
+  struct phttp_ho_wire_header wh;
+  const char *table;
+
+  (void)dec;
+
+  if (len < sizeof(hdr)) {
+    return -EPROTO;
+  }
+
+  memcpy(&hdr, payload, sizeof(hdr));
+
+  if (hdr.magic != PHTTP_HO_WIRE_MAGIC ||
+      hdr.version != PHTTP_HO_WIRE_VERSION) {
+    return -EPROTO;
+  }
+
+  if (hdr.total_len != len || hdr.nheaders > HTTP_HEADERS_MAX ||
+      hdr.hdr_len != sizeof(hdr) + hdr.nheaders * sizeof(wh) ||
+      hdr.hdr_len > len) {
+    return -EPROTO;
+  }
+
+  if (!blob_ok(&hdr.sendq, hdr.hdr_len, len) ||
+      !blob_ok(&hdr.recvq, hdr.hdr_len, len) ||
+      !blob_ok(&hdr.tls, hdr.hdr_len, len) ||
+      !blob_ok(&hdr.http_buf, hdr.hdr_len, len) ||
+      hdr.unsentq_len > hdr.sendq.len) {
+    return -EPROTO;
+  }
+
+  msg->tcp.seq = hdr.seq;
+  msg->tcp.ack = hdr.ack;
+  msg->tcp.sendq = (uint8_t *)payload + hdr.sendq.ofs;
+  msg->tcp.sendq_len = hdr.sendq.len;
+  msg->tcp.unsentq_len = hdr.unsentq_len;
+  msg->tcp.recvq = (uint8_t *)payload + hdr.recvq.ofs;
+  msg->tcp.recvq_len = hdr.recvq.len;
+  memcpy(&msg->tcp.self_addr, hdr.self_addr, sizeof(hdr.self_addr));
+  msg->tcp.self_port = hdr.self_port;
+  memcpy(&msg->tcp.peer_addr, hdr.peer_addr, sizeof(hdr.peer_addr));
+  msg->tcp.peer_port = hdr.peer_port;
+  msg->tcp.mss = hdr.mss;
+  msg->tcp.send_wscale = hdr.send_wscale;
+  msg->tcp.recv_wscale = hdr.recv_wscale;
+  msg->tcp.timestamp = hdr.timestamp;
+  msg->tcp.snd_wl1 = hdr.snd_wl1;
+  msg->tcp.snd_wnd = hdr.snd_wnd;
+  msg->tcp.max_window = hdr.max_window;
+  msg->tcp.rcv_wnd = hdr.rcv_wnd;
+  msg->tcp.rcv_wup = hdr.rcv_wup;
+  msg->tcp.options = hdr.options;
+  memcpy(msg->tcp.congestion, hdr.congestion, sizeof(msg->tcp.congestion));
+  msg->tcp.congestion[sizeof(msg->tcp.congestion) - 1] = '\0';
+
+  if (hdr.flags & PHTTP_HO_WIRE_F_TLS) {
+    msg->tls = (const uint8_t *)payload + hdr.tls.ofs;
+    msg->tls_len = hdr.tls.len;
+  } else {
+    msg->tls = NULL;
+    msg->tls_len = 0;
+  }
+
+  msg->http.buf = payload + hdr.http_buf.ofs;
+  msg->http.buf_len = hdr.http_buf.len;
+  msg->http.minor_version = hdr.minor_version;
+  msg->http.method_ofs = hdr.method_ofs;
+  msg->http.method_len = hdr.method_len;
+  msg->http.path_ofs = hdr.path_ofs;
+  msg->http.path_len = hdr.path_len;
+  msg->http.body_ofs = hdr.body_ofs;
+  msg->http.body_len = hdr.body_len;
+  msg->http.nheaders = hdr.nheaders;
+  msg->http.req_len = hdr.req_len;
+  msg->http.body_pending = (hdr.flags & PHTTP_HO_WIRE_F_BODY_PENDING) != 0;
+
+  table = payload + sizeof(hdr);
+  for (uint32_t i = 0; i < hdr.nheaders; i++) {
+    memcpy(&wh, table + i * sizeof(wh), sizeof(wh));
+    msg->http.headers[i].name_ofs = wh.name_ofs;
+    msg->http.headers[i].name_len = wh.name_len;
+    msg->http.headers[i].val_ofs = wh.val_ofs;
+    msg->http.headers[i].val_len = wh.val_len;
+  }
+
+  msg->raw = payload;
+  msg->raw_len = len;
+
+  return 0;
+}
@@ -0,0 +1,152 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <http.pb.h>
+
+#include <phttp_ho_msg.h>
+
+/*
+ * Protobuf (prism::HTTPHandoffReq) handoff payload. Kept for
+ * compatibility with the peers speaking the original format.
+ */
+
+/*
+ * Message under construction and its serialization, kept until the write
+ * completes
+ */
+struct pb_out {
+  prism::HTTPHandoffReq req;
+  std::string data;
+};
+
+static struct pb_out *
+get_pb_out(struct phttp_ho_out *out)
+{
+  if (out->priv == NULL) {
+    out->priv = new pb_out();
+  }
+
+  return (struct pb_out *)out->priv;
+}
+
+void
+phttp_ho_out_init(struct phttp_ho_out *out, struct mempool *pool)
+{
+  out->nbufs = 0;
+  out->len = 0;
+  out->pool = pool;
+  for (int i = 0; i < TCP_STATE_NQUEUES; i++) {
+    out->queues[i] = NULL;
+    out->queue_size[i] = 0;
+  }
+  out->priv = NULL;
+}
+
+/*
+ * Queues are captured into the TCPState of the message, so that
+ * serialization is the only copy
+ */
+uint8_t *
+phttp_ho_out_queue(void *_out, enum tcp_state_queue queue, uint64_t len)
+{
+  struct pb_out *pb = get_pb_out((struct phttp_ho_out *)_out);
+
+  return tcp_state_proto_queue(pb->req.mutable_tcp(), queue, len);
+}
+
+int
+phttp_ho_encode(const struct phttp_ho_msg *msg, struct phttp_ho_out *out)
+{
+  bool serialize_ok;
+  uint32_t padlen;
+  struct phttp_ho_header frame;
+  struct pb_out *pb = get_pb_out(out);
+  prism::HTTPHandoffReq *ho_req = &pb->req;
+  std::string *data = &pb->data;
+
+  tcp_state_to_proto(&msg->tcp, ho_req->mutable_tcp());
+
+  if (msg->tls != NULL) {
+    ho_req->mutable_tls()->set_buf(msg->tls, msg->tls_len);
+  }
+
+  http_request_state_to_proto(&msg->http, ho_req->mutable_http());
+
+  serialize_ok = ho_req->SerializeToString(data);
+  if (!serialize_ok) {
+    return -EINVAL;
+  }
+
+  padlen = phttp_ho_padlen(data->size());
+  frame.length = htonl(data->size());
+  memcpy(out->head, &frame, sizeof(frame));
+  memset(out->head + sizeof(frame), 0, padlen);
+
+  out->bufs[0] = uv_buf_init((char *)out->head, sizeof(frame) + padlen);
+  out->bufs[1] = uv_buf_init(const_cast<char *>(data->c_str()), data->size());
+  out->nbufs = 2;
+  out->len = sizeof(frame) + padlen + data->size();
+
+  return 0;
+}
+
+void
+phttp_ho_out_release(struct phttp_ho_out *out)
+{
+  delete (struct pb_out *)out->priv;
+  out->priv = NULL;
+}
+
+int
+phttp_ho_decoder_init(struct phttp_ho_decoder *dec)
+{
+  dec->priv = new prism::HTTPHandoffReq();
+  return 0;
+}
+
+void
+phttp_ho_decoder_deinit(struct phttp_ho_decoder *dec)
+{
+  delete (prism::HTTPHandoffReq *)dec->priv;
+  dec->priv = NULL;
+}
+
+/*
+ * Parses directly from the receive buffer. Pointers in the message refer
+ * to the decoder's protobuf object.
+ */
+int
+phttp_ho_decode(struct phttp_ho_decoder *dec, const char *payload, size_t len,
+                struct phttp_ho_msg *msg)
+{
+  int error;
+  prism::HTTPHandoffReq *ho_req = (prism::HTTPHandoffReq *)dec->priv;
+
+  ho_req->Clear();
+
+  if (!ho_req->ParseFromArray(payload, len)) {
+    return -EPROTO;
+  }
+
+  tcp_state_from_proto(&ho_req->tcp(), &msg->tcp);
+
+  if (ho_req->has_tls()) {
+    msg->tls = (const uint8_t *)ho_req->tls().buf().data();
+    msg->tls_len = ho_req->tls().buf().size();
+  } else {
+    msg->tls = NULL;
+    msg->tls_len = 0;
+  }
+
+  error = http_request_state_from_proto(&ho_req->http(), &msg->http);
+  if (error) {
+    return error;
+  }
+
+  msg->raw = payload;
+  msg->raw_len = len;
+
+  return 0;
+}
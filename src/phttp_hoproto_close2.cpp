@@ -12,8 +12,7 @@ after_close_tcp_monitor(uv_handle_t *_monitor)
   uv_tcp_monitor_t *monitor = (uv_tcp_monitor_t *)_monitor;
   http_client_socket_t *hcs = container_of(monitor, http_client_socket_t, monitor);  // TODO Fix this
 
-  http_client_socket_deinit(hcs);
-  free(hcs);
+  http_client_socket_destroy(hcs);
 }
 
 static void
@@ -31,7 +30,8 @@ after_real_close_imported(uv_tcp_monitor_t *monitor)
 
   del_req.type = PSW_REQ_DELETE;
   del_req.status = 0;
-  del_req.peer_addr = hcs->peername_cache.peer_addr;
+  memcpy(&del_req.peer_addr, &hcs->peername_cache.peer_addr,
+         sizeof(del_req.peer_addr));
   del_req.peer_port = hcs->peername_cache.peer_port;
 
   error = prism_switch_client_queue_task(
@@ -55,7 +55,7 @@ after_close_imported(uv_handle_t *_client)
   http_client_socket_t *hcs = (http_client_socket_t *)_client->data;
   error = uv_tcp_monitor_wait_close(&hcs->monitor, after_real_close_imported);
   assert(error == 0);
-  free(_client);
+  phttp_tcp_free(hcs->pool, (uv_tcp_t *)_client);
 }
 
 static void
@@ -63,7 +63,7 @@ after_close(uv_handle_t *_client)
 {
   http_client_socket_t *hcs = (http_client_socket_t *)_client->data;
   uv_close((uv_handle_t *)&hcs->monitor, after_close_tcp_monitor);
-  free(_client);
+  phttp_tcp_free(hcs->pool, (uv_tcp_t *)_client);
 }
 
 int
@@ -71,6 +71,8 @@ phttp_start_close(uv_tcp_t *client)
 {
   http_client_socket_t *hcs = (http_client_socket_t *)client->data;
 
+  phttp_abort_res(hcs);
+
   if (hcs->imported) {
     uv_close((uv_handle_t *)client, after_close_imported);
   } else {
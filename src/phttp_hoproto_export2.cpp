@@ -1,10 +1,13 @@
 #include <unistd.h>
+#include <cstdio>
+#include <cstring>
 
 #include <tcp_export.h>
 #include <tls_export.h>
 #include <http_export.h>
 #include <phttp_server.h>
 #include <phttp_handoff_server.h>
+#include <phttp_ho_msg.h>
 #include <phttp_prof.h>
 #include <util.h>
 
@@ -12,7 +15,7 @@
 
 #define PROF(_id)                                                              \
   do {                                                                         \
-    prof_tstamp(PROF_TYPE_EXPORT, _id, hcs->peername_cache.peer_addr,          \
+    prof_tstamp(PROF_TYPE_EXPORT, _id, &hcs->peername_cache.peer_addr,         \
                 hcs->peername_cache.peer_port);                                \
   } while (0)
 
@@ -20,10 +23,13 @@
         const typeof( ((type *)0)->member ) *__mptr = (ptr); \
         (type *)( (char *)__mptr - offsetof(type,member) );})
 
+/*
+ * Allocated on export, the TCP queues are captured straight into out
+ */
 struct handoff_ctx {
-  uv_write_t req;
-  uv_buf_t buf[2];
-  std::string *serialized_data;
+  struct phttp_ho_pending pending;
+  struct phttp_ho_out out;
+  struct phttp_ho_msg msg;
   http_client_socket_t *hcs;
 };
 
@@ -32,14 +38,24 @@ after_close_tcp_monitor(uv_handle_t *_monitor)
 {
   uv_tcp_monitor_t *monitor = (uv_tcp_monitor_t *)_monitor;
   http_client_socket_t *hcs = container_of(monitor, http_client_socket_t, monitor);  // TODO Fix this
-  http_client_socket_deinit(hcs);
-  free(hcs);
+  http_client_socket_destroy(hcs);
 }
 
 static void
-handoff_done(uv_write_t *req, int status)
+release_export_data(http_client_socket_t *hcs)
 {
-  struct handoff_ctx *ctx = (struct handoff_ctx *)req->data;
+  struct handoff_ctx *ctx = (struct handoff_ctx *)hcs->export_data;
+
+  phttp_ho_out_release(&ctx->out);
+  free((void *)ctx->msg.tls);
+  mempool_free(hcs->pool, ctx, sizeof(*ctx));
+  hcs->export_data = NULL;
+}
+
+static void
+handoff_done(struct phttp_ho_pending *p, int status)
+{
+  struct handoff_ctx *ctx = container_of(p, struct handoff_ctx, pending);
   http_client_socket_t *hcs = ctx->hcs;
 
   if (status != 0) {
@@ -50,9 +66,11 @@ handoff_done(uv_write_t *req, int status)
 
   PROF(PROF_SEND_PROTO_STATES);
 
-  delete ctx->serialized_data;
-  free(ctx->buf[0].base);
-  free(ctx);
+  /*
+   * The encoded message refers to the exported states and the request
+   * buffer of the socket, release them only after the write completes.
+   */
+  release_export_data(hcs);
 
   int evfd;
   uv_fileno((uv_handle_t *)&hcs->monitor, &evfd);
@@ -64,100 +82,97 @@ static void
 after_real_close(uv_tcp_monitor_t *monitor)
 {
   int error;
-  bool serialize_ok;
   http_client_socket_t *hcs =
     container_of(monitor, http_client_socket_t, monitor);  // TODO Fix this
   http_server_handoff_data_t *ho_data =
       (http_server_handoff_data_t *)hcs->res.handoff_data;
-  prism::HTTPHandoffReq *ho_req = (prism::HTTPHandoffReq *)hcs->export_data;
+  struct handoff_ctx *ctx = (struct handoff_ctx *)hcs->export_data;
 
   PROF(PROF_TCP_CLOSE);
 
-  struct handoff_ctx *ctx = (struct handoff_ctx *)malloc(sizeof(*ctx));
-  assert(ctx != NULL);
-
-  ctx->serialized_data = new std::string(ho_req->ByteSizeLong(), '\0');
-  serialize_ok = ho_req->SerializeToString(ctx->serialized_data);
-  assert(serialize_ok);
+  error = phttp_ho_encode(&ctx->msg, &ctx->out);
+  assert(error == 0);
   PROF(PROF_SERIALIZE);
 
-  uint32_t padlen = ctx->serialized_data->size() % 8 == 0
-                        ? 0
-                        : 8 - ctx->serialized_data->size() % 8;
-
-  struct phttp_ho_header *header =
-      (struct phttp_ho_header *)malloc(sizeof(*header) + padlen);
-  assert(header != NULL);
-  header->length = htonl(ctx->serialized_data->size());
-
-  ctx->buf[0].base = (char *)header;
-  ctx->buf[0].len = sizeof(*header) + padlen;
-  ctx->buf[1].base = const_cast<char *>(ctx->serialized_data->c_str());
-  ctx->buf[1].len = ctx->serialized_data->size();
-  ctx->hcs = hcs;
-  ctx->req.data = ctx;
+  ctx->pending.bufs = ctx->out.bufs;
+  ctx->pending.nbufs = ctx->out.nbufs;
+  ctx->pending.done = handoff_done;
 
-  error = uv_write(&ctx->req, (uv_stream_t *)&ho_data->dest, ctx->buf, 2,
-                   handoff_done);
+  error = phttp_ho_batch_write(ho_data, &ctx->pending);
   assert(error == 0);
-
-  delete ho_req;
 }
 
+/*
+ * Addresses are known since accept (or import), don't ask the socket
+ */
 static int
-export_tcp(int sock, prism::TCPState *tcp_state)
+export_tcp(int sock, struct tcp_state *tcp_state, struct handoff_ctx *ctx)
 {
-  return tcp_export(sock, tcp_state);
+  http_client_socket_t *hcs = ctx->hcs;
+  struct tcp_export_opts opts;
+
+  opts.alloc = phttp_ho_out_queue;
+  opts.arg = &ctx->out;
+  opts.self_addr = hcs->sockname_cache.self_addr;
+  opts.self_port = hcs->sockname_cache.self_port;
+  opts.peer_addr = hcs->peername_cache.peer_addr;
+  opts.peer_port = hcs->peername_cache.peer_port;
+
+  return tcp_export_state_into(sock, tcp_state, &opts);
 }
 
 static int
-export_tls(int sock, struct TLSContext *tls, prism::TLSState *tls_state)
+export_tls(int sock, struct TLSContext *tls, const uint8_t **buf,
+           uint32_t *len)
 {
   int error;
   error = tls_unmake_ktls(tls, sock);
   assert(error == 0);
-  return tls_export(tls, tls_state);
+  return tls_export_buf(tls, (uint8_t **)buf, len);
 }
 
 static int
-export_http(struct http_request *http, prism::HTTPReq *http_state)
+export_http(struct http_request *http, struct http_request_state *http_state)
 {
-  return http_request_export(http, http_state);
+  return http_request_export_state(http, http_state);
 }
 
 static int
-export_all(uv_tcp_t *client, prism::HTTPHandoffReq **ho_reqp)
+export_all(uv_tcp_t *client, struct handoff_ctx **ctxp)
 {
   int error, sock;
   http_client_socket_t *hcs = (http_client_socket_t *)client->data;
-  prism::HTTPHandoffReq *ho_req = new prism::HTTPHandoffReq();
-  prism::TCPState *tcp;
-  prism::TLSState *tls;
-  prism::HTTPReq *http;
+  struct handoff_ctx *ctx =
+      (struct handoff_ctx *)mempool_alloc(hcs->pool, sizeof(*ctx));
+  assert(ctx != NULL);
+  struct phttp_ho_msg *msg = &ctx->msg;
+
+  ctx->hcs = hcs;
+  phttp_ho_out_init(&ctx->out, hcs->pool);
 
   uv_fileno((uv_handle_t *)client, &sock);
 
-  tcp = new prism::TCPState();
-  error = export_tcp(sock, tcp);
+  error = export_tcp(sock, &msg->tcp, ctx);
   assert(error == 0);
-  ho_req->set_allocated_tcp(tcp);
   PROF(PROF_EXPORT_TCP);
 
+  msg->tls = NULL;
+  msg->tls_len = 0;
   if (hcs->tls != NULL) {
-    tls = new prism::TLSState();
-    error = export_tls(sock, hcs->tls, tls);
+    error = export_tls(sock, hcs->tls, &msg->tls, &msg->tls_len);
     assert(error == 0);
-    ho_req->set_allocated_tls(tls);
     PROF(PROF_EXPORT_TLS);
   }
 
-  http = new prism::HTTPReq();
-  error = export_http(&hcs->req, http);
+  /*
+   * Request buffer is not copied. It stays in the client socket until
+   * the handoff message is written.
+   */
+  error = export_http(&hcs->req, &msg->http);
   assert(error == 0);
-  ho_req->set_allocated_http(http);
   PROF(PROF_EXPORT_HTTP);
 
-  *ho_reqp = ho_req;
+  *ctxp = ctx;
 
   return 0;
 }
@@ -170,17 +185,122 @@ after_close(uv_handle_t *_client)
   http_client_socket_t *hcs = (http_client_socket_t *)client->data;
   error = uv_tcp_monitor_wait_close(&hcs->monitor, after_real_close);
   assert(error == 0);
-  // free(client);
+  phttp_tcp_free(hcs->pool, client);
 }
 
+/*
+ * Segments which reached the socket between the export and the switch
+ * lock were acknowledged by this host but are not in the exported
+ * receive queue. The flow is held by the switch now, so exporting the
+ * TCP state again is stable. TLS state doesn't change, records in the
+ * receive queue are not decrypted yet.
+ */
+static int
+refresh_tcp_state(uv_tcp_t *client, struct handoff_ctx *ctx)
+{
+  int error, sock;
+  bool changed;
+
+  uv_fileno((uv_handle_t *)client, &sock);
+
+  error = tcp_export_recv_changed(sock, &ctx->msg.tcp, &changed);
+  if (error != 0 || !changed) {
+    return error;
+  }
+
+  return export_tcp(sock, &ctx->msg.tcp, ctx);
+}
+
+/*
+ * Switch update and state export run concurrently, the socket is closed
+ * when both are done.
+ */
 static void
-after_configure_switch(struct psw_req_base *req, void *data)
+join_handoff(uv_tcp_t *client)
 {
   int error;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+
+  if (--hcs->ho_wait != 0) {
+    return;
+  }
+
+  error = refresh_tcp_state(client, (struct handoff_ctx *)hcs->export_data);
+  assert(error == 0);
+
+  PROF(PROF_JOIN);
+
+  uv_close((uv_handle_t *)client, after_close);
+}
+
+/*
+ * Switch didn't take the flow (e.g. it didn't answer), the connection
+ * stays here. The rule may have been applied with the reply lost, so it
+ * is undone as well. A request handed off on its headers continues to
+ * receive the body and tries again once it is complete, like after a
+ * failed phttp_start_handoff. Other ones are answered here.
+ */
+static void
+cancel_handoff(uv_tcp_t *client, struct psw_req_base *req)
+{
+  int error, sock;
+  struct global_config *gconf = (struct global_config *)client->loop->data;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_response *res = &hcs->res;
+  struct psw_lock_req undo_req;
+
+  fprintf(stderr, "Handoff cancelled, switch returned %s\n",
+          strerror(req->status));
+
+  undo_req.type = req->type == PSW_REQ_ADD ? PSW_REQ_DELETE : PSW_REQ_UNLOCK;
+  undo_req.status = 0;
+  memcpy(&undo_req.peer_addr, &hcs->peername_cache.peer_addr,
+         sizeof(undo_req.peer_addr));
+  undo_req.peer_port = hcs->peername_cache.peer_port;
+  error = prism_switch_client_queue_task(
+      gconf->sw_client, (struct psw_req_base *)&undo_req, NULL, NULL);
+  assert(error == 0);
+
+  release_export_data(hcs);
+  hcs->ho_wait = 0;
+
+  uv_fileno((uv_handle_t *)client, &sock);
+
+  error = tcp_export_cancel(sock);
+  assert(error == 0);
+
+  if (hcs->tls != NULL) {
+    error = tls_make_ktls(hcs->tls, sock);
+    assert(error == 0);
+  }
+
+  if (hcs->req.body_pending) {
+    hcs->req.body_pending = false;
+  } else {
+    res->status = 500;
+    res->reason = "Internal Server Error";
+
+    error = phttp_send_http_res(client, false);
+    if (error) {
+      hcs->closing = true;
+      hcs->hs.close(client);
+      return;
+    }
+  }
+
+  phttp_process_requests(client);
+}
+
+static void
+after_configure_switch(struct psw_req_base *req, void *data)
+{
   uv_tcp_t *client = (uv_tcp_t *)data;
   http_client_socket_t *hcs = (http_client_socket_t *)client->data;
 
-  assert(req->status == 0);
+  if (req->status != 0) {
+    cancel_handoff(client, req);
+    return;
+  }
 
   if (req->type == PSW_REQ_ADD) {
     PROF(PROF_ADD);
@@ -188,13 +308,7 @@ after_configure_switch(struct psw_req_base *req, void *data)
     PROF(PROF_LOCK);
   }
 
-  prism::HTTPHandoffReq *ho_req;
-  error = export_all(client, &ho_req);
-  assert(error == 0);
-
-  hcs->export_data = ho_req;
-
-  uv_close((uv_handle_t *)client, after_close);
+  join_handoff(client);
 }
 
 int
@@ -214,7 +328,8 @@ phttp_start_handoff(uv_tcp_t *client)
     struct psw_lock_req lock_req;
     lock_req.type = PSW_REQ_LOCK;
     lock_req.status = 0;
-    lock_req.peer_addr = hcs->peername_cache.peer_addr;
+    memcpy(&lock_req.peer_addr, &hcs->peername_cache.peer_addr,
+           sizeof(lock_req.peer_addr));
     lock_req.peer_port = hcs->peername_cache.peer_port;
 
     error = prism_switch_client_queue_task(sw_client,
@@ -222,13 +337,24 @@ phttp_start_handoff(uv_tcp_t *client)
                                            after_configure_switch, client);
   } else {
     struct psw_add_req add_req;
+    struct in6_addr server_addr;
+
+    /*
+     * Accepted on the listener of the peer's family
+     */
+    error = phttp_server_addr(
+        hcs->server_sock, tcp_addr_family(&hcs->peername_cache.peer_addr),
+        &server_addr);
+    assert(error == 0);
+
     add_req.type = PSW_REQ_ADD;
     add_req.status = 0;
-    add_req.peer_addr = hcs->peername_cache.peer_addr;
+    memcpy(&add_req.peer_addr, &hcs->peername_cache.peer_addr,
+           sizeof(add_req.peer_addr));
     add_req.peer_port = hcs->peername_cache.peer_port;
-    add_req.virtual_addr = hcs->server_sock->server_addr;
+    memcpy(&add_req.virtual_addr, &server_addr, sizeof(add_req.virtual_addr));
     add_req.virtual_port = hcs->server_sock->server_port;
-    add_req.owner_addr = hcs->server_sock->server_addr;
+    memcpy(&add_req.owner_addr, &server_addr, sizeof(add_req.owner_addr));
     add_req.owner_port = hcs->server_sock->server_port;
     memcpy(add_req.owner_mac, hcs->server_sock->server_mac, 6);
     add_req.lock = 1;
@@ -238,5 +364,23 @@ phttp_start_handoff(uv_tcp_t *client)
                                            after_configure_switch, client);
   }
 
-  return error;
+  if (error != 0) {
+    return error;
+  }
+
+  /*
+   * The switch request is on the wire (or in the batch flushed at the
+   * end of this iteration), export while waiting for the reply.
+   */
+  hcs->ho_wait = 2;
+
+  struct handoff_ctx *ctx;
+  error = export_all(client, &ctx);
+  assert(error == 0);
+
+  hcs->export_data = ctx;
+
+  join_handoff(client);
+
+  return 0;
 }
@@ -1,18 +1,40 @@
+#include <cstdio>
+#include <cstring>
+
 #include <tcp_export.h>
 #include <tls_export.h>
 #include <http_export.h>
 #include <phttp_server.h>
 #include <phttp_prof.h>
 #include <phttp_handoff_server.h>
+#include <phttp_ho_msg.h>
 #include <util.h>
 
 #include <prism_switch/prism_switch_client.h>
 
 #define PROF(_id, _peer_addr, _peer_port)                                      \
   do {                                                                         \
-    prof_tstamp(PROF_TYPE_IMPORT, _id, _peer_addr, _peer_port);                \
+    prof_tstamp(PROF_TYPE_IMPORT, _id, &(_peer_addr), _peer_port);             \
   } while (0)
 
+static void
+delete_rule(uv_loop_t *loop, const struct in6_addr *peer_addr,
+            uint32_t peer_port)
+{
+  int error;
+  struct global_config *gconf = (struct global_config *)loop->data;
+  struct psw_delete_req del_req;
+
+  del_req.type = PSW_REQ_DELETE;
+  del_req.status = 0;
+  memcpy(&del_req.peer_addr, peer_addr, sizeof(del_req.peer_addr));
+  del_req.peer_port = peer_port;
+
+  error = prism_switch_client_queue_task(
+      gconf->sw_client, (struct psw_req_base *)&del_req, NULL, NULL);
+  assert(error == 0);
+}
+
 static void
 after_change_owner(struct psw_req_base *req, void *data)
 {
@@ -20,16 +42,38 @@ after_change_owner(struct psw_req_base *req, void *data)
   uv_tcp_t *client = (uv_tcp_t *)data;
   http_client_socket_t *hcs = (http_client_socket_t *)client->data;
 
-  assert(req->status == 0);
+  /*
+   * Flow still goes to the exporter (e.g. the switch didn't answer).
+   * The rule is deleted right away rather than after the close, which
+   * waits for the peer that can't reach this host.
+   */
+  if (req->status != 0) {
+    fprintf(stderr, "Import aborted, switch returned %s\n",
+            strerror(req->status));
+    delete_rule(client->loop, &hcs->peername_cache.peer_addr,
+                hcs->peername_cache.peer_port);
+    hcs->closing = true;
+    hcs->hs.close(client);
+    return;
+  }
 
   PROF(PROF_CHOWN, hcs->peername_cache.peer_addr,
        hcs->peername_cache.peer_port);
 
-  error = uv_read_start((uv_stream_t *)client, phttp_on_alloc, phttp_on_read);
-  assert(error == 0);
+  /*
+   * Request handed off on its headers has no response yet, it is made
+   * once the body is received.
+   */
+  if (hcs->http_state == HTTP_PARSING_HEADER) {
+    error = phttp_send_http_res(client, false);
+    assert(error == 0);
+  }
 
-  error = phttp_send_http_res(client, false);
-  assert(error == 0);
+  /*
+   * Continue with the pipelined requests came with the handoff, then
+   * with the ones on the socket.
+   */
+  phttp_process_requests(client);
 }
 
 static int
@@ -43,13 +87,16 @@ start_change_owner(uv_tcp_t *client)
   /*
    * Request switch to change the owner of this flow.
    * unlock the rule since proxy hands off it immidiately.
+   * The imported socket is bound to the server address of its family.
    */
   struct psw_chown_req chown_req;
   chown_req.type = PSW_REQ_CHOWN;
   chown_req.status = 0;
-  chown_req.peer_addr = hcs->peername_cache.peer_addr;
+  memcpy(&chown_req.peer_addr, &hcs->peername_cache.peer_addr,
+         sizeof(chown_req.peer_addr));
   chown_req.peer_port = hcs->peername_cache.peer_port;
-  chown_req.owner_addr = hss->server_addr;
+  memcpy(&chown_req.owner_addr, &hcs->sockname_cache.self_addr,
+         sizeof(chown_req.owner_addr));
   chown_req.owner_port = hss->server_port;
   memcpy(chown_req.owner_mac, hss->server_mac, 6);
   chown_req.unlock = 1;
@@ -59,17 +106,17 @@ start_change_owner(uv_tcp_t *client)
 }
 
 struct forward_ctx {
-  uint32_t peer_addr;
+  struct phttp_ho_pending pending; /* must be the first member */
+  struct in6_addr peer_addr;
   uint16_t peer_port;
-  uv_write_t req;
-  uv_buf_t buf[2];
-  std::string *serialized_data;
+  uv_buf_t buf;
+  struct mempool *pool;
 };
 
 static void
-forward_done(uv_write_t *req, int status)
+forward_done(struct phttp_ho_pending *p, int status)
 {
-  struct forward_ctx *ctx = (struct forward_ctx *)req->data;
+  struct forward_ctx *ctx = (struct forward_ctx *)p;
 
   if (status != 0) {
     uv_perror("forward_done", status);
@@ -79,9 +126,8 @@ forward_done(uv_write_t *req, int status)
 
   PROF(PROF_FORWARDING, ctx->peer_addr, ctx->peer_port);
 
-  delete ctx->serialized_data;
-  free(ctx->buf[0].base);
-  free(ctx);
+  mempool_free(ctx->pool, ctx->buf.base, ctx->buf.len);
+  mempool_free(ctx->pool, ctx, sizeof(*ctx));
 }
 
 static http_server_socket_t *
@@ -94,41 +140,38 @@ ho_client_to_hss(uv_tcp_t *ho_client)
   return hhss->server_socket;
 }
 
+/*
+ * Socket and handle come from the import pool, the socket is in the
+ * repair mode already
+ */
 static int
-import_tcp(uv_loop_t *loop, uv_tcp_t **tcp, const prism::TCPState *tcp_state)
+import_tcp(const struct phttp_import_slot *slot,
+           const struct tcp_state *tcp_state)
 {
   int error;
-  *tcp = (uv_tcp_t *)malloc(sizeof(uv_tcp_t));
-  assert(*tcp != NULL);
-
-  error = uv_tcp_init(loop, *tcp);
-  assert(error == 0);
 
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
-  assert(sock != -1);
-
-  error = tcp_import(sock, tcp_state);
+  error = tcp_import_state_prepared(slot->sock, tcp_state);
   assert(error == 0);
 
-  error = uv_tcp_open(*tcp, sock);
+  error = uv_tcp_open(slot->tcp, slot->sock);
   assert(error == 0);
 
-  error = uv_tcp_nodelay(*tcp, 1);
+  error = uv_tcp_nodelay(slot->tcp, 1);
   assert(error == 0);
 
   return error;
 }
 
 static int
-import_tls(uv_tcp_t *tcp, struct TLSContext **tls,
-           const prism::TLSState *tls_state)
+import_tls(uv_tcp_t *tcp, struct TLSContext **tls, const uint8_t *buf,
+           uint32_t len)
 {
   int error, sock;
 
   *tls = tls_create_context(1, TLS_V12);
   assert(*tls != NULL);
 
-  error = tls_import(*tls, tls_state);
+  error = tls_import_buf(*tls, buf, len);
   assert(error == 0);
 
   tls_make_exportable(*tls, 1);
@@ -143,29 +186,32 @@ import_tls(uv_tcp_t *tcp, struct TLSContext **tls,
 
 static int
 continue_import(uv_loop_t *loop, uv_tcp_t **client,
-                const prism::HTTPHandoffReq *ho_req)
+                const struct phttp_ho_msg *msg)
 {
   int error;
-  http_client_socket_t *hcs = (http_client_socket_t *)malloc(sizeof(*hcs));
-  assert(hcs != NULL);
+  struct phttp_import_slot slot;
+  http_client_socket_t *hcs;
 
-  error = http_client_socket_init(hcs, true);
-  assert(error == 0);
+  phttp_import_pool_get(loop, tcp_addr_family(&msg->tcp.peer_addr), &slot);
+  hcs = slot.hcs;
+  *client = slot.tcp;
 
-  hcs->peername_cache.peer_addr = ho_req->tcp().peer_addr();
-  hcs->peername_cache.peer_port = ho_req->tcp().peer_port();
+  hcs->peername_cache.peer_addr = msg->tcp.peer_addr;
+  hcs->peername_cache.peer_port = msg->tcp.peer_port;
+  hcs->sockname_cache.self_addr = msg->tcp.self_addr;
+  hcs->sockname_cache.self_port = msg->tcp.self_port;
 
-  error = import_tcp(loop, client, &ho_req->tcp());
+  error = import_tcp(&slot, &msg->tcp);
   assert(error == 0);
 
   PROF(PROF_IMPORT_TCP, hcs->peername_cache.peer_addr,
-       hcs->peername_cache.peer_addr);
+       hcs->peername_cache.peer_port);
 
   error = uv_tcp_monitor_init(loop, &hcs->monitor, *client);
   assert(error == 0);
 
-  if (ho_req->has_tls()) {
-    error = import_tls(*client, &hcs->tls, &ho_req->tls());
+  if (msg->tls != NULL) {
+    error = import_tls(*client, &hcs->tls, msg->tls, msg->tls_len);
     assert(error == 0);
     PROF(PROF_IMPORT_TLS, hcs->peername_cache.peer_addr,
          hcs->peername_cache.peer_port);
@@ -176,53 +222,68 @@ continue_import(uv_loop_t *loop, uv_tcp_t **client,
   return 0;
 }
 
+/*
+ * Forward the message as is. Only the raw payload is copied (the receive
+ * buffer is reused for the next message), it is never re-encoded.
+ */
 static int
-forward_proto_states(struct http_response *res, prism::HTTPHandoffReq *ho_req)
+forward_proto_states(struct http_response *res, const struct phttp_ho_msg *msg)
 {
   int error;
-  bool serialize_ok;
+  uint32_t padlen;
+  struct phttp_ho_header frame;
   struct http_server_handoff_data *ho_data =
       (struct http_server_handoff_data *)res->handoff_data;
+  struct mempool *pool = phttp_loop_pool(ho_data->dest.loop);
 
-  struct forward_ctx *ctx = (struct forward_ctx *)malloc(sizeof(*ctx));
+  struct forward_ctx *ctx =
+      (struct forward_ctx *)mempool_alloc(pool, sizeof(*ctx));
   assert(ctx != NULL);
 
-  ctx->peer_addr = ho_req->tcp().peer_addr();
-  ctx->peer_port = ho_req->tcp().peer_port();
+  ctx->peer_addr = msg->tcp.peer_addr;
+  ctx->peer_port = msg->tcp.peer_port;
+  ctx->pool = pool;
 
-  ctx->serialized_data = new std::string(ho_req->ByteSizeLong(), '\0');
-  serialize_ok = ho_req->SerializeToString(ctx->serialized_data);
-  assert(serialize_ok);
-  PROF(PROF_SERIALIZE, ctx->peer_addr, ctx->peer_port);
-
-  uint32_t padlen = ctx->serialized_data->size() % 8 == 0
-                        ? 0
-                        : 8 - ctx->serialized_data->size() % 8;
+  padlen = phttp_ho_padlen(msg->raw_len);
+  ctx->buf.len = sizeof(frame) + padlen + msg->raw_len;
+  ctx->buf.base = (char *)mempool_alloc(pool, ctx->buf.len);
+  assert(ctx->buf.base != NULL);
 
-  struct phttp_ho_header *header =
-      (struct phttp_ho_header *)malloc(sizeof(*header) + padlen);
-  assert(header != NULL);
-  header->length = htonl(ctx->serialized_data->size());
+  frame.length = htonl(msg->raw_len);
+  memcpy(ctx->buf.base, &frame, sizeof(frame));
+  memset(ctx->buf.base + sizeof(frame), 0, padlen);
+  memcpy(ctx->buf.base + sizeof(frame) + padlen, msg->raw, msg->raw_len);
+  PROF(PROF_SERIALIZE, ctx->peer_addr, ctx->peer_port);
 
-  ctx->buf[0].base = (char *)header;
-  ctx->buf[0].len = sizeof(uint32_t) + padlen;
-  ctx->buf[1].base = const_cast<char *>(ctx->serialized_data->c_str());
-  ctx->buf[1].len = ctx->serialized_data->size();
-  ctx->req.data = ctx;
+  ctx->pending.bufs = &ctx->buf;
+  ctx->pending.nbufs = 1;
+  ctx->pending.done = forward_done;
 
-  error = uv_write(&ctx->req, (uv_stream_t *)&ho_data->dest, ctx->buf, 2,
-                   forward_done);
+  error = phttp_ho_batch_write(ho_data, &ctx->pending);
   assert(error == 0);
 
   return 0;
 }
 
+/*
+ * Drops a handoff this server can't import. Removing the switch rule of
+ * the connection sends its packets back to the exporter, which no longer
+ * has the socket and resets it.
+ */
+static void
+reject_handoff(uv_loop_t *loop, struct phttp_ho_msg *msg, int reason)
+{
+  fprintf(stderr, "Rejected handoff: %s\n", strerror(reason));
+  delete_rule(loop, &msg->tcp.peer_addr, msg->tcp.peer_port);
+}
+
 int
-phttp_on_handoff(uv_tcp_t *ho_client, prism::HTTPHandoffReq *ho_req)
+phttp_on_handoff(uv_tcp_t *ho_client, struct phttp_ho_msg *msg)
 {
   int error;
+  struct in6_addr self_addr;
 
-  PROF(PROF_HANDOFF, ho_req->tcp().peer_addr(), ho_req->tcp().peer_port());
+  PROF(PROF_HANDOFF, msg->tcp.peer_addr, msg->tcp.peer_port);
 
   /*
    * First, import only http request and invoke request handler.
@@ -230,26 +291,50 @@ phttp_on_handoff(uv_tcp_t *ho_client, prism::HTTPHandoffReq *ho_req)
    * to import rest of the protocol states and send response to
    * the client.
    */
-  struct http_request *req = (struct http_request *)malloc(sizeof(*req));
+  http_server_socket_t *hss = ho_client_to_hss(ho_client);
+
+  /*
+   * IPv6 connections can only be imported by the servers with the IPv6
+   * listener. Checked before the request handler runs, so a rejected
+   * request has no effects.
+   */
+  error = phttp_server_addr(hss, tcp_addr_family(&msg->tcp.peer_addr),
+                            &self_addr);
+  if (error != 0) {
+    reject_handoff(ho_client->loop, msg, error);
+    return 0;
+  }
+
+  struct mempool *pool = phttp_loop_pool(ho_client->loop);
+  struct http_request *req =
+      (struct http_request *)mempool_alloc(pool, sizeof(*req));
   assert(req != NULL);
-  error = http_request_init(req);
+  error = http_request_init(req, pool);
   assert(error == 0);
-  error = http_request_import(req, &ho_req->http());
+  http_request_set_max_headers(req, hss->max_headers);
+  error = http_request_import_state(req, &msg->http);
   assert(error == 0);
 
-  PROF(PROF_IMPORT_HTTP, ho_req->tcp().peer_addr(), ho_req->tcp().peer_port());
+  PROF(PROF_IMPORT_HTTP, msg->tcp.peer_addr, msg->tcp.peer_port);
 
-  struct http_response *res = (struct http_response *)malloc(sizeof(*res));
+  struct http_response *res =
+      (struct http_response *)mempool_alloc(pool, sizeof(*res));
   assert(res != NULL);
-  error = http_response_init(res);
+  error = http_response_init(res, pool);
   assert(error == 0);
 
-  http_server_socket_t *hss = ho_client_to_hss(ho_client);
-  error = hss->request_handler(req, res, true);
+  /*
+   * Without the body only the headers handler can tell (if there is
+   * one) whether the request is forwarded further.
+   */
+  if (!msg->http.body_pending) {
+    error = hss->request_handler(req, res, true);
+  } else if (hss->headers_handler != NULL) {
+    error = hss->headers_handler(req, res, true);
+  }
   assert(error == 0);
 
-  PROF(PROF_HANDLE_HTTP_REQ, ho_req->tcp().peer_addr(),
-       ho_req->tcp().peer_port());
+  PROF(PROF_HANDLE_HTTP_REQ, msg->tcp.peer_addr, msg->tcp.peer_port);
 
   /*
    * Handler returned ordinal http response. Import
@@ -259,19 +344,22 @@ phttp_on_handoff(uv_tcp_t *ho_client, prism::HTTPHandoffReq *ho_req)
     uv_tcp_t *client;
     http_client_socket_t *hcs;
 
-    const_cast<prism::TCPState &>(ho_req->tcp())
-        .set_self_addr(hss->server_addr);
-    const_cast<prism::TCPState &>(ho_req->tcp())
-        .set_self_port(hss->server_port);
+    msg->tcp.self_addr = self_addr;
+    msg->tcp.self_port = hss->server_port;
 
-    error = continue_import(ho_client->loop, &client, ho_req);
+    error = continue_import(ho_client->loop, &client, msg);
     assert(error == 0);
 
     hcs = (http_client_socket_t *)client->data;
-    memcpy(&hcs->req, req, sizeof(*req));
-    memcpy(&hcs->res, res, sizeof(*res));
+    http_request_move(&hcs->req, req);
+    http_response_move(&hcs->res, res);
+    hcs->res.conn = client;
     hcs->server_sock = hss;
 
+    if (hcs->req.body_pending) {
+      phttp_resume_request(client);
+    }
+
     error = start_change_owner(client);
     assert(error == 0);
 
@@ -280,8 +368,8 @@ phttp_on_handoff(uv_tcp_t *ho_client, prism::HTTPHandoffReq *ho_req)
      * copied into client socket object, we just need
      * to free container.
      */
-    free(req);
-    free(res);
+    mempool_free(pool, req, sizeof(*req));
+    mempool_free(pool, res, sizeof(*res));
 
     return 0;
   }
@@ -290,13 +378,13 @@ phttp_on_handoff(uv_tcp_t *ho_client, prism::HTTPHandoffReq *ho_req)
 
   DEBUG("3. Forward protocol states\n");
 
-  error = forward_proto_states(res, ho_req);
+  error = forward_proto_states(res, msg);
   assert(error == 0);
 
   http_request_deinit(req);
   http_response_deinit(res);
-  free(req);
-  free(res);
+  mempool_free(pool, req, sizeof(*req));
+  mempool_free(pool, res, sizeof(*res));
 
   return 0;
 }
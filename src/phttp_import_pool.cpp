@@ -0,0 +1,182 @@
+#include <assert.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <phttp_import_pool.h>
+#include <phttp_server.h>
+#include <tcp_export.h>
+
+/*
+ * Indexed by phttp_import_family
+ */
+static const int families[PHTTP_IMPORT_NFAMILIES] = {AF_INET, AF_INET6};
+
+static void
+make_slot(uv_loop_t *loop, int family, struct phttp_import_slot *slot)
+{
+  int error;
+
+  slot->sock = tcp_repair_socket(family);
+  assert(slot->sock >= 0);
+
+  slot->tcp = phttp_tcp_alloc(loop);
+  error = uv_tcp_init(loop, slot->tcp);
+  assert(error == 0);
+
+  /*
+   * on_walk of the apps closes the TCP handles with data through
+   * http_socket
+   */
+  slot->tcp->data = NULL;
+
+  slot->hcs = http_client_socket_create(loop, true);
+}
+
+static void
+on_slot_close(uv_handle_t *handle)
+{
+  phttp_tcp_free(phttp_loop_pool(handle->loop), (uv_tcp_t *)handle);
+}
+
+static void
+free_slot(struct phttp_import_slot *slot)
+{
+  close(slot->sock);
+  uv_close((uv_handle_t *)slot->tcp, on_slot_close);
+  http_client_socket_destroy(slot->hcs);
+}
+
+static bool
+refill(uv_loop_t *loop, struct phttp_import_pool *pool, int f)
+{
+  if (!pool->active[f]) {
+    return true;
+  }
+
+  for (int i = 0;
+       i < PHTTP_IMPORT_POOL_REFILL_BATCH && pool->nslots[f] < pool->size;
+       i++) {
+    make_slot(loop, families[f], pool->slots[f] + pool->nslots[f]);
+    pool->nslots[f]++;
+  }
+
+  return pool->nslots[f] == pool->size;
+}
+
+static void
+on_idle(uv_idle_t *idle)
+{
+  int error;
+  struct phttp_import_pool *pool = (struct phttp_import_pool *)idle->data;
+  bool full = true;
+
+  for (int f = 0; f < PHTTP_IMPORT_NFAMILIES; f++) {
+    full = refill(idle->loop, pool, f) && full;
+  }
+
+  if (full) {
+    error = uv_idle_stop(idle);
+    assert(error == 0);
+  }
+}
+
+static void
+pool_init(uv_loop_t *loop, struct phttp_import_pool *pool)
+{
+  int error;
+  struct global_config *gconf = (struct global_config *)loop->data;
+
+  pool->size = gconf->ho_import_pool;
+  if (pool->size == 0) {
+    pool->size = PHTTP_IMPORT_POOL_DEFAULT;
+  } else if (pool->size > PHTTP_IMPORT_POOL_MAX) {
+    pool->size = PHTTP_IMPORT_POOL_MAX;
+  }
+
+  for (int f = 0; f < PHTTP_IMPORT_NFAMILIES; f++) {
+    pool->active[f] = f == PHTTP_IMPORT_IPV4;
+    pool->nslots[f] = 0;
+  }
+
+  error = uv_idle_init(loop, &pool->idle);
+  assert(error == 0);
+
+  pool->idle.data = pool;
+
+  /*
+   * Refill alone shouldn't keep the loop alive
+   */
+  uv_unref((uv_handle_t *)&pool->idle);
+
+  pool->initialized = true;
+}
+
+static struct phttp_import_pool *
+get_pool(uv_loop_t *loop)
+{
+  struct global_config *gconf = (struct global_config *)loop->data;
+  struct phttp_import_pool *pool = &gconf->import_pool;
+
+  if (!pool->initialized) {
+    pool_init(loop, pool);
+  }
+
+  return pool;
+}
+
+void
+phttp_import_pool_start(uv_loop_t *loop)
+{
+  int error;
+  struct phttp_import_pool *pool = get_pool(loop);
+
+  error = uv_idle_start(&pool->idle, on_idle);
+  assert(error == 0);
+}
+
+void
+phttp_import_pool_get(uv_loop_t *loop, int family,
+                      struct phttp_import_slot *slot)
+{
+  int error;
+  struct phttp_import_pool *pool = get_pool(loop);
+  int f = family == AF_INET6 ? PHTTP_IMPORT_IPV6 : PHTTP_IMPORT_IPV4;
+
+  if (pool->stopped) {
+    make_slot(loop, family, slot);
+    return;
+  }
+
+  pool->active[f] = true;
+
+  if (pool->nslots[f] != 0) {
+    *slot = pool->slots[f][--pool->nslots[f]];
+  } else {
+    make_slot(loop, family, slot);
+  }
+
+  error = uv_idle_start(&pool->idle, on_idle);
+  assert(error == 0);
+}
+
+void
+phttp_import_pool_stop(uv_loop_t *loop)
+{
+  struct global_config *gconf = (struct global_config *)loop->data;
+  struct phttp_import_pool *pool = &gconf->import_pool;
+
+  if (!pool->initialized || pool->stopped) {
+    return;
+  }
+
+  for (int f = 0; f < PHTTP_IMPORT_NFAMILIES; f++) {
+    for (uint32_t i = 0; i < pool->nslots[f]; i++) {
+      free_slot(pool->slots[f] + i);
+    }
+    pool->nslots[f] = 0;
+    pool->active[f] = false;
+  }
+
+  uv_close((uv_handle_t *)&pool->idle, NULL);
+  pool->stopped = true;
+}
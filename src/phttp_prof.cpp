@@ -1,44 +1,239 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
 #include <cstdbool>
-#include <vector>
+#include <ctime>
 #include <unistd.h>
-#include <sys/time.h>
+#include <pthread.h>
+#include <phttp_clock.h>
 #include <phttp_prof.h>
+#include <phttp_stats.h>
 
-bool initialized = false;
-FILE *export_side;
-FILE *import_side;
+static const char *prof_id_names[PROF_NR_IDS] = {
+    "RECEIVE_HTTP_REQ",  "LOCK",        "ADD",
+    "EXPORT_TCP",        "EXPORT_TLS",  "EXPORT_HTTP",
+    "JOIN",              "TCP_CLOSE",   "SERIALIZE",
+    "SEND_PROTO_STATES", "HANDOFF",     "IMPORT_HTTP",
+    "HANDLE_HTTP_REQ",   "IMPORT_TCP",  "IMPORT_TLS",
+    "CHOWN",             "FORWARDING",  "HTTP_RES",
+};
+
+const char *
+prof_id_name(enum prof_ids id)
+{
+  if (id >= PROF_NR_IDS) {
+    return "UNKNOWN";
+  }
+
+  return prof_id_names[id];
+}
+
+#ifdef PHTTP_PROF
+
+/*
+ * Single producer (owner thread), single consumer (drain thread) ring.
+ * Records are dropped when the ring is full, the number of the dropped
+ * records is reported at exit.
+ */
+struct prof_ring {
+  struct prof_ring *next;
+  uint64_t head; /* written by the owner thread */
+  uint64_t tail; /* written by the drain thread */
+  uint64_t dropped;
+  struct prof_record records[PROF_RING_SIZE];
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_ring *rings;
+static FILE *out;
+static pthread_t drain_thread;
+static bool running;
+static thread_local struct prof_ring *my_ring;
+
+static void
+drain_ring(struct prof_ring *ring)
+{
+  uint64_t head, tail, n;
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  tail = ring->tail;
+
+  while (tail != head) {
+    /*
+     * Write up to the end of the ring at once
+     */
+    n = head - tail;
+    if ((tail % PROF_RING_SIZE) + n > PROF_RING_SIZE) {
+      n = PROF_RING_SIZE - (tail % PROF_RING_SIZE);
+    }
+
+    fwrite(ring->records + (tail % PROF_RING_SIZE), sizeof(struct prof_record),
+           n, out);
+    tail += n;
+  }
+
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void
+drain_all(void)
+{
+  pthread_mutex_lock(&rings_lock);
+  for (struct prof_ring *r = rings; r != NULL; r = r->next) {
+    drain_ring(r);
+  }
+  fflush(out);
+  pthread_mutex_unlock(&rings_lock);
+}
+
+static void *
+drain_main(void *arg)
+{
+  (void)arg;
+
+  while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    usleep(PROF_DRAIN_INTERVAL_MS * 1000);
+    drain_all();
+  }
+
+  return NULL;
+}
+
+static void
+prof_fini(void)
+{
+  uint64_t dropped = 0;
+
+  if (out == NULL) {
+    return;
+  }
+
+  __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+  pthread_join(drain_thread, NULL);
+  drain_all();
+
+  for (struct prof_ring *r = rings; r != NULL; r = r->next) {
+    dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  }
+
+  if (dropped != 0) {
+    fprintf(stderr, "prof: %lu records dropped, ring is full\n", dropped);
+  }
+
+  fclose(out);
+  out = NULL;
+}
+
+/*
+ * Workers are forked after the parent may have profiled. Child starts
+ * over with its own file and thread, rings of the parent are abandoned.
+ */
+static void
+prof_atfork_child(void)
+{
+  pthread_mutex_init(&rings_lock, NULL);
+  rings = NULL;
+  my_ring = NULL;
+  out = NULL;
+  running = false;
+}
+
+static void
+prof_init_locked(void)
+{
+  char fname[64];
+  struct prof_file_header hdr;
+  static bool registered = false;
+
+  snprintf(fname, sizeof(fname), "/tmp/prism_prof_%d.bin", getpid());
+  out = fopen(fname, "w");
+  if (out == NULL) {
+    perror("prof: fopen");
+    abort();
+  }
+
+  memcpy(hdr.magic, PROF_FILE_MAGIC, sizeof(hdr.magic));
+  hdr.version = PROF_FILE_VERSION;
+  hdr.pid = getpid();
+  hdr.mono_ns = phttp_clock_ns();
+  hdr.realtime_ns = phttp_clock_read_ns(CLOCK_REALTIME);
+  fwrite(&hdr, sizeof(hdr), 1, out);
+
+  if (!registered) {
+    pthread_atfork(NULL, NULL, prof_atfork_child);
+    atexit(prof_fini);
+    registered = true;
+  }
+
+  running = true;
+  pthread_create(&drain_thread, NULL, drain_main, NULL);
+}
+
+static struct prof_ring *
+prof_ring_create(void)
+{
+  struct prof_ring *ring = (struct prof_ring *)calloc(1, sizeof(*ring));
+  if (ring == NULL) {
+    perror("prof: calloc");
+    abort();
+  }
+
+  pthread_mutex_lock(&rings_lock);
+  if (out == NULL) {
+    prof_init_locked();
+  }
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+
+  return ring;
+}
+#endif
+
+static inline uint32_t
+fold_addr(const struct in6_addr *addr)
+{
+  if (IN6_IS_ADDR_V4MAPPED(addr)) {
+    return addr->s6_addr32[3];
+  }
+
+  return addr->s6_addr32[0] ^ addr->s6_addr32[1] ^ addr->s6_addr32[2] ^
+         addr->s6_addr32[3];
+}
 
 void
-prof_tstamp(enum prof_types type, enum prof_ids id, uint32_t peer_addr,
-            uint16_t peer_port)
+prof_tstamp(enum prof_types type, enum prof_ids id,
+            const struct in6_addr *addr, uint16_t peer_port)
 {
+  uint64_t now = phttp_clock_ns();
+  uint32_t peer_addr = fold_addr(addr);
+
+  phttp_stats_record(id, peer_addr, peer_port, now);
+
 #ifdef PHTTP_PROF
-  FILE *f;
-  struct timeval tstamp;
-
-  if (!initialized) {
-    char fname[64] = {0};
-    sprintf(fname, "/tmp/prism_prof_export_%d.csv", getpid());
-    export_side = fopen(fname, "w");
-    sprintf(fname, "/tmp/prism_prof_import_%d.csv", getpid());
-    import_side = fopen(fname, "w");
-    initialized = true;
-  }
-
-  if (type == PROF_TYPE_EXPORT) {
-    f = export_side;
-  } else {
-    f = import_side;
-  }
-
-  gettimeofday(&tstamp, NULL);
-  fprintf(f, "%d,0x%x:%u,%03d.%06d\n", id, peer_addr, peer_port,
-          (int)(tstamp.tv_sec % 1000), (int)tstamp.tv_usec);
-  fflush(f);
-#else
-  return;
+  struct prof_ring *ring = my_ring;
+  struct prof_record *rec;
+  uint64_t head;
+
+  if (ring == NULL) {
+    ring = my_ring = prof_ring_create();
+  }
+
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+      PROF_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  rec = ring->records + (head % PROF_RING_SIZE);
+  rec->tstamp_ns = now;
+  rec->peer_addr = peer_addr;
+  rec->peer_port = peer_port;
+  rec->type = type;
+  rec->id = id;
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 #endif
 }
@@ -1,10 +1,16 @@
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <strings.h>
 #include <queue>
 #include <unistd.h>
 #include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
 
 #include <http_export.h>
 #include <phttp_handoff_server.h>
@@ -17,7 +23,7 @@
 
 #define PROF(_id)                                                              \
   do {                                                                         \
-    prof_tstamp(PROF_TYPE_EXPORT, _id, hcs->peername_cache.peer_addr,          \
+    prof_tstamp(PROF_TYPE_EXPORT, _id, &hcs->peername_cache.peer_addr,         \
                 hcs->peername_cache.peer_port);                                \
   } while (0)
 
@@ -32,7 +38,8 @@ http_client_socket_deinit(http_client_socket_t *hcs)
 }
 
 int
-http_client_socket_init(http_client_socket_t *hcs, bool import)
+http_client_socket_init(http_client_socket_t *hcs, struct mempool *pool,
+                        bool import)
 {
   int error;
 
@@ -41,243 +48,1419 @@ http_client_socket_init(http_client_socket_t *hcs, bool import)
 
   hcs->tls = NULL;
   hcs->http_state = HTTP_PARSING_HEADER;
+  hcs->pool = pool;
 
   if (!import) {
-    error = http_request_init(&hcs->req);
+    error = http_request_init(&hcs->req, pool);
     assert(error == 0);
-    error = http_response_init(&hcs->res);
+    error = http_response_init(&hcs->res, pool);
     assert(error == 0);
   }
 
   hcs->imported = import;
   /* hcs->monitor uninitialized here */
+  hcs->export_data = NULL;
+  hcs->ho_wait = 0;
+  hcs->ho_request = false;
+  hcs->reading = false;
+  hcs->res_pending = false;
+  hcs->keep_alive = true;
+  hcs->closing = false;
   /* hcs->wreq uninitialized here */
   /* hcs->wbufs uninitialized here */
-  hcs->peername_cache.peer_addr = 0;
+  hcs->body_sent = 0;
+  hcs->body_poll = NULL;
+  hcs->zerocopy = false;
+  hcs->zc_enabled = false;
+  hcs->zc_off = false;
+  hcs->zc_nsent = 0;
+  hcs->zc_ncompleted = 0;
+  hcs->streaming = false;
+  hcs->stream_blocked = false;
+  hcs->peername_cache.peer_addr = in6addr_any;
   hcs->peername_cache.peer_port = 0;
+  hcs->sockname_cache.self_addr = in6addr_any;
+  hcs->sockname_cache.self_port = 0;
   /* hcs->server_socket uninitialized here */
 
   return 0;
 }
 
+http_client_socket_t *
+http_client_socket_create(uv_loop_t *loop, bool import)
+{
+  int error;
+  struct mempool *pool = phttp_loop_pool(loop);
+  http_client_socket_t *hcs =
+      (http_client_socket_t *)mempool_alloc(pool, sizeof(*hcs));
+  assert(hcs != NULL);
+
+  error = http_client_socket_init(hcs, pool, import);
+  assert(error == 0);
+
+  return hcs;
+}
+
+void
+http_client_socket_destroy(http_client_socket_t *hcs)
+{
+  struct mempool *pool = hcs->pool;
+  http_client_socket_deinit(hcs);
+  mempool_free(pool, hcs, sizeof(*hcs));
+}
+
+uv_tcp_t *
+phttp_tcp_alloc(uv_loop_t *loop)
+{
+  uv_tcp_t *tcp;
+
+  tcp = (uv_tcp_t *)mempool_alloc(phttp_loop_pool(loop), sizeof(*tcp));
+  assert(tcp != NULL);
+  return tcp;
+}
+
+void
+phttp_tcp_free(struct mempool *pool, uv_tcp_t *tcp)
+{
+  mempool_free(pool, tcp, sizeof(*tcp));
+}
+
 void
 phttp_on_alloc(uv_handle_t *_client, size_t suggested_size, uv_buf_t *buf)
 {
   uv_tcp_t *client = (uv_tcp_t *)_client;
   http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_request *req = &hcs->req;
+
+  /*
+   * Reclaim the room of the finished pipelined requests first, then
+   * grow buffer when it is still not enough. Buffers start small and
+   * double in size, the larger blocks come from the per-loop pool.
+   */
+  if (membuf_avail(&req->mem) < 1024) {
+    http_request_compact(req);
+  }
+
+  if (membuf_avail(&req->mem) < 1024) {
+    http_request_grow(req, membuf_used(&req->mem));
+  }
+
+  buf->base = req->mem.cur;
+  buf->len = membuf_avail(&req->mem);
+}
+
+static void
+set_reading(uv_tcp_t *client, bool reading)
+{
+  int error;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+
+  if (hcs->reading == reading) {
+    return;
+  }
+
+  if (reading) {
+    error = uv_read_start((uv_stream_t *)client, phttp_on_alloc, phttp_on_read);
+  } else {
+    error = uv_read_stop((uv_stream_t *)client);
+  }
+  assert(error == 0);
+
+  hcs->reading = reading;
+}
+
+/*
+ * Response of the current request is handed to the kernel. Move on to
+ * the next request, or close the connection when it is not persistent.
+ */
+static void
+finish_http_res(uv_tcp_t *client)
+{
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_request *req = &hcs->req;
+  struct http_response *res = &hcs->res;
+
+  PROF(PROF_HTTP_RES);
+
+  if (res->after_res) {
+    res->after_res(res);
+  }
+
+  hcs->res_pending = false;
+  hcs->streaming = false;
+  hcs->stream_blocked = false;
+
+  http_request_next(req);
+  http_response_reset(res);
+
+  if (!hcs->keep_alive) {
+    hcs->closing = true;
+    hcs->hs.close(client);
+  }
+}
+
+static void
+after_close_body_poll(uv_handle_t *handle)
+{
+  mempool_free(phttp_loop_pool(handle->loop), handle, sizeof(uv_poll_t));
+}
+
+static void
+release_body_poll(http_client_socket_t *hcs)
+{
+  int fd;
+
+  if (hcs->body_poll == NULL) {
+    return;
+  }
+
+  uv_poll_stop(hcs->body_poll);
+  uv_fileno((uv_handle_t *)hcs->body_poll, &fd);
+  close(fd);
+  uv_close((uv_handle_t *)hcs->body_poll, after_close_body_poll);
+  hcs->body_poll = NULL;
+}
+
+/*
+ * Connection is going away with the response unfinished. Let go of the
+ * body poll, tell a streaming producer to stop and run after_res, which
+ * releases what the response refers to (e.g. body_fd).
+ */
+void
+phttp_abort_res(http_client_socket_t *hcs)
+{
+  struct http_response *res = &hcs->res;
+
+  release_body_poll(hcs);
+
+  if (hcs->streaming) {
+    hcs->streaming = false;
+    if (res->stream_cb != NULL && !res->chunked_done) {
+      res->stream_cb(res, UV_ECANCELED);
+    }
+  }
+
+  if (res->after_res != NULL) {
+    res->after_res(res);
+    res->after_res = NULL;
+  }
+}
+
+static int send_body(uv_tcp_t *client);
+static void stream_check_drain(uv_tcp_t *client);
+
+static int
+sock_error(int sock)
+{
+  int error, sock_err = 0;
+  socklen_t len = sizeof(sock_err);
+
+  error = getsockopt(sock, SOL_SOCKET, SO_ERROR, &sock_err, &len);
+  if (error == -1) {
+    return uv_translate_sys_error(errno);
+  }
+
+  return sock_err != 0 ? uv_translate_sys_error(sock_err) : 0;
+}
+
+/*
+ * Count the zerocopy completions in the error queue of the socket.
+ * Each notification covers a range of sendmsg calls.
+ */
+static int
+reap_zerocopy(http_client_socket_t *hcs, int sock)
+{
+  ssize_t ret;
+  char control[128];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ret = recvmsg(sock, &msg, MSG_ERRQUEUE);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN) {
+        break;
+      }
+
+      return uv_translate_sys_error(errno);
+    }
+
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL) {
+      continue;
+    }
+
+    serr = (struct sock_extended_err *)CMSG_DATA(cm);
+    if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+      return serr->ee_errno != 0 ? uv_translate_sys_error(serr->ee_errno)
+                                 : UV_EIO;
+    }
+
+    hcs->zc_ncompleted += serr->ee_data - serr->ee_info + 1;
+
+    /*
+     * Kernel had to copy anyway (e.g. loopback or a device without
+     * scatter-gather), zerocopy only adds the notification cost here.
+     */
+    if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+      hcs->zc_off = true;
+    }
+  }
+
+  return 0;
+}
+
+static void
+on_body_poll(uv_poll_t *poll, int status, int events)
+{
+  int error, sock;
+  uv_tcp_t *client = (uv_tcp_t *)poll->data;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+
+  error = status;
 
   /*
-   * Grow buffer when it is not enough. This may have
-   * unacceptable performance penalty. Need to tune
-   * default buffer length when we see frequent grow.
+   * libuv reports POLLERR as UV_EBADF (and stops the handle), but
+   * zerocopy notifications raise POLLERR too. It is a real error only
+   * when the socket says so after the queue is drained.
    */
-  if (membuf_avail(&hcs->req.mem) < 1024) {
-    fprintf(stderr, "Warning: Memory growing occured\n");
-    membuf_grow(&hcs->req.mem, 4096);
+  if (error == UV_EBADF && hcs->zerocopy) {
+    uv_fileno((uv_handle_t *)client, &sock);
+    error = reap_zerocopy(hcs, sock);
+    if (error == 0) {
+      error = sock_error(sock);
+    }
+  }
+
+  if (error == 0) {
+    error = send_body(client);
+    if (error == UV_EAGAIN) {
+      return;
+    }
+  }
+
+  if (error != 0) {
+    uv_perror("on_body_poll", error);
+    hcs->closing = true;
+    hcs->hs.close(client);
+    return;
+  }
+
+  finish_http_res(client);
+
+  phttp_process_requests(client);
+}
+
+/*
+ * The socket is already watched by the loop through the uv_tcp_t, which
+ * libuv doesn't allow a uv_poll_t to share. Poll on a duplicate of it
+ * instead, it refers to the same socket.
+ */
+static int
+wait_body_poll(uv_tcp_t *client, int sock, int events)
+{
+  int error, fd;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  uv_poll_t *poll = hcs->body_poll;
+
+  if (poll == NULL) {
+    fd = dup(sock);
+    if (fd == -1) {
+      return uv_translate_sys_error(errno);
+    }
+
+    poll = (uv_poll_t *)mempool_alloc(hcs->pool, sizeof(*poll));
+    assert(poll != NULL);
+
+    error = uv_poll_init(client->loop, poll, fd);
+    assert(error == 0);
+
+    poll->data = client;
+    hcs->body_poll = poll;
+  }
+
+  error = uv_poll_start(poll, events, on_body_poll);
+  assert(error == 0);
+
+  return UV_EAGAIN;
+}
+
+/*
+ * Send the rest of the file body straight from the page cache. Over
+ * TLS the socket is kTLS by now, the kernel encrypts on the way out.
+ * Returns UV_EAGAIN when the socket is full, on_body_poll takes over
+ * from there.
+ */
+static int
+send_body_file(uv_tcp_t *client)
+{
+  int error, sock;
+  ssize_t nsent;
+  off_t ofs;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_response *res = &hcs->res;
+
+  error = uv_fileno((uv_handle_t *)client, &sock);
+  assert(error == 0);
+
+  while (hcs->body_sent < res->body_len) {
+    ofs = res->body_ofs + hcs->body_sent;
+    nsent = sendfile(sock, res->body_fd, &ofs, res->body_len - hcs->body_sent);
+    if (nsent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN) {
+        return wait_body_poll(client, sock, UV_WRITABLE);
+      }
+
+      return uv_translate_sys_error(errno);
+    }
+
+    /*
+     * File is shorter than promised by Content-Length
+     */
+    if (nsent == 0) {
+      return UV_EOF;
+    }
+
+    hcs->body_sent += nsent;
+  }
+
+  release_body_poll(hcs);
+
+  return 0;
+}
+
+/*
+ * Send the in-memory body with MSG_ZEROCOPY. The kernel refers to the
+ * pages of the body until it notifies the completion, so the response
+ * (and its body_mem) is held until every sendmsg is accounted for.
+ */
+static int
+send_body_zerocopy(uv_tcp_t *client)
+{
+  int error, sock, flags = MSG_ZEROCOPY;
+  ssize_t nsent;
+  char *body;
+  uint64_t body_len;
+  struct iovec iov;
+  struct msghdr msg;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_response *res = &hcs->res;
+
+  error = uv_fileno((uv_handle_t *)client, &sock);
+  assert(error == 0);
+
+  if (res->body_kind == HTTP_BODY_SHARED) {
+    body = res->body_shared->buf + res->body_ofs;
+  } else {
+    body = res->body_mem.begin;
+  }
+  body_len = http_response_body_len(res);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  while (hcs->body_sent < body_len) {
+    iov.iov_base = body + hcs->body_sent;
+    iov.iov_len = body_len - hcs->body_sent;
+
+    nsent = sendmsg(sock, &msg, flags);
+    if (nsent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN) {
+        return wait_body_poll(client, sock, UV_WRITABLE);
+      }
+
+      /*
+       * Out of option memory for the notifications, copy the rest
+       */
+      if (errno == ENOBUFS && flags != 0) {
+        flags = 0;
+        continue;
+      }
+
+      return uv_translate_sys_error(errno);
+    }
+
+    if (flags != 0) {
+      hcs->zc_nsent++;
+    }
+
+    hcs->body_sent += nsent;
+  }
+
+  error = reap_zerocopy(hcs, sock);
+  if (error != 0) {
+    return error;
+  }
+
+  /*
+   * Notifications come with POLLERR which is always polled, the
+   * requested event is a placeholder that doesn't fire on a plain
+   * TCP socket.
+   */
+  if (hcs->zc_ncompleted != hcs->zc_nsent) {
+    return wait_body_poll(client, sock, UV_PRIORITIZED);
+  }
+
+  release_body_poll(hcs);
+
+  return 0;
+}
+
+/*
+ * Body parts which bypass uv_write, after the headers are out
+ */
+static inline bool
+body_is_direct(http_client_socket_t *hcs)
+{
+  return hcs->res.body_kind == HTTP_BODY_FILE || hcs->zerocopy;
+}
+
+static int
+send_body(uv_tcp_t *client)
+{
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+
+  if (hcs->zerocopy) {
+    return send_body_zerocopy(client);
+  }
+
+  return send_body_file(client);
+}
+
+/*
+ * Zerocopy pays off only for large bodies, below the threshold pinning
+ * the pages and handling the notification costs more than the copy.
+ * kTLS doesn't take MSG_ZEROCOPY, TLS connections always copy.
+ */
+static bool
+use_zerocopy(uv_tcp_t *client)
+{
+  int error, sock, one = 1;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_response *res = &hcs->res;
+  uint64_t threshold = hcs->server_sock->zerocopy_threshold;
+
+  if (threshold == 0 || hcs->tls != NULL || hcs->zc_off ||
+      res->body_kind == HTTP_BODY_FILE || res->chunked ||
+      http_response_body_len(res) < threshold) {
+    return false;
+  }
+
+  if (!hcs->zc_enabled) {
+    error = uv_fileno((uv_handle_t *)client, &sock);
+    assert(error == 0);
+
+    error = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+    if (error == -1) {
+      hcs->zc_off = true;
+      return false;
+    }
+
+    hcs->zc_enabled = true;
+  }
+
+  return true;
+}
+
+static void
+after_send_http_res(uv_write_t *wreq, int status)
+{
+  int error;
+  uv_tcp_t *client = (uv_tcp_t *)wreq->handle;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+
+  if (status != 0) {
+    uv_perror("after_send_http_res", status);
+    hcs->closing = true;
+    hcs->hs.close(client);
+    return;
+  }
+
+  /*
+   * Headers of a streaming response are out, the rest comes with
+   * phttp_stream_write
+   */
+  if (hcs->streaming) {
+    stream_check_drain(client);
+    return;
+  }
+
+  if (body_is_direct(hcs)) {
+    error = send_body(client);
+    if (error == UV_EAGAIN) {
+      return;
+    }
+
+    if (error != 0) {
+      uv_perror("send_body", error);
+      hcs->closing = true;
+      hcs->hs.close(client);
+      return;
+    }
+  }
+
+  finish_http_res(client);
+
+  phttp_process_requests(client);
+}
+
+static void
+after_send_continue_res(uv_write_t *wreq, int status)
+{
+  uv_tcp_t *client = (uv_tcp_t *)wreq->handle;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_response *res = &hcs->res;
+
+  assert(status == 0);
+
+  http_response_reset(res);
+}
+
+/*
+ * Small responses usually fit in the socket buffer, write them right
+ * away so that the next pipelined request can be handled in the same
+ * loop iteration. The rest goes through uv_write. File and zerocopy
+ * bodies follow the buffers.
+ */
+static int
+write_http_res(uv_tcp_t *client, uv_buf_t *bufs, unsigned int nbufs)
+{
+  int error, written;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+
+  /*
+   * uv_write still writes right away on an empty queue. Its callback
+   * is where a streaming producer gets resumed.
+   */
+  if (hcs->streaming) {
+    return uv_write(&hcs->wreq, (uv_stream_t *)client, bufs, nbufs,
+                    after_send_http_res);
+  }
+
+  written = uv_try_write((uv_stream_t *)client, bufs, nbufs);
+  if (written < 0 && written != UV_EAGAIN) {
+    return written;
+  }
+
+  if (written < 0) {
+    written = 0;
+  }
+
+  while (nbufs > 0 && (size_t)written >= bufs->len) {
+    written -= bufs->len;
+    bufs++;
+    nbufs--;
+  }
+
+  if (nbufs == 0) {
+    if (body_is_direct(hcs)) {
+      error = send_body(client);
+      if (error == UV_EAGAIN) {
+        return 0;
+      }
+
+      if (error != 0) {
+        return error;
+      }
+    }
+
+    finish_http_res(client);
+    return 0;
+  }
+
+  bufs->base += written;
+  bufs->len -= written;
+
+  return uv_write(&hcs->wreq, (uv_stream_t *)client, bufs, nbufs,
+                  after_send_http_res);
+}
+
+static inline void
+res_append(struct membuf *mem, const char *buf, size_t len)
+{
+  memcpy(mem->cur, buf, len);
+  mem->cur += len;
+}
+
+#define RES_APPEND_STR(_mem, _str) res_append(_mem, _str, sizeof(_str) - 1)
+
+/*
+ * Response goes out as (at most) four buffers without formatting
+ * passes: the pre-rendered status line, the constant header set of the
+ * handler, the per-response headers (with the cached Date of the loop)
+ * copied into res->mem and the body (body_mem or a shared buffer, file
+ * bodies follow with sendfile). Responses with a non-standard status
+ * line take the slow path which renders the status line into res->mem.
+ */
+int
+phttp_send_http_res(uv_tcp_t *client, bool continue_res)
+{
+  int error, nprinted;
+  uint64_t need;
+  bool user_conn = false;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_request *req = &hcs->req;
+  struct http_response *res = &hcs->res;
+  struct membuf *mem = &res->mem;
+  struct membuf *body_mem = &res->body_mem;
+  const struct http_status_line *sl;
+  const struct phttp_date *date;
+  const struct http_header_set *set = continue_res ? NULL : res->header_set;
+  struct http_header *h;
+  unsigned int nsend = 0;
+  uv_buf_t *wbufs = hcs->wbufs;
+
+  sl = http_status_line_lookup(res->status, res->reason);
+
+  /*
+   * Room for the per-response part, grown only when the user headers
+   * (or the rendered status line) don't fit.
+   */
+  need = 128 + PHTTP_DATE_LEN;
+  if (sl == NULL) {
+    need += strlen(res->reason) + (set != NULL ? set->len : 0);
+  }
+
+  for (uint32_t i = 0; i < res->nheaders; i++) {
+    need += res->headers[i].name_len + res->headers[i].val_len + 4;
+  }
+
+  if (membuf_avail(mem) < need) {
+    membuf_grow(mem, need);
+  }
+
+  if (sl != NULL) {
+    wbufs[nsend++] =
+        uv_buf_init((char *)sl->line, continue_res ? sl->status_len : sl->len);
+    if (set != NULL) {
+      wbufs[nsend++] = uv_buf_init(set->buf, set->len);
+    }
+  } else {
+    if (continue_res) {
+      nprinted = snprintf(mem->cur, membuf_avail(mem), "HTTP/1.1 %u %s\r\n",
+                          res->status, res->reason);
+    } else {
+      nprinted = snprintf(mem->cur, membuf_avail(mem),
+                          "HTTP/1.1 %u %s\r\n"
+                          "Server: Prism\r\n",
+                          res->status, res->reason);
+    }
+    assert(nprinted > 0 && (uint64_t)nprinted < membuf_avail(mem));
+    membuf_consume(mem, (uint64_t)nprinted);
+
+    if (set != NULL) {
+      res_append(mem, set->buf, set->len);
+    }
+  }
+
+  if (!continue_res) {
+    if (res->chunked) {
+      RES_APPEND_STR(mem, "Transfer-Encoding: chunked\r\n");
+    } else {
+      RES_APPEND_STR(mem, "Content-Length: ");
+      mem->cur += http_u64toa(http_response_body_len(res), mem->cur);
+      RES_APPEND_STR(mem, "\r\n");
+    }
+
+    /*
+     * Copied rather than referenced as a buffer of its own, the timer
+     * may re-render it while an async write is still queued.
+     */
+    date = phttp_loop_date(client->loop);
+    res_append(mem, date->buf, PHTTP_DATE_LEN);
+
+    hcs->keep_alive = true;
+
+    /* Print user supplied headers */
+    for (uint32_t i = 0; i < res->nheaders; i++) {
+      h = res->headers + i;
+      res_append(mem, h->name, h->name_len);
+      RES_APPEND_STR(mem, ": ");
+      res_append(mem, h->val, h->val_len);
+      RES_APPEND_STR(mem, "\r\n");
+
+      if (h->name_len == 10 && strncasecmp(h->name, "Connection", 10) == 0) {
+        user_conn = true;
+        if (h->val_len == 5 && strncasecmp(h->val, "close", 5) == 0) {
+          hcs->keep_alive = false;
+        }
+      }
+    }
+
+    /*
+     * Handler may close the connection with its own Connection header,
+     * otherwise it follows the request.
+     */
+    if (!user_conn) {
+      hcs->keep_alive = http_request_keep_alive(req);
+      if (!hcs->keep_alive) {
+        RES_APPEND_STR(mem, "Connection: close\r\n");
+      } else if (req->minor_version == 0) {
+        RES_APPEND_STR(mem, "Connection: keep-alive\r\n");
+      }
+    }
+  }
+
+  RES_APPEND_STR(mem, "\r\n");
+
+  wbufs[nsend++] = uv_buf_init(mem->begin, membuf_used(mem));
+
+  hcs->zerocopy = !continue_res && use_zerocopy(client);
+
+  if (!continue_res && !hcs->zerocopy) {
+    if (res->body_kind == HTTP_BODY_MEM && membuf_used(body_mem) != 0) {
+      wbufs[nsend++] = uv_buf_init(body_mem->begin, membuf_used(body_mem));
+    } else if (res->body_kind == HTTP_BODY_SHARED && res->body_len != 0) {
+      wbufs[nsend++] = uv_buf_init(res->body_shared->buf + res->body_ofs,
+                                   res->body_len);
+    }
+  }
+
+  if (continue_res) {
+    error = uv_write(&hcs->wreq, (uv_stream_t *)client, wbufs, nsend,
+                     after_send_continue_res);
+    assert(error == 0);
+    return 0;
+  }
+
+  hcs->res_pending = true;
+  hcs->body_sent = 0;
+  hcs->streaming = res->chunked && !res->chunked_done;
+  hcs->stream_blocked =
+      hcs->streaming && membuf_used(body_mem) > PHTTP_STREAM_HIGH_WATERMARK;
+
+  return write_http_res(client, wbufs, nsend);
+}
+
+/*
+ * Chunk copied into a single pool block, freed when written
+ */
+struct stream_chunk {
+  uv_write_t wreq;
+  uv_buf_t bufs[2];
+  uint64_t size;
+  char hdr[20];
+};
+
+static void
+stream_check_drain(uv_tcp_t *client)
+{
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_response *res = &hcs->res;
+
+  if (!hcs->stream_blocked ||
+      uv_stream_get_write_queue_size((uv_stream_t *)client) >
+          PHTTP_STREAM_LOW_WATERMARK) {
+    return;
+  }
+
+  hcs->stream_blocked = false;
+  if (res->stream_cb != NULL) {
+    res->stream_cb(res, 0);
+  }
+}
+
+static void
+after_stream_write(uv_write_t *wreq, int status)
+{
+  struct stream_chunk *chunk = (struct stream_chunk *)wreq;
+  uv_tcp_t *client = (uv_tcp_t *)wreq->handle;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+
+  mempool_free(hcs->pool, chunk, chunk->size);
+
+  if (status != 0) {
+    if (!hcs->closing) {
+      uv_perror("after_stream_write", status);
+      hcs->closing = true;
+      hcs->hs.close(client);
+    }
+    return;
   }
 
-  buf->base = hcs->req.mem.cur;
-  buf->len = membuf_avail(&hcs->req.mem);
+  if (hcs->streaming) {
+    stream_check_drain(client);
+  }
 }
 
+/*
+ * Writes complete in order, the response is done with the last chunk
+ */
 static void
-after_send_http_res(uv_write_t *wreq, int status)
+after_stream_end(uv_write_t *wreq, int status)
 {
   uv_tcp_t *client = (uv_tcp_t *)wreq->handle;
+
+  after_stream_write(wreq, status);
+  if (status != 0) {
+    return;
+  }
+
+  finish_http_res(client);
+
+  phttp_process_requests(client);
+}
+
+static int
+stream_write_chunk(uv_tcp_t *client, const char *buf, uint64_t len,
+                   uv_write_cb cb)
+{
+  int hlen;
+  uint64_t size;
+  char *data;
+  struct stream_chunk *chunk;
   http_client_socket_t *hcs = (http_client_socket_t *)client->data;
-  struct http_request *req = &hcs->req;
-  struct http_response *res = &hcs->res;
 
-  assert(status == 0);
+  size = sizeof(*chunk) + len + 2;
+  chunk = (struct stream_chunk *)mempool_alloc(hcs->pool, size);
+  assert(chunk != NULL);
 
-  PROF(PROF_HTTP_RES);
+  chunk->size = size;
+  data = (char *)(chunk + 1);
 
-  if (res->after_res) {
-    res->after_res(res);
+  hlen = snprintf(chunk->hdr, sizeof(chunk->hdr), "%lx\r\n", len);
+  if (len != 0) {
+    memcpy(data, buf, len);
   }
+  memcpy(data + len, "\r\n", 2);
 
-  http_request_reset(req);
-  http_response_reset(res);
+  chunk->bufs[0] = uv_buf_init(chunk->hdr, hlen);
+  chunk->bufs[1] = uv_buf_init(data, len + 2);
+
+  return uv_write(&chunk->wreq, (uv_stream_t *)client, chunk->bufs, 2, cb);
+}
+
+int
+phttp_stream_begin(struct http_request *req, struct http_response *res,
+                   int (*cb)(struct http_response *, int), void *data)
+{
+  if (req->minor_version == 0) {
+    return -ENOTSUP;
+  }
+
+  assert(res->body_kind == HTTP_BODY_MEM);
+  assert(membuf_used(&res->body_mem) == 0);
+
+  res->chunked = true;
+  res->chunked_done = false;
+  res->stream_cb = cb;
+  res->stream_data = data;
+
+  return 0;
+}
+
+static inline http_client_socket_t *
+stream_hcs(struct http_response *res)
+{
+  uv_tcp_t *client = (uv_tcp_t *)res->conn;
+  http_client_socket_t *hcs;
+
+  if (client == NULL) {
+    return NULL;
+  }
+
+  hcs = (http_client_socket_t *)client->data;
+
+  return hcs->streaming ? hcs : NULL;
 }
 
+/*
+ * Until the headers are out the chunks are encoded into body_mem and
+ * sent along with them.
+ */
 static void
-after_send_continue_res(uv_write_t *wreq, int status)
+stream_append_chunk(struct http_response *res, const char *buf, uint64_t len)
 {
-  uv_tcp_t *client = (uv_tcp_t *)wreq->handle;
-  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
-  struct http_response *res = &hcs->res;
+  struct membuf *body_mem = &res->body_mem;
 
-  assert(status == 0);
+  if (membuf_avail(body_mem) < len + 32) {
+    membuf_grow(body_mem, len + 32);
+  }
 
-  http_response_reset(res);
+  body_mem->cur += snprintf(body_mem->cur, 20, "%lx\r\n", len);
+  memcpy(body_mem->cur, buf, len);
+  body_mem->cur += len;
+  memcpy(body_mem->cur, "\r\n", 2);
+  body_mem->cur += 2;
 }
 
 int
-phttp_send_http_res(uv_tcp_t *client, bool continue_res)
+phttp_stream_write(struct http_response *res, const char *buf, uint64_t len)
 {
-  int error, nprinted;
-  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
-  struct http_response *res = &hcs->res;
-  struct membuf *mem = &res->mem;
-  struct membuf *body_mem = &res->body_mem;
-  uv_write_cb after_res;
+  int error;
+  uv_tcp_t *client = (uv_tcp_t *)res->conn;
+  http_client_socket_t *hcs = stream_hcs(res);
 
-  if (continue_res) {
-    nprinted = snprintf(mem->cur, membuf_avail(mem),
-                        "HTTP/1.1 %u %s\r\n",
-                        res->status, res->reason);
-    assert(nprinted > 0 && (uint64_t)nprinted < membuf_avail(mem));
-    membuf_consume(mem, (uint64_t)nprinted);
-    after_res = after_send_continue_res;
+  assert(res->chunked && !res->chunked_done);
+
+  /*
+   * Zero length chunk would end the body
+   */
+  if (len == 0) {
+    return 0;
+  }
+
+  if (hcs == NULL) {
+    stream_append_chunk(res, buf, len);
+    return 0;
+  }
+
+  if (hcs->closing) {
+    return UV_ECANCELED;
+  }
+
+  error = stream_write_chunk(client, buf, len, after_stream_write);
+  if (error != 0) {
+    return error;
+  }
+
+  if (uv_stream_get_write_queue_size((uv_stream_t *)client) >
+      PHTTP_STREAM_HIGH_WATERMARK) {
+    hcs->stream_blocked = true;
+  }
+
+  return 0;
+}
+
+/*
+ * False when the producer should stop and wait for the callback
+ */
+bool
+phttp_stream_writable(struct http_response *res)
+{
+  uv_tcp_t *client = (uv_tcp_t *)res->conn;
+  http_client_socket_t *hcs = stream_hcs(res);
+  uint64_t queued;
+
+  if (hcs == NULL) {
+    queued = membuf_used(&res->body_mem);
   } else {
-    /* Print boiler plate headers */
-    nprinted = snprintf(mem->cur, membuf_avail(mem),
-                        "HTTP/1.1 %u %s\r\n"
-                        "Server: Prism\r\n",
-                        res->status, res->reason);
-    assert(nprinted > 0 && (uint64_t)nprinted < membuf_avail(mem));
-    membuf_consume(mem, (uint64_t)nprinted);
+    queued = uv_stream_get_write_queue_size((uv_stream_t *)client);
+  }
 
-    nprinted = snprintf(mem->cur, membuf_avail(mem), "Content-Length: %lu\r\n",
-                        membuf_used(body_mem));
-    assert(nprinted > 0 && (uint64_t)nprinted < membuf_avail(mem));
-    membuf_consume(mem, (uint64_t)nprinted);
+  if (queued > PHTTP_STREAM_HIGH_WATERMARK) {
+    /*
+     * Before the headers are out, phttp_send_http_res sees the same
+     * body_mem and blocks the stream there.
+     */
+    if (hcs != NULL) {
+      hcs->stream_blocked = true;
+    }
+    return false;
+  }
 
-    /* Print user supplied headers */
-    struct http_header *h;
-    for (uint32_t i = 0; i < res->nheaders; i++) {
-      h = res->headers + i;
-      assert(h->name_len <= INT_MAX && h->val_len <= INT_MAX);
-      nprinted = snprintf(mem->cur, membuf_avail(mem), "%.*s: %.*s\r\n",
-                          (int)h->name_len, h->name, (int)h->val_len, h->val);
-      assert(nprinted > 0 && (uint64_t)nprinted < membuf_avail(mem));
-      membuf_consume(mem, (uint64_t)nprinted);
+  return true;
+}
+
+int
+phttp_stream_end(struct http_response *res)
+{
+  uv_tcp_t *client = (uv_tcp_t *)res->conn;
+  http_client_socket_t *hcs = stream_hcs(res);
+
+  assert(res->chunked && !res->chunked_done);
+
+  res->chunked_done = true;
+
+  if (hcs == NULL) {
+    if (membuf_avail(&res->body_mem) < 5) {
+      membuf_grow(&res->body_mem, 5);
     }
+    RES_APPEND_STR(&res->body_mem, "0\r\n\r\n");
+    return 0;
+  }
 
-    after_res = after_send_http_res;
+  if (hcs->closing) {
+    return UV_ECANCELED;
   }
 
-  assert(membuf_avail(mem) > 2);
-  memcpy(mem->cur, "\r\n", 2);
-  membuf_consume(mem, 2);
+  hcs->streaming = false;
 
-  unsigned int nsend = 1;
-  uv_write_t *wreq = &hcs->wreq;
-  uv_buf_t *wbufs = hcs->wbufs;
-  wbufs[0].base = mem->begin;
-  wbufs[0].len = membuf_used(mem);
+  return stream_write_chunk(client, NULL, 0, after_stream_end);
+}
+
+#undef RES_APPEND_STR
+
+static uint64_t
+max_body_len(http_client_socket_t *hcs)
+{
+  uint64_t max = hcs->server_sock->max_body;
+
+  return max != 0 ? max : HTTP_BODY_DEFAULT_MAX;
+}
+
+/*
+ * Set up receiving the body of the request whose headers are parsed,
+ * http_state stays HTTP_PARSING_HEADER when the request has no body.
+ * Returns the status to refuse the request with (400 for a malformed
+ * Content-Length, 413 for one over max_len) or 0.
+ */
+static uint32_t
+start_request_body(http_client_socket_t *hcs, uint64_t max_len)
+{
+  struct http_request *req = &hcs->req;
+  uint64_t body_len;
 
-  if (membuf_used(body_mem) != 0) {
-    nsend++;
-    wbufs[1].base = body_mem->begin;
-    wbufs[1].len = membuf_used(body_mem);
+  if (http_request_is_chunked(req)) {
+    http_request_start_chunked(req);
+    hcs->http_state = HTTP_RECEIVING_CHUNKED;
+    return 0;
   }
 
-  error =
-      uv_write(wreq, (uv_stream_t *)client, wbufs, nsend, after_res);
-  assert(error == 0);
+  req->len = req->header_len;
+
+  if (http_request_determine_body_len(req, &body_len) != 0) {
+    return 400;
+  }
+
+  if (body_len > max_len) {
+    return 413;
+  }
+
+  if (body_len == 0) {
+    return 0;
+  }
+
+  req->len += body_len;
+  req->body = req->mem.begin + req->ofs + req->header_len;
+  req->body_len = body_len;
+  hcs->http_state = HTTP_RECEIVING_BODY;
 
   return 0;
 }
 
-void
-phttp_on_read(uv_stream_t *_client, ssize_t nread, const uv_buf_t *buf)
+/*
+ * Answer the request with an error and close. The body is not read, so
+ * the rest of the stream can't be parsed.
+ */
+static void
+refuse_request(uv_tcp_t *client, uint32_t status)
 {
-  int error, nparsed;
-  uint64_t body_len;
-  uv_tcp_t *client = (uv_tcp_t *)_client;
+  int error;
   http_client_socket_t *hcs = (http_client_socket_t *)client->data;
   struct http_request *req = &hcs->req;
   struct http_response *res = &hcs->res;
-  struct membuf *mem = &hcs->req.mem;
 
-  if (nread == 0) {
-    return;
+  req->len = req->header_len;
+  req->body = NULL;
+  req->body_len = 0;
+  req->body_cb = NULL;
+  hcs->http_state = HTTP_PARSING_HEADER;
+
+  res->conn = client;
+  res->status = status;
+  if (status == 413) {
+    res->reason = "Payload Too Large";
+  } else {
+    res->reason = "Bad Request";
   }
+  http_response_add_header(res, "Connection", 10, "close", 5);
 
-  if (nread < 0) {
-    uv_perror("on_read", (int)nread);
+  error = phttp_send_http_res(client, false);
+  if (error) {
+    hcs->closing = true;
     hcs->hs.close(client);
-    return;
   }
+}
 
-  error = membuf_consume(mem, (size_t)nread);
-  assert(error == 0);
+/*
+ * Continue with the body of a request which was handed off on its
+ * headers. The request handler runs once the body is complete, as for
+ * an imported request.
+ */
+void
+phttp_resume_request(uv_tcp_t *client)
+{
+  uint32_t status;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_request *req = &hcs->req;
+
+  assert(req->body_pending);
+
+  req->body_pending = false;
+  hcs->ho_request = true;
 
   /*
-   * We may have TLS decryption here
+   * Length was checked by the exporter
    */
+  status = start_request_body(hcs, UINT64_MAX);
+  assert(status == 0 && hcs->http_state != HTTP_PARSING_HEADER);
+}
 
-  switch (hcs->http_state) {
-  case HTTP_PARSING_HEADER:
-    nparsed = http_parse_request(req);
-    if (nparsed == -1) {
-      fprintf(stderr, "HTTP request parsing failed\n");
-      hcs->hs.close(client);
-      return;
-    } else if (nparsed == -2) {
+/*
+ * Handle the complete requests in the buffer one by one. Responses go
+ * out in the request order since the next request is taken only after
+ * the response of the previous one is handed to the kernel. While a
+ * response is waiting for the socket, reading is paused, so a client
+ * pipelining faster than it reads can't grow the buffer without bound.
+ */
+void
+phttp_process_requests(uv_tcp_t *client)
+{
+  int error, nparsed;
+  uint32_t status;
+  bool last;
+  char *data;
+  uint64_t body_len, n;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct http_request *req = &hcs->req;
+  struct http_response *res = &hcs->res;
+  struct membuf *mem = &hcs->req.mem;
+
+  while (!hcs->closing) {
+    if (hcs->res_pending) {
+      set_reading(client, false);
       return;
     }
 
-    /*
-     * Parsing done, go to next state
-     */
-    body_len = http_request_determine_body_len(req);
-    if (body_len == 0) {
-      break;
-    } else {
-      req->body = mem->prev + nparsed;
-      req->body_len = body_len;
-      hcs->http_state = HTTP_RECEIVING_BODY;
-    }
+    switch (hcs->http_state) {
+    case HTTP_PARSING_HEADER:
+      if (req->ofs == membuf_used(mem)) {
+        set_reading(client, true);
+        return;
+      }
+
+      nparsed = http_parse_request(req);
+      if (nparsed == -1) {
+        fprintf(stderr, "HTTP request parsing failed\n");
+        hcs->closing = true;
+        hcs->hs.close(client);
+        return;
+      } else if (nparsed == -2) {
+        set_reading(client, true);
+        return;
+      }
 
-  case HTTP_RECEIVING_BODY:
-    if ((uint64_t)(mem->cur - req->body) == req->body_len) {
-      hcs->http_state = HTTP_PARSING_HEADER;
-      break;
-    } else if ((uint64_t)(mem->cur - req->body) > req->body_len) {
       /*
-       * Unacceptable request format, may be oversized body or
-       * pipelining. Abort request.
+       * Parsing done, go to next state
        */
-      printf("Unacceptable request format!\n");
-      hcs->hs.close(client);
-      return;
-    } else {
+      req->header_len = nparsed;
+
+      status = start_request_body(hcs, max_body_len(hcs));
+      if (status != 0) {
+        refuse_request(client, status);
+        return;
+      }
+
+      if (hcs->http_state == HTTP_PARSING_HEADER) {
+        break;
+      }
+
       /*
-       * Request is incomplete, continue receiving.
+       * Let the handler look at the headers before the body arrives
        */
-      return;
-    }
+      if (hcs->server_sock->headers_handler != NULL) {
+        res->conn = client;
+        error = hcs->server_sock->headers_handler(req, res, false);
+        assert(error == 0);
+
+        /*
+         * Hand off on the headers. The body is not buffered here, it
+         * follows on the connection (what is already read goes with
+         * the request buffer).
+         */
+        if (res->status == 600) {
+          req->body_cb = NULL;
+          req->body_pending = true;
+          set_reading(client, false);
+          if (phttp_start_handoff(client) == 0) {
+            return;
+          }
+
+          /*
+           * Buffer the body and try again once it is complete
+           */
+          req->body_pending = false;
+        }
+      }
 
-    break;
+      /*
+       * Make room for the body at once rather than doubling the
+       * buffer many times while receiving it. The length is the
+       * client's word, the larger bodies grow as they arrive.
+       */
+      body_len = std::min(req->body_len, (uint64_t)HTTP_BODY_RESERVE_MAX);
+      if (hcs->http_state == HTTP_RECEIVING_BODY && req->body_cb == NULL &&
+          (uint64_t)(mem->cur - req->body) < body_len) {
+        http_request_reserve(req, body_len - (mem->cur - req->body));
+      }
+
+      continue;
+
+    case HTTP_RECEIVING_BODY:
+      n = mem->cur - req->body;
+
+      if (req->body_cb != NULL) {
+        n = std::min(n, req->body_len - req->body_recv);
+        last = req->body_recv + n == req->body_len;
+
+        if (n != 0 || last) {
+          error = req->body_cb(req, req->body, n, last);
+          if (error != 0) {
+            hcs->closing = true;
+            hcs->hs.close(client);
+            return;
+          }
+
+          http_request_drop_body(req, n);
+          req->body_recv += n;
+        }
+
+        if (!last) {
+          set_reading(client, true);
+          return;
+        }
+
+        req->len = req->header_len;
+        req->body = NULL;
+      } else if (n < req->body_len) {
+        /*
+         * Request is incomplete, continue receiving.
+         */
+        set_reading(client, true);
+        return;
+      }
 
-  default:
-    fprintf(stderr, "Unknown HTTP state\n");
-    break;
-  }
+      /*
+       * Bytes after the body are the next pipelined request
+       */
+      hcs->http_state = HTTP_PARSING_HEADER;
+      break;
 
-  error = hcs->server_sock->request_handler(req, res, false);
-  assert(error == 0);
+    case HTTP_RECEIVING_CHUNKED:
+      error = http_request_decode_chunked(req, &data, &n);
+      if (error == -1) {
+        fprintf(stderr, "HTTP chunked body decoding failed\n");
+        hcs->closing = true;
+        hcs->hs.close(client);
+        return;
+      }
+
+      last = error == 0;
+
+      if (req->body_cb == NULL && req->body_len > max_body_len(hcs)) {
+        refuse_request(client, 413);
+        return;
+      }
+
+      if (req->body_cb != NULL && (n != 0 || last)) {
+        error = req->body_cb(req, data, n, last);
+        if (error != 0) {
+          hcs->closing = true;
+          hcs->hs.close(client);
+          return;
+        }
+
+        http_request_drop_body(req, n);
+        req->body_recv += n;
+        req->body_len = 0;
+      }
+
+      if (!last) {
+        set_reading(client, true);
+        return;
+      }
+
+      req->len = req->header_len + req->body_len;
+
+      if (req->body_cb != NULL) {
+        req->body_len = req->body_recv;
+      }
+
+      if (req->body_cb != NULL || req->body_len == 0) {
+        req->body = NULL;
+      }
 
-  /*
-   * Our own special status code for invoking handoff
-   */
-  if (res->status == 600) {
-    error = phttp_start_handoff(client);
+      hcs->http_state = HTTP_PARSING_HEADER;
+      break;
+
+    default:
+      fprintf(stderr, "Unknown HTTP state\n");
+      break;
+    }
+
+    /*
+     * Handoff may be decided on the headers already
+     */
+    if (res->status != 600) {
+      res->conn = client;
+      error = hcs->server_sock->request_handler(req, res, hcs->ho_request);
+      assert(error == 0);
+      hcs->ho_request = false;
+    }
+
+    /*
+     * Our own special status code for invoking handoff
+     */
+    if (res->status == 600) {
+      set_reading(client, false);
+      error = phttp_start_handoff(client);
+      if (error) {
+        res->status = 500;
+        res->reason = "Internal Server Error";
+      } else {
+        /*
+         * Rest of the pipelined requests go with the handoff
+         */
+        return;
+      }
+    }
+
+    error = phttp_send_http_res(client, false);
     if (error) {
-      res->status = 500;
-      res->reason = "Internal Server Error";
-    } else {
+      printf("Error returned from HTTP handler!\n");
+      hcs->closing = true;
+      hcs->hs.close(client);
       return;
     }
   }
+}
 
-  error = phttp_send_http_res(client, false);
-  if (error) {
-    printf("Error returned from HTTP handler!\n");
+void
+phttp_on_read(uv_stream_t *_client, ssize_t nread, const uv_buf_t *buf)
+{
+  int error;
+  uv_tcp_t *client = (uv_tcp_t *)_client;
+  http_client_socket_t *hcs = (http_client_socket_t *)client->data;
+  struct membuf *mem = &hcs->req.mem;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    uv_perror("on_read", (int)nread);
+    hcs->closing = true;
     hcs->hs.close(client);
+    return;
   }
+
+  error = membuf_consume(mem, (size_t)nread);
+  assert(error == 0);
+
+  /*
+   * We may have TLS decryption here
+   */
+
+  phttp_process_requests(client);
 }
 
 static void
@@ -359,22 +1542,21 @@ on_tls_handshake_read(uv_stream_t *_client, ssize_t nread, const uv_buf_t *buf)
 static void
 on_connection(uv_stream_t *_server, int status)
 {
-  int error;
-  struct sockaddr_in peeraddr;
+  int error, family;
+  struct sockaddr_storage peeraddr;
   int peeraddr_len = sizeof(peeraddr);
+  struct in6_addr self_addr;
 
   assert(status == 0);
 
-  uv_tcp_t *client = (uv_tcp_t *)malloc(sizeof(*client));
-  http_client_socket_t *hcs = (http_client_socket_t *)malloc(sizeof(*hcs));
-  assert(client != NULL && hcs != NULL);
-
-  error = http_client_socket_init(hcs, false);
-  assert(error == 0);
+  uv_tcp_t *client = phttp_tcp_alloc(_server->loop);
+  http_client_socket_t *hcs = http_client_socket_create(_server->loop, false);
 
   hcs->server_sock = (http_server_socket_t *)_server->data;
   client->data = hcs;
 
+  http_request_set_max_headers(&hcs->req, hcs->server_sock->max_headers);
+
   error = uv_tcp_init(_server->loop, client);
   assert(error == 0);
 
@@ -402,16 +1584,52 @@ on_connection(uv_stream_t *_server, int status)
   error = uv_read_start((uv_stream_t *)client, alloc_cb, read_cb);
   assert(error == 0);
 
+  hcs->reading = true;
+
   error =
       uv_tcp_getpeername(client, (struct sockaddr *)&peeraddr, &peeraddr_len);
   assert(error == 0);
 
-  hcs->peername_cache.peer_addr = peeraddr.sin_addr.s_addr;
-  hcs->peername_cache.peer_port = peeraddr.sin_port;
+  error = tcp_addr_from_sockaddr((struct sockaddr *)&peeraddr,
+                                 &hcs->peername_cache.peer_addr,
+                                 &hcs->peername_cache.peer_port);
+  assert(error == 0);
+
+  /*
+   * Listeners are bound to the server address of their family
+   */
+  family = tcp_addr_family(&hcs->peername_cache.peer_addr);
+  error = phttp_server_addr(hcs->server_sock, family, &self_addr);
+  assert(error == 0);
+
+  if (family == AF_INET ? hcs->server_sock->server_addr != INADDR_ANY
+                        : !IN6_IS_ADDR_UNSPECIFIED(&self_addr)) {
+    hcs->sockname_cache.self_addr = self_addr;
+    hcs->sockname_cache.self_port = hcs->server_sock->server_port;
+  }
 }
 
 int
-phttp_server_init(uv_loop_t *loop, http_server_socket_t *hss)
+phttp_server_addr(const http_server_socket_t *hss, int family,
+                  struct in6_addr *addr)
+{
+  if (family == AF_INET) {
+    tcp_addr_set_ipv4(addr, hss->server_addr);
+    return 0;
+  }
+
+  if (family != AF_INET6 || !hss->server_ipv6) {
+    return EAFNOSUPPORT;
+  }
+
+  *addr = hss->server_addr6;
+
+  return 0;
+}
+
+static void
+server_listen(uv_loop_t *loop, http_server_socket_t *hss,
+              const struct sockaddr *addr, unsigned int flags)
 {
   int error, sock, opt = 1;
 
@@ -420,7 +1638,7 @@ phttp_server_init(uv_loop_t *loop, http_server_socket_t *hss)
 
   server->data = hss;
 
-  error = uv_tcp_init_ex(loop, server, AF_INET);
+  error = uv_tcp_init_ex(loop, server, addr->sa_family);
   assert(error == 0);
 
   uv_fileno((uv_handle_t *)server, &sock);
@@ -434,16 +1652,34 @@ phttp_server_init(uv_loop_t *loop, http_server_socket_t *hss)
   error = uv_tcp_simultaneous_accepts(server, 1);
   assert(error == 0);
 
+  error = uv_tcp_bind(server, addr, flags);
+  assert(error == 0);
+
+  error = uv_listen((uv_stream_t *)server, hss->backlog, on_connection);
+  assert(error == 0);
+}
+
+int
+phttp_server_init(uv_loop_t *loop, http_server_socket_t *hss)
+{
   struct sockaddr_in addr;
+  struct sockaddr_in6 addr6;
+
+  memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = hss->server_addr;
   addr.sin_port = hss->server_port;
 
-  error = uv_tcp_bind(server, (struct sockaddr *)&addr, sizeof(addr));
-  assert(error == 0);
+  server_listen(loop, hss, (struct sockaddr *)&addr, 0);
 
-  error = uv_listen((uv_stream_t *)server, hss->backlog, on_connection);
-  assert(error == 0);
+  if (hss->server_ipv6) {
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_addr = hss->server_addr6;
+    addr6.sin6_port = hss->server_port;
+
+    server_listen(loop, hss, (struct sockaddr *)&addr6, UV_TCP_IPV6ONLY);
+  }
 
   return 0;
 }
@@ -0,0 +1,438 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <phttp_stats.h>
+
+static struct phttp_stats_shm *shm;
+static thread_local struct phttp_stats_slot *my_slot;
+
+/*
+ * Last profiling point of the flows seen by this thread. Direct mapped,
+ * a collision just loses the sample.
+ */
+#define FLOW_TABLE_SIZE 4096
+
+struct flow_ent {
+  uint64_t key;
+  uint64_t last_ns;
+  uint64_t start_ns;
+};
+
+static thread_local struct flow_ent flow_table[FLOW_TABLE_SIZE];
+
+int
+phttp_stats_init(void)
+{
+  void *mem;
+
+  if (shm != NULL) {
+    return 0;
+  }
+
+  mem = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return -errno;
+  }
+
+  shm = (struct phttp_stats_shm *)mem;
+  shm->nslots = PHTTP_STATS_MAX_SLOTS;
+  shm->next_slot = 0;
+
+  return 0;
+}
+
+static struct phttp_stats_slot *
+claim_slot(void)
+{
+  uint32_t idx;
+
+  if (shm == NULL) {
+    int error = phttp_stats_init();
+    assert(error == 0);
+  }
+
+  /*
+   * Slots are shared when there are more workers than slots. Updates
+   * are atomic, so it only mixes their numbers.
+   */
+  idx = __atomic_fetch_add(&shm->next_slot, 1, __ATOMIC_RELAXED);
+
+  return shm->slots + (idx % shm->nslots);
+}
+
+static inline int
+hist_idx(uint64_t val)
+{
+  int exp;
+
+  if (val < PHTTP_HIST_SUB) {
+    return val;
+  }
+
+  exp = 63 - __builtin_clzl(val);
+  if (exp > PHTTP_HIST_MAX_EXP) {
+    return PHTTP_HIST_NBUCKETS - 1;
+  }
+
+  return (exp - PHTTP_HIST_SUB_BITS + 1) * PHTTP_HIST_SUB +
+         ((val >> (exp - PHTTP_HIST_SUB_BITS)) & (PHTTP_HIST_SUB - 1));
+}
+
+/*
+ * Lowest value of the bucket
+ */
+static inline uint64_t
+hist_val(int idx)
+{
+  int exp;
+
+  if (idx < PHTTP_HIST_SUB) {
+    return idx;
+  }
+
+  exp = idx / PHTTP_HIST_SUB + PHTTP_HIST_SUB_BITS - 1;
+
+  return (uint64_t)(PHTTP_HIST_SUB + idx % PHTTP_HIST_SUB)
+         << (exp - PHTTP_HIST_SUB_BITS);
+}
+
+void
+phttp_stats_hist_add(struct phttp_hist *hist, uint64_t val)
+{
+  __atomic_fetch_add(&hist->buckets[hist_idx(val)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->sum, val, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t
+phttp_stats_hist_quantile(const struct phttp_hist *hist, double q)
+{
+  uint64_t rank, seen = 0;
+
+  if (hist->count == 0) {
+    return 0;
+  }
+
+  rank = (uint64_t)(q * (hist->count - 1)) + 1;
+
+  for (int i = 0; i < PHTTP_HIST_NBUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank) {
+      return hist_val(i);
+    }
+  }
+
+  return hist_val(PHTTP_HIST_NBUCKETS - 1);
+}
+
+void
+phttp_stats_record(enum prof_ids id, uint32_t peer_addr, uint16_t peer_port,
+                   uint64_t now_ns)
+{
+  struct phttp_stats_slot *slot = my_slot;
+  uint64_t key = ((uint64_t)peer_addr << 16) | peer_port;
+  struct flow_ent *ent;
+
+  if (slot == NULL) {
+    slot = my_slot = claim_slot();
+  }
+
+  ent = flow_table + ((key * 0x9e3779b97f4a7c15UL) >> 52);
+
+  switch (id) {
+  case PROF_RECEIVE_HTTP_REQ:
+  case PROF_HANDOFF:
+    ent->key = key;
+    ent->start_ns = now_ns;
+    ent->last_ns = now_ns;
+    return;
+  default:
+    break;
+  }
+
+  if (ent->key != key || ent->last_ns == 0) {
+    return;
+  }
+
+  phttp_stats_hist_add(slot->hists + id, now_ns - ent->last_ns);
+  ent->last_ns = now_ns;
+
+  switch (id) {
+  case PROF_SEND_PROTO_STATES:
+    phttp_stats_hist_add(slot->hists + PHTTP_STATS_EXPORT_TOTAL,
+                         now_ns - ent->start_ns);
+    ent->last_ns = 0;
+    break;
+  case PROF_HTTP_RES:
+  case PROF_FORWARDING:
+    phttp_stats_hist_add(slot->hists + PHTTP_STATS_IMPORT_TOTAL,
+                         now_ns - ent->start_ns);
+    ent->last_ns = 0;
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Stats server
+ */
+
+#define STATS_REQ_MAX 2048
+
+struct stats_conn {
+  struct http_socket hs;
+  uv_tcp_t tcp;
+  uv_write_t wreq;
+  std::string *res;
+  size_t rlen;
+  char rbuf[STATS_REQ_MAX];
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static void
+merge_hists(struct phttp_hist *merged)
+{
+  uint32_t nslots = __atomic_load_n(&shm->next_slot, __ATOMIC_RELAXED);
+
+  if (nslots > shm->nslots) {
+    nslots = shm->nslots;
+  }
+
+  memset(merged, 0, sizeof(*merged) * PHTTP_STATS_NR_HISTS);
+
+  for (uint32_t s = 0; s < nslots; s++) {
+    for (int h = 0; h < PHTTP_STATS_NR_HISTS; h++) {
+      const struct phttp_hist *src = shm->slots[s].hists + h;
+      merged[h].count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+      merged[h].sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+      for (int i = 0; i < PHTTP_HIST_NBUCKETS; i++) {
+        merged[h].buckets[i] +=
+            __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+static void
+hist_name(int h, char *buf, size_t len)
+{
+  const char *name;
+
+  if (h == PHTTP_STATS_EXPORT_TOTAL) {
+    name = "EXPORT_TOTAL";
+  } else if (h == PHTTP_STATS_IMPORT_TOTAL) {
+    name = "IMPORT_TOTAL";
+  } else {
+    name = prof_id_name((enum prof_ids)h);
+  }
+
+  size_t i;
+  for (i = 0; name[i] != '\0' && i < len - 1; i++) {
+    buf[i] = tolower(name[i]);
+  }
+  buf[i] = '\0';
+}
+
+static std::string *
+build_metrics(void)
+{
+  char name[32], line[256];
+  std::string *res = new std::string();
+  struct phttp_hist *merged = (struct phttp_hist *)malloc(
+      sizeof(*merged) * PHTTP_STATS_NR_HISTS);
+  assert(merged != NULL);
+
+  merge_hists(merged);
+
+  *res += "# HELP phttp_stage_latency_seconds Time since the previous "
+          "handoff stage of the same flow\n";
+  *res += "# TYPE phttp_stage_latency_seconds summary\n";
+
+  for (int h = 0; h < PHTTP_STATS_NR_HISTS; h++) {
+    hist_name(h, name, sizeof(name));
+
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+      snprintf(line, sizeof(line),
+               "phttp_stage_latency_seconds{stage=\"%s\",quantile=\"%g\"} "
+               "%.9f\n",
+               name, quantiles[q],
+               phttp_stats_hist_quantile(merged + h, quantiles[q]) / 1e9);
+      *res += line;
+    }
+
+    snprintf(line, sizeof(line),
+             "phttp_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+             "phttp_stage_latency_seconds_count{stage=\"%s\"} %lu\n",
+             name, merged[h].sum / 1e9, name, merged[h].count);
+    *res += line;
+  }
+
+  free(merged);
+
+  return res;
+}
+
+static void
+stats_conn_after_close(uv_handle_t *handle)
+{
+  struct stats_conn *conn = (struct stats_conn *)handle->data;
+  delete conn->res;
+  free(conn);
+}
+
+static int
+stats_conn_close(uv_tcp_t *tcp)
+{
+  uv_close((uv_handle_t *)tcp, stats_conn_after_close);
+  return 0;
+}
+
+static void
+stats_after_write(uv_write_t *req, int status)
+{
+  struct stats_conn *conn = (struct stats_conn *)req->data;
+  stats_conn_close(&conn->tcp);
+}
+
+static void
+stats_on_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+  struct stats_conn *conn = (struct stats_conn *)handle->data;
+  buf->base = conn->rbuf + conn->rlen;
+  buf->len = sizeof(conn->rbuf) - conn->rlen;
+}
+
+static void
+stats_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+  int error;
+  char hdr[128];
+  uv_buf_t bufs[1];
+  struct stats_conn *conn = (struct stats_conn *)stream->data;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    stats_conn_close(&conn->tcp);
+    return;
+  }
+
+  conn->rlen += nread;
+
+  /*
+   * Any request gets the metrics. Wait for the end of the headers, or
+   * just answer if the request doesn't fit.
+   */
+  if (memmem(conn->rbuf, conn->rlen, "\r\n\r\n", 4) == NULL &&
+      conn->rlen < sizeof(conn->rbuf)) {
+    return;
+  }
+
+  error = uv_read_stop(stream);
+  assert(error == 0);
+
+  conn->res = build_metrics();
+
+  snprintf(hdr, sizeof(hdr),
+           "HTTP/1.1 200 OK\r\n"
+           "Content-Type: text/plain; version=0.0.4\r\n"
+           "Content-Length: %zu\r\n"
+           "Connection: close\r\n\r\n",
+           conn->res->size());
+  conn->res->insert(0, hdr);
+
+  bufs[0] = uv_buf_init(const_cast<char *>(conn->res->c_str()),
+                        conn->res->size());
+  conn->wreq.data = conn;
+
+  error = uv_write(&conn->wreq, stream, bufs, 1, stats_after_write);
+  if (error) {
+    stats_conn_close(&conn->tcp);
+  }
+}
+
+static void
+stats_on_connection(uv_stream_t *server, int status)
+{
+  int error;
+  struct stats_conn *conn;
+
+  if (status != 0) {
+    return;
+  }
+
+  conn = (struct stats_conn *)malloc(sizeof(*conn));
+  assert(conn != NULL);
+
+  conn->hs.close = stats_conn_close;
+  conn->res = NULL;
+  conn->rlen = 0;
+
+  error = uv_tcp_init(server->loop, &conn->tcp);
+  assert(error == 0);
+
+  conn->tcp.data = conn;
+
+  error = uv_accept(server, (uv_stream_t *)&conn->tcp);
+  if (error) {
+    stats_conn_close(&conn->tcp);
+    return;
+  }
+
+  error = uv_read_start((uv_stream_t *)&conn->tcp, stats_on_alloc,
+                        stats_on_read);
+  if (error) {
+    stats_conn_close(&conn->tcp);
+  }
+}
+
+int
+phttp_stats_server_init(uv_loop_t *loop, phttp_stats_server_t *pss)
+{
+  int error, sock, opt = 1;
+
+  if (shm == NULL) {
+    error = phttp_stats_init();
+    assert(error == 0);
+  }
+
+  uv_tcp_t *server = (uv_tcp_t *)malloc(sizeof(*server));
+  assert(server != NULL);
+
+  server->data = pss;
+
+  error = uv_tcp_init_ex(loop, server, AF_INET);
+  assert(error == 0);
+
+  uv_fileno((uv_handle_t *)server, &sock);
+
+  error = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  assert(error == 0);
+
+  error = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+  assert(error == 0);
+
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = pss->addr;
+  addr.sin_port = pss->port;
+
+  error = uv_tcp_bind(server, (struct sockaddr *)&addr, sizeof(addr));
+  assert(error == 0);
+
+  error = uv_listen((uv_stream_t *)server, pss->backlog, stats_on_connection);
+  assert(error == 0);
+
+  return 0;
+}
@@ -7,8 +7,10 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 
 #include <tcp_export.h>
@@ -17,22 +19,89 @@
 #define TCP_ESTABLISHED 1
 #endif
 
-struct tcp_info_sub {
-  uint8_t tcpi_state;
-  uint8_t tcpi_ca_state;
-  uint8_t tcpi_retransmits;
-  uint8_t tcpi_probes;
-  uint8_t tcpi_backoff;
-  uint8_t tcpi_options;
-  uint8_t tcpi_snd_wscale : 4;
-  uint8_t tcpi_rcv_wscale : 4;
-};
+/*
+ * Syscalls on the socket go through the sys_ wrappers, which count them
+ * for tcp_export_get_counters
+ */
+static thread_local uint64_t nsyscalls;
+static thread_local struct tcp_export_counters counters;
+
+static inline int
+sys_setsockopt(int sock, int level, int name, const void *val, socklen_t len)
+{
+  nsyscalls++;
+  return setsockopt(sock, level, name, val, len);
+}
+
+static inline int
+sys_getsockopt(int sock, int level, int name, void *val, socklen_t *len)
+{
+  nsyscalls++;
+  return getsockopt(sock, level, name, val, len);
+}
+
+static inline int
+sys_ioctl(int sock, unsigned long req, int *val)
+{
+  nsyscalls++;
+  return ioctl(sock, req, val);
+}
+
+static inline ssize_t
+sys_recv(int sock, void *buf, size_t len, int flags)
+{
+  nsyscalls++;
+  return recv(sock, buf, len, flags);
+}
+
+static inline ssize_t
+sys_send(int sock, const void *buf, size_t len, int flags)
+{
+  nsyscalls++;
+  return send(sock, buf, len, flags);
+}
+
+static inline int
+sys_getsockname(int sock, struct sockaddr *addr, socklen_t *len)
+{
+  nsyscalls++;
+  return getsockname(sock, addr, len);
+}
+
+static inline int
+sys_getpeername(int sock, struct sockaddr *addr, socklen_t *len)
+{
+  nsyscalls++;
+  return getpeername(sock, addr, len);
+}
+
+static inline int
+sys_bind(int sock, const struct sockaddr *addr, socklen_t len)
+{
+  nsyscalls++;
+  return bind(sock, addr, len);
+}
+
+static inline int
+sys_connect(int sock, const struct sockaddr *addr, socklen_t len)
+{
+  nsyscalls++;
+  return connect(sock, addr, len);
+}
+
+/*
+ * TCP_INFO up to tcpi_options and the window scales
+ */
+#define TCP_INFO_MIN_LEN offsetof(struct tcp_info, tcpi_rto)
+
+#define TCP_STATE_OPT_MASK                                                     \
+  (TCP_STATE_OPT_TIMESTAMPS | TCP_STATE_OPT_SACK | TCP_STATE_OPT_WSCALE)
 
 static int
 tcp_repair_start(int sock)
 {
   int error, opt = 1;
-  error = setsockopt(sock, IPPROTO_TCP, TCP_REPAIR, &opt, sizeof(opt));
+  error = sys_setsockopt(sock, IPPROTO_TCP, TCP_REPAIR, &opt, sizeof(opt));
   if (error) {
     return errno;
   }
@@ -43,7 +112,7 @@ static int
 tcp_repair_done(int sock)
 {
   int error, opt = -1;
-  error = setsockopt(sock, IPPROTO_TCP, TCP_REPAIR, &opt, sizeof(opt));
+  error = sys_setsockopt(sock, IPPROTO_TCP, TCP_REPAIR, &opt, sizeof(opt));
   if (error) {
     return errno;
   }
@@ -51,16 +120,20 @@ tcp_repair_done(int sock)
 }
 
 static int
-tcp_is_established(int sock, struct tcp_info_sub *info)
+tcp_is_established(int sock, struct tcp_info *info)
 {
   int error;
   socklen_t opt_len = sizeof(*info);
 
-  error = getsockopt(sock, IPPROTO_TCP, TCP_INFO, info, &opt_len);
-  if (error == -1 || opt_len != sizeof(*info)) {
+  error = sys_getsockopt(sock, IPPROTO_TCP, TCP_INFO, info, &opt_len);
+  if (error == -1) {
     return errno;
   }
 
+  if (opt_len < TCP_INFO_MIN_LEN) {
+    return ENOTSUP;
+  }
+
   if (info->tcpi_state != TCP_ESTABLISHED) {
     return EINVAL;
   }
@@ -69,58 +142,83 @@ tcp_is_established(int sock, struct tcp_info_sub *info)
 }
 
 static int
-tcp_get_queue_len(int sock, prism::TCPState *ex)
+tcp_get_queue_len(int sock, struct tcp_state *ex)
 {
   int error, size;
 
-  error = ioctl(sock, SIOCOUTQ, &size);
+  error = sys_ioctl(sock, SIOCOUTQ, &size);
   if (error == -1) {
     return errno;
   }
 
-  ex->set_sendq_len(size);
+  ex->sendq_len = size;
 
-  error = ioctl(sock, SIOCOUTQNSD, &size);
-  if (error == -1) {
-    return errno;
-  }
+  /*
+   * Unsent data is a part of the send queue
+   */
+  if (ex->sendq_len != 0) {
+    error = sys_ioctl(sock, SIOCOUTQNSD, &size);
+    if (error == -1) {
+      return errno;
+    }
 
-  ex->set_unsentq_len(size);
+    ex->unsentq_len = size;
+  }
 
-  error = ioctl(sock, SIOCINQ, &size);
+  error = sys_ioctl(sock, SIOCINQ, &size);
   if (error == -1) {
     return errno;
   }
 
-  ex->set_recvq_len(size);
+  ex->recvq_len = size;
 
   return 0;
 }
 
 static int
-tcp_get_options(int sock, prism::TCPState *ex, struct tcp_info_sub *info)
+tcp_get_options(int sock, struct tcp_state *ex, const struct tcp_info *info)
 {
   int error;
   uint32_t mss;
   uint32_t timestamp;
   socklen_t opt_len = sizeof(mss);
 
-  error = getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &mss, &opt_len);
+  error = sys_getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &mss, &opt_len);
   if (error == -1) {
     return errno;
   }
 
-  ex->set_mss(mss);
-  ex->set_send_wscale(info->tcpi_snd_wscale);
-  ex->set_recv_wscale(info->tcpi_rcv_wscale);
+  ex->mss = mss;
+  ex->send_wscale = info->tcpi_snd_wscale;
+  ex->recv_wscale = info->tcpi_rcv_wscale;
+  ex->options =
+      (info->tcpi_options & TCP_STATE_OPT_MASK) | TCP_STATE_OPT_KNOWN;
 
   opt_len = sizeof(timestamp);
-  error = getsockopt(sock, IPPROTO_TCP, TCP_TIMESTAMP, &timestamp, &opt_len);
+  error =
+      sys_getsockopt(sock, IPPROTO_TCP, TCP_TIMESTAMP, &timestamp, &opt_len);
   if (error == -1) {
     return errno;
   }
 
-  ex->set_timestamp(timestamp);
+  ex->timestamp = timestamp;
+
+  return 0;
+}
+
+static int
+tcp_get_congestion(int sock, struct tcp_state *ex)
+{
+  int error;
+  socklen_t opt_len = sizeof(ex->congestion) - 1;
+
+  error = sys_getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, ex->congestion,
+                         &opt_len);
+  if (error == -1) {
+    return errno;
+  }
+
+  ex->congestion[opt_len] = '\0';
 
   return 0;
 }
@@ -141,30 +239,78 @@ tcp_get_options(int sock, prism::TCPState *ex, struct tcp_info_sub *info)
 #define TCPOPT_TIMESTAMP 8
 #endif
 
+/*
+ * Only the options negotiated on the original connection are turned on,
+ * the peer would drop or misread e.g. timestamps it never agreed to.
+ */
 static int
-tcp_set_options(int sock, const prism::TCPState *ex)
+tcp_set_options(int sock, const struct tcp_state *ex)
 {
-  int error;
+  int error, nopts = 0;
+  uint32_t options = ex->options;
   struct tcp_repair_opt opts[4];
 
-  opts[0].opt_code = TCPOPT_SACK_PERM;
-  opts[0].opt_val = 0;
-  opts[1].opt_code = TCPOPT_WINDOW;
-  opts[1].opt_val = ex->send_wscale() + (ex->recv_wscale() << 16);
-  opts[2].opt_code = TCPOPT_TIMESTAMP;
-  opts[2].opt_val = 0;
-  opts[3].opt_code = TCPOPT_MSS;
-  opts[3].opt_val = ex->mss();
-
-  error = setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_OPTIONS, opts,
-                     sizeof(struct tcp_repair_opt) * 4);
+  if (!(options & TCP_STATE_OPT_KNOWN)) {
+    options = TCP_STATE_OPT_MASK;
+  }
+
+  if (options & TCP_STATE_OPT_SACK) {
+    opts[nopts].opt_code = TCPOPT_SACK_PERM;
+    opts[nopts].opt_val = 0;
+    nopts++;
+  }
+
+  if (options & TCP_STATE_OPT_WSCALE) {
+    opts[nopts].opt_code = TCPOPT_WINDOW;
+    opts[nopts].opt_val = ex->send_wscale + (ex->recv_wscale << 16);
+    nopts++;
+  }
+
+  if (options & TCP_STATE_OPT_TIMESTAMPS) {
+    opts[nopts].opt_code = TCPOPT_TIMESTAMP;
+    opts[nopts].opt_val = 0;
+    nopts++;
+  }
+
+  opts[nopts].opt_code = TCPOPT_MSS;
+  opts[nopts].opt_val = ex->mss;
+  nopts++;
+
+  error = sys_setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_OPTIONS, opts,
+                         sizeof(struct tcp_repair_opt) * nopts);
   if (error == -1) {
     return errno;
   }
 
-  uint32_t tstamp = ex->timestamp();
-  error = setsockopt(sock, IPPROTO_TCP, TCP_TIMESTAMP, &tstamp, sizeof(tstamp));
-  if (error == -1) {
+  if (options & TCP_STATE_OPT_TIMESTAMPS) {
+    uint32_t tstamp = ex->timestamp;
+    error = sys_setsockopt(sock, IPPROTO_TCP, TCP_TIMESTAMP, &tstamp,
+                           sizeof(tstamp));
+    if (error == -1) {
+      return errno;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Algorithm of the original connection, which may not be the default of
+ * this host. Unknown or unavailable ones keep the default.
+ */
+static int
+tcp_set_congestion(int sock, const struct tcp_state *ex)
+{
+  int error;
+  size_t len = strnlen(ex->congestion, sizeof(ex->congestion));
+
+  if (len == 0) {
+    return 0;
+  }
+
+  error = sys_setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, ex->congestion,
+                         len);
+  if (error == -1 && errno != ENOENT && errno != EPERM) {
     return errno;
   }
 
@@ -172,39 +318,40 @@ tcp_set_options(int sock, const prism::TCPState *ex)
 }
 
 static int
-tcp_get_window(int sock, prism::TCPState *ex)
+tcp_get_window(int sock, struct tcp_state *ex)
 {
   int error;
   struct tcp_repair_window window;
   socklen_t slen = sizeof(struct tcp_repair_window);
 
-  error = getsockopt(sock, IPPROTO_TCP, TCP_REPAIR_WINDOW, &window, &slen);
+  error =
+      sys_getsockopt(sock, IPPROTO_TCP, TCP_REPAIR_WINDOW, &window, &slen);
   if (error) {
     return errno;
   }
 
-  ex->set_snd_wl1(window.snd_wl1);
-  ex->set_snd_wnd(window.snd_wnd);
-  ex->set_max_window(window.max_window);
-  ex->set_rcv_wnd(window.rcv_wnd);
-  ex->set_rcv_wup(window.rcv_wup);
+  ex->snd_wl1 = window.snd_wl1;
+  ex->snd_wnd = window.snd_wnd;
+  ex->max_window = window.max_window;
+  ex->rcv_wnd = window.rcv_wnd;
+  ex->rcv_wup = window.rcv_wup;
 
   return 0;
 }
 
 static int
-tcp_set_window(int sock, const prism::TCPState *ex)
+tcp_set_window(int sock, const struct tcp_state *ex)
 {
   int error;
   struct tcp_repair_window window;
 
-  window.snd_wl1 = ex->snd_wl1();
-  window.snd_wnd = ex->snd_wnd();
-  window.max_window = ex->max_window();
-  window.rcv_wnd = ex->rcv_wnd();
-  window.rcv_wup = ex->rcv_wup();
-  error =
-      setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_WINDOW, &window, sizeof(window));
+  window.snd_wl1 = ex->snd_wl1;
+  window.snd_wnd = ex->snd_wnd;
+  window.max_window = ex->max_window;
+  window.rcv_wnd = ex->rcv_wnd;
+  window.rcv_wup = ex->rcv_wup;
+  error = sys_setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_WINDOW, &window,
+                         sizeof(window));
   if (error) {
     return errno;
   }
@@ -212,50 +359,118 @@ tcp_set_window(int sock, const prism::TCPState *ex)
   return 0;
 }
 
+int
+tcp_addr_from_sockaddr(const struct sockaddr *sa, struct in6_addr *addr,
+                       uint32_t *port)
+{
+  const struct sockaddr_in *sin;
+  const struct sockaddr_in6 *sin6;
+
+  switch (sa->sa_family) {
+  case AF_INET:
+    sin = (const struct sockaddr_in *)sa;
+    tcp_addr_set_ipv4(addr, sin->sin_addr.s_addr);
+    *port = sin->sin_port;
+    return 0;
+  case AF_INET6:
+    sin6 = (const struct sockaddr_in6 *)sa;
+    *addr = sin6->sin6_addr;
+    *port = sin6->sin6_port;
+    return 0;
+  default:
+    return EAFNOSUPPORT;
+  }
+}
+
+/*
+ * Mapped addresses become sockaddr_in. Scope of the link-local addresses
+ * is not carried.
+ */
+socklen_t
+tcp_addr_to_sockaddr(const struct in6_addr *addr, uint32_t port,
+                     struct sockaddr_storage *ss)
+{
+  struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+  if (tcp_addr_family(addr) == AF_INET) {
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = addr->s6_addr32[3];
+    sin->sin_port = (uint16_t)port;
+    return sizeof(*sin);
+  }
+
+  memset(sin6, 0, sizeof(*sin6));
+  sin6->sin6_family = AF_INET6;
+  sin6->sin6_addr = *addr;
+  sin6->sin6_port = (uint16_t)port;
+  return sizeof(*sin6);
+}
+
 static int
-tcp_get_addr(int sock, prism::TCPState *ex)
+tcp_get_addr(int sock, struct tcp_state *ex, const struct tcp_export_opts *opts)
 {
   int error;
-  struct sockaddr_in addr;
+  struct sockaddr_storage addr;
   socklen_t addr_len;
 
-  addr_len = sizeof(addr);
-  error = getsockname(sock, (struct sockaddr *)&addr, &addr_len);
-  if (error == -1) {
-    return errno;
+  if (opts->self_port != 0) {
+    ex->self_addr = opts->self_addr;
+    ex->self_port = opts->self_port;
+  } else {
+    addr_len = sizeof(addr);
+    error = sys_getsockname(sock, (struct sockaddr *)&addr, &addr_len);
+    if (error == -1) {
+      return errno;
+    }
+
+    error = tcp_addr_from_sockaddr((struct sockaddr *)&addr, &ex->self_addr,
+                                   &ex->self_port);
+    if (error) {
+      return error;
+    }
   }
 
-  ex->set_self_addr(addr.sin_addr.s_addr);
-  ex->set_self_port(addr.sin_port);
+  if (opts->peer_port != 0) {
+    ex->peer_addr = opts->peer_addr;
+    ex->peer_port = opts->peer_port;
+  } else {
+    addr_len = sizeof(addr);
+    error = sys_getpeername(sock, (struct sockaddr *)&addr, &addr_len);
+    if (error == -1) {
+      return errno;
+    }
 
-  error = getpeername(sock, (struct sockaddr *)&addr, &addr_len);
-  if (error == -1) {
-    return errno;
+    error = tcp_addr_from_sockaddr((struct sockaddr *)&addr, &ex->peer_addr,
+                                   &ex->peer_port);
+    if (error) {
+      return error;
+    }
   }
 
-  ex->set_peer_addr(addr.sin_addr.s_addr);
-  ex->set_peer_port(addr.sin_port);
-
   return 0;
 }
 
 static int
-tcp_set_addr(int sock, const prism::TCPState *ex)
+tcp_set_addr(int sock, const struct tcp_state *ex)
 {
   int error;
-  struct sockaddr_in addr;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+
+  if (tcp_addr_family(&ex->self_addr) != tcp_addr_family(&ex->peer_addr)) {
+    return EAFNOSUPPORT;
+  }
 
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = ex->self_addr();
-  addr.sin_port = (uint16_t)ex->self_port();
-  error = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  addr_len = tcp_addr_to_sockaddr(&ex->self_addr, ex->self_port, &addr);
+  error = sys_bind(sock, (struct sockaddr *)&addr, addr_len);
   if (error) {
     return errno;
   }
 
-  addr.sin_addr.s_addr = ex->peer_addr();
-  addr.sin_port = (uint16_t)ex->peer_port();
-  error = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+  addr_len = tcp_addr_to_sockaddr(&ex->peer_addr, ex->peer_port, &addr);
+  error = sys_connect(sock, (struct sockaddr *)&addr, addr_len);
   if (error) {
     return errno;
   }
@@ -263,8 +478,13 @@ tcp_set_addr(int sock, const prism::TCPState *ex)
   return 0;
 }
 
+/*
+ * Queue contents are peeked into the buffer from alloc as is. Empty
+ * queues only need the sequence number.
+ */
 static int
-tcp_get_queue(int sock, int qid, prism::TCPState *ex)
+tcp_get_queue(int sock, int qid, struct tcp_state *ex, tcp_queue_alloc_t alloc,
+              void *arg)
 {
   int error;
   ssize_t ret;
@@ -272,44 +492,54 @@ tcp_get_queue(int sock, int qid, prism::TCPState *ex)
   uint32_t seq;
   socklen_t opt_len;
   uint64_t len;
+  enum tcp_state_queue queue;
 
-  error = setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_QUEUE, &qid, sizeof(int));
+  error =
+      sys_setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_QUEUE, &qid, sizeof(int));
   if (error == -1) {
     return errno;
   }
 
   opt_len = sizeof(uint32_t);
-  error = getsockopt(sock, IPPROTO_TCP, TCP_QUEUE_SEQ, &seq, &opt_len);
+  error = sys_getsockopt(sock, IPPROTO_TCP, TCP_QUEUE_SEQ, &seq, &opt_len);
   if (error == -1) {
     return errno;
   }
 
   if (qid == TCP_SEND_QUEUE) {
-    ex->set_seq(seq);
-    len = ex->sendq_len();
+    ex->seq = seq;
+    len = ex->sendq_len;
+    queue = TCP_STATE_SENDQ;
   } else {
-    ex->set_ack(seq);
-    len = ex->recvq_len();
+    ex->ack = seq;
+    len = ex->recvq_len;
+    queue = TCP_STATE_RECVQ;
   }
 
-  if (len) {
-    buf = (uint8_t *)malloc(len + 1);
-    if (!buf) {
-      return ENOMEM;
-    }
+  if (len == 0) {
+    return 0;
+  }
 
-    ret = recv(sock, buf, len + 1, MSG_PEEK | MSG_DONTWAIT);
-    if (ret < 0 || (uint64_t)ret != len) {
-      return EINVAL;
-    }
-  } else {
-    buf = NULL;
+  buf = alloc(arg, queue, len);
+  if (buf == NULL) {
+    return ENOMEM;
   }
 
-  if (qid == TCP_SEND_QUEUE) {
-    ex->set_sendq(buf, len);
+  /*
+   * Set before the peek, so the caller releases the buffer on failure
+   */
+  if (queue == TCP_STATE_SENDQ) {
+    ex->sendq = buf;
   } else {
-    ex->set_recvq(buf, len);
+    ex->recvq = buf;
+  }
+
+  /*
+   * The socket is in the repair mode, the queue can't change under us
+   */
+  ret = sys_recv(sock, buf, len, MSG_PEEK | MSG_DONTWAIT);
+  if (ret < 0 || (uint64_t)ret != len) {
+    return EINVAL;
   }
 
   return 0;
@@ -334,7 +564,7 @@ __send_queue(int sock, int queue, const uint8_t *buf, uint32_t len)
     if (chunk > max_chunk)
       chunk = max_chunk;
 
-    ret = send(sock, buf + off, chunk, 0);
+    ret = sys_send(sock, buf + off, chunk, 0);
     if (ret <= 0) {
       if (max_chunk > 1024) {
         /*
@@ -372,8 +602,8 @@ send_queue(int sock, int queue, const uint8_t *buf, uint32_t len)
 {
   int error;
 
-  error =
-      setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_QUEUE, &queue, sizeof(queue));
+  error = sys_setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_QUEUE, &queue,
+                         sizeof(queue));
   if (error == -1) {
     return errno;
   }
@@ -382,17 +612,16 @@ send_queue(int sock, int queue, const uint8_t *buf, uint32_t len)
 }
 
 static int
-tcp_set_queue(int sock, int queue, const prism::TCPState *ex)
+tcp_set_queue(int sock, int queue, const struct tcp_state *ex)
 {
   int error;
 
   if (queue == TCP_RECV_QUEUE) {
-    if (ex->recvq_len() == 0) {
+    if (ex->recvq_len == 0) {
       return 0;
     }
 
-    return send_queue(sock, TCP_RECV_QUEUE,
-                      (const uint8_t *)ex->recvq().c_str(), ex->recvq_len());
+    return send_queue(sock, TCP_RECV_QUEUE, ex->recvq, ex->recvq_len);
   }
 
   if (queue == TCP_SEND_QUEUE) {
@@ -405,11 +634,13 @@ tcp_set_queue(int sock, int queue, const prism::TCPState *ex)
      * acknowledgment can be received for them. These data must be
      * restored in repair mode.
      */
-    ulen = ex->unsentq_len();
-    len = ex->sendq_len() - ulen;
+    ulen = ex->unsentq_len;
+    len = ex->sendq_len - ulen;
     if (len) {
-      error = send_queue(sock, TCP_SEND_QUEUE,
-                         (const uint8_t *)ex->sendq().c_str(), len);
+      /*
+       * Selected by the last tcp_set_seq, see tcp_import_state
+       */
+      error = __send_queue(sock, TCP_SEND_QUEUE, ex->sendq, len);
       if (error) {
         return error;
       }
@@ -423,8 +654,7 @@ tcp_set_queue(int sock, int queue, const prism::TCPState *ex)
       error = tcp_repair_done(sock);
       assert(error == 0);
 
-      error = __send_queue(sock, TCP_SEND_QUEUE,
-                           (const uint8_t *)ex->sendq().c_str() + len, ulen);
+      error = __send_queue(sock, TCP_SEND_QUEUE, ex->sendq + len, ulen);
       if (error) {
         return error;
       }
@@ -439,25 +669,30 @@ tcp_set_queue(int sock, int queue, const prism::TCPState *ex)
   return EINVAL;
 }
 
+/*
+ * Exported sequence numbers are of the queue tails (write_seq and
+ * rcv_nxt). Restoring the queues advances them again, so start from the
+ * queue heads like CRIU does.
+ */
 static int
-tcp_set_seq(int sock, int queue, const prism::TCPState *ex)
+tcp_set_seq(int sock, int queue, const struct tcp_state *ex)
 {
   int error;
   uint32_t seq;
 
   if (queue == TCP_SEND_QUEUE) {
-    seq = ex->seq();
+    seq = ex->seq - (uint32_t)ex->sendq_len;
   } else {
-    seq = ex->ack();
+    seq = ex->ack - (uint32_t)ex->recvq_len;
   }
 
-  error =
-      setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_QUEUE, &queue, sizeof(queue));
+  error = sys_setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_QUEUE, &queue,
+                         sizeof(queue));
   if (error == -1) {
     return errno;
   }
 
-  error = setsockopt(sock, IPPROTO_TCP, TCP_QUEUE_SEQ, &seq, sizeof(seq));
+  error = sys_setsockopt(sock, IPPROTO_TCP, TCP_QUEUE_SEQ, &seq, sizeof(seq));
   if (error == -1) {
     return errno;
   }
@@ -465,17 +700,33 @@ tcp_set_seq(int sock, int queue, const prism::TCPState *ex)
   return 0;
 }
 
+static uint8_t *
+malloc_queue(void *arg, enum tcp_state_queue queue, uint64_t len)
+{
+  (void)arg;
+  (void)queue;
+  return (uint8_t *)malloc(len);
+}
+
+/*
+ * On failure, queues which were already allocated are left in the state
+ * for the caller to release.
+ */
 int
-tcp_export(int sock, prism::TCPState *ex)
+tcp_export_state_into(int sock, struct tcp_state *ex,
+                      const struct tcp_export_opts *opts)
 {
   int error;
-  struct tcp_info_sub info;
+  uint64_t start = nsyscalls;
+  struct tcp_info info;
+  tcp_queue_alloc_t alloc;
 
-  if (ex == NULL) {
+  if (ex == NULL || opts == NULL) {
     return EINVAL;
   }
 
-  ex->Clear();
+  memset(ex, 0, sizeof(*ex));
+  alloc = opts->alloc != NULL ? opts->alloc : malloc_queue;
 
 #define TRY(_funccall, _label)                                                 \
   if ((error = _funccall) != 0) {                                              \
@@ -486,17 +737,19 @@ tcp_export(int sock, prism::TCPState *ex)
   TRY(tcp_is_established(sock, &info), err1);
   TRY(tcp_get_queue_len(sock, ex), err1);
   TRY(tcp_get_options(sock, ex, &info), err1);
+  TRY(tcp_get_congestion(sock, ex), err1);
   TRY(tcp_get_window(sock, ex), err1);
-  TRY(tcp_get_addr(sock, ex), err1);
-  TRY(tcp_get_queue(sock, TCP_SEND_QUEUE, ex), err1);
-  TRY(tcp_get_queue(sock, TCP_RECV_QUEUE, ex), err2);
+  TRY(tcp_get_addr(sock, ex, opts), err1);
+  TRY(tcp_get_queue(sock, TCP_SEND_QUEUE, ex, alloc, opts->arg), err1);
+  TRY(tcp_get_queue(sock, TCP_RECV_QUEUE, ex, alloc, opts->arg), err1);
 
 #undef TRY
 
+  counters.nexports++;
+  counters.export_syscalls += nsyscalls - start;
+
   return 0;
 
-err2:
-  free((uint8_t *)ex->mutable_sendq()->c_str());
 err1:
   assert(tcp_repair_done(sock) == 0);
 err0:
@@ -504,10 +757,73 @@ err0:
 }
 
 int
-tcp_import(int sock, const prism::TCPState *ex)
+tcp_export_state(int sock, struct tcp_state *ex)
 {
   int error;
 
+  struct tcp_export_opts opts;
+
+  memset(&opts, 0, sizeof(opts));
+
+  error = tcp_export_state_into(sock, ex, &opts);
+  if (error != 0 && ex != NULL) {
+    tcp_state_release(ex);
+  }
+
+  return error;
+}
+
+int
+tcp_import_state(int sock, const struct tcp_state *ex)
+{
+  int error;
+  uint64_t start = nsyscalls;
+
+  if (ex == NULL) {
+    return EINVAL;
+  }
+
+  error = tcp_repair_start(sock);
+  if (error) {
+    return error;
+  }
+
+  counters.import_syscalls += nsyscalls - start;
+
+  return tcp_import_state_prepared(sock, ex);
+}
+
+int
+tcp_repair_socket(int family)
+{
+  int error, sock, opt = 1;
+
+  sock = socket(family, SOCK_STREAM, 0);
+  if (sock == -1) {
+    return -errno;
+  }
+
+  error = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (error == 0) {
+    error = tcp_repair_start(sock);
+  } else {
+    error = errno;
+  }
+
+  if (error) {
+    close(sock);
+    return -error;
+  }
+
+  return sock;
+}
+
+int
+tcp_import_state_prepared(int sock, const struct tcp_state *ex)
+{
+  int error;
+  uint64_t start = nsyscalls;
+
   if (ex == NULL) {
     return EINVAL;
   }
@@ -517,22 +833,238 @@ tcp_import(int sock, const prism::TCPState *ex)
     goto _label;                                                               \
   }
 
-  TRY(tcp_repair_start(sock), err0);
-  TRY(tcp_set_seq(sock, TCP_SEND_QUEUE, ex), err1);
-  TRY(tcp_set_seq(sock, TCP_RECV_QUEUE, ex), err1);
-  TRY(tcp_set_addr(sock, ex), err1);
-  TRY(tcp_set_queue(sock, TCP_SEND_QUEUE, ex), err1);
-  TRY(tcp_set_queue(sock, TCP_RECV_QUEUE, ex), err1);
-  TRY(tcp_set_options(sock, ex), err1);
-  TRY(tcp_set_window(sock, ex), err1);
-  TRY(tcp_repair_done(sock), err1);
+  /*
+   * The send queue stays selected from its tcp_set_seq through connect,
+   * so restoring it doesn't select it again
+   */
+  TRY(tcp_set_seq(sock, TCP_RECV_QUEUE, ex), err0);
+  TRY(tcp_set_seq(sock, TCP_SEND_QUEUE, ex), err0);
+  TRY(tcp_set_addr(sock, ex), err0);
+  TRY(tcp_set_queue(sock, TCP_SEND_QUEUE, ex), err0);
+  TRY(tcp_set_queue(sock, TCP_RECV_QUEUE, ex), err0);
+  TRY(tcp_set_options(sock, ex), err0);
+  TRY(tcp_set_congestion(sock, ex), err0);
+  TRY(tcp_set_window(sock, ex), err0);
+  TRY(tcp_repair_done(sock), err0);
 
 #undef TRY
 
+  counters.nimports++;
+  counters.import_syscalls += nsyscalls - start;
+
   return 0;
 
-err1:
-  assert(tcp_repair_done(sock) == 0);
 err0:
+  assert(tcp_repair_done(sock) == 0);
   return error;
 }
+
+int
+tcp_export_cancel(int sock)
+{
+  return tcp_repair_done(sock);
+}
+
+/*
+ * Checks whether the receive side moved on since tcp_export_state. The
+ * socket must still be in the repair mode.
+ */
+int
+tcp_export_recv_changed(int sock, const struct tcp_state *ex, bool *changed)
+{
+  int error, size, qid = TCP_RECV_QUEUE;
+  uint32_t seq;
+  socklen_t opt_len = sizeof(seq);
+  uint64_t start = nsyscalls;
+
+  error =
+      sys_setsockopt(sock, IPPROTO_TCP, TCP_REPAIR_QUEUE, &qid, sizeof(qid));
+  if (error == -1) {
+    return errno;
+  }
+
+  error = sys_getsockopt(sock, IPPROTO_TCP, TCP_QUEUE_SEQ, &seq, &opt_len);
+  if (error == -1) {
+    return errno;
+  }
+
+  error = sys_ioctl(sock, SIOCINQ, &size);
+  if (error == -1) {
+    return errno;
+  }
+
+  *changed = seq != ex->ack || (uint64_t)size != ex->recvq_len;
+  counters.export_syscalls += nsyscalls - start;
+
+  return 0;
+}
+
+void
+tcp_export_get_counters(struct tcp_export_counters *c)
+{
+  *c = counters;
+}
+
+void
+tcp_state_release(struct tcp_state *ex)
+{
+  free(ex->sendq);
+  free(ex->recvq);
+  ex->sendq = NULL;
+  ex->recvq = NULL;
+}
+
+/*
+ * IPv4 addresses stay in the 32 bit fields as they used to, the IPv6
+ * fields are set only for the IPv6 ones
+ */
+static void
+addr_to_proto(const struct in6_addr *addr, std::string *addr6, uint32_t *v4)
+{
+  if (tcp_addr_family(addr) == AF_INET) {
+    addr6->clear();
+    *v4 = addr->s6_addr32[3];
+  } else {
+    addr6->assign((const char *)addr->s6_addr, sizeof(addr->s6_addr));
+    *v4 = 0;
+  }
+}
+
+static void
+addr_from_proto(const std::string &addr6, uint32_t v4, struct in6_addr *addr)
+{
+  if (addr6.size() == sizeof(addr->s6_addr)) {
+    memcpy(addr->s6_addr, addr6.data(), sizeof(addr->s6_addr));
+  } else {
+    tcp_addr_set_ipv4(addr, v4);
+  }
+}
+
+void
+tcp_state_to_proto(const struct tcp_state *ex, prism::TCPState *pb)
+{
+  uint32_t v4;
+
+  pb->set_seq(ex->seq);
+  pb->set_ack(ex->ack);
+  /*
+   * Queues captured into the message itself (tcp_export) are not
+   * copied onto themselves
+   */
+  if ((const char *)ex->sendq != pb->sendq().data()) {
+    pb->set_sendq(ex->sendq, ex->sendq_len);
+  }
+  pb->set_sendq_len(ex->sendq_len);
+  pb->set_unsentq_len(ex->unsentq_len);
+  if ((const char *)ex->recvq != pb->recvq().data()) {
+    pb->set_recvq(ex->recvq, ex->recvq_len);
+  }
+  pb->set_recvq_len(ex->recvq_len);
+  addr_to_proto(&ex->self_addr, pb->mutable_self_addr6(), &v4);
+  pb->set_self_addr(v4);
+  pb->set_self_port(ex->self_port);
+  addr_to_proto(&ex->peer_addr, pb->mutable_peer_addr6(), &v4);
+  pb->set_peer_addr(v4);
+  pb->set_peer_port(ex->peer_port);
+  pb->set_mss(ex->mss);
+  pb->set_send_wscale(ex->send_wscale);
+  pb->set_recv_wscale(ex->recv_wscale);
+  pb->set_timestamp(ex->timestamp);
+  pb->set_snd_wl1(ex->snd_wl1);
+  pb->set_snd_wnd(ex->snd_wnd);
+  pb->set_max_window(ex->max_window);
+  pb->set_rcv_wnd(ex->rcv_wnd);
+  pb->set_rcv_wup(ex->rcv_wup);
+  pb->set_options(ex->options);
+  pb->set_congestion(ex->congestion);
+}
+
+/*
+ * Queue pointers of the resulting state point into the protobuf
+ * message, so it must outlive the state.
+ */
+void
+tcp_state_from_proto(const prism::TCPState *pb, struct tcp_state *ex)
+{
+  ex->seq = pb->seq();
+  ex->ack = pb->ack();
+  ex->sendq = (uint8_t *)pb->sendq().data();
+  ex->sendq_len = pb->sendq_len();
+  ex->unsentq_len = pb->unsentq_len();
+  ex->recvq = (uint8_t *)pb->recvq().data();
+  ex->recvq_len = pb->recvq_len();
+  addr_from_proto(pb->self_addr6(), pb->self_addr(), &ex->self_addr);
+  ex->self_port = pb->self_port();
+  addr_from_proto(pb->peer_addr6(), pb->peer_addr(), &ex->peer_addr);
+  ex->peer_port = pb->peer_port();
+  ex->mss = pb->mss();
+  ex->send_wscale = pb->send_wscale();
+  ex->recv_wscale = pb->recv_wscale();
+  ex->timestamp = pb->timestamp();
+  ex->snd_wl1 = pb->snd_wl1();
+  ex->snd_wnd = pb->snd_wnd();
+  ex->max_window = pb->max_window();
+  ex->rcv_wnd = pb->rcv_wnd();
+  ex->rcv_wup = pb->rcv_wup();
+  ex->options = pb->options();
+  memset(ex->congestion, 0, sizeof(ex->congestion));
+  strncpy(ex->congestion, pb->congestion().c_str(),
+          sizeof(ex->congestion) - 1);
+}
+
+/*
+ * Captures the queues straight into the message
+ */
+uint8_t *
+tcp_state_proto_queue(void *arg, enum tcp_state_queue queue, uint64_t len)
+{
+  prism::TCPState *pb = (prism::TCPState *)arg;
+  std::string *q;
+
+  q = queue == TCP_STATE_SENDQ ? pb->mutable_sendq() : pb->mutable_recvq();
+  q->resize(len);
+
+  return (uint8_t *)&(*q)[0];
+}
+
+int
+tcp_export(int sock, prism::TCPState *pb)
+{
+  int error;
+  struct tcp_state ex;
+  struct tcp_export_opts opts;
+
+  if (pb == NULL) {
+    return EINVAL;
+  }
+
+  pb->Clear();
+
+  memset(&opts, 0, sizeof(opts));
+  opts.alloc = tcp_state_proto_queue;
+  opts.arg = pb;
+
+  error = tcp_export_state_into(sock, &ex, &opts);
+  if (error) {
+    pb->Clear();
+    return error;
+  }
+
+  tcp_state_to_proto(&ex, pb);
+
+  return 0;
+}
+
+int
+tcp_import(int sock, const prism::TCPState *pb)
+{
+  struct tcp_state ex;
+
+  if (pb == NULL) {
+    return EINVAL;
+  }
+
+  tcp_state_from_proto(pb, &ex);
+
+  return tcp_import_state(sock, &ex);
+}
@@ -3,7 +3,7 @@
 #include <cstdlib>
 
 int
-tls_export(struct TLSContext *tls, prism::TLSState *ex)
+tls_export_buf(struct TLSContext *tls, uint8_t **bufp, uint32_t *lenp)
 {
   int ret;
   uint8_t *buf;
@@ -15,23 +15,22 @@ tls_export(struct TLSContext *tls, prism::TLSState *ex)
 
   ret = tls_export_context(tls, buf, 0xFFFF, 1);
   if (ret == 0) {
+    free(buf);
     return -EINVAL;
   }
 
-  ex->set_buf(buf, ret);
-
-  free(buf);
+  *bufp = buf;
+  *lenp = ret;
 
   return 0;
 }
 
 int
-tls_import(struct TLSContext *tls, const prism::TLSState *ex)
+tls_import_buf(struct TLSContext *tls, const uint8_t *buf, uint32_t len)
 {
   ssize_t ret;
 
-  ret =
-      tls_import_context2(tls, (uint8_t *)ex->buf().c_str(), ex->buf().size());
+  ret = tls_import_context2(tls, (uint8_t *)buf, len);
   if (ret < 0) {
     return -EINVAL;
   }
@@ -40,3 +39,29 @@ tls_import(struct TLSContext *tls, const prism::TLSState *ex)
 
   return 0;
 }
+
+int
+tls_export(struct TLSContext *tls, prism::TLSState *ex)
+{
+  int error;
+  uint8_t *buf;
+  uint32_t len;
+
+  error = tls_export_buf(tls, &buf, &len);
+  if (error) {
+    return error;
+  }
+
+  ex->set_buf(buf, len);
+
+  free(buf);
+
+  return 0;
+}
+
+int
+tls_import(struct TLSContext *tls, const prism::TLSState *ex)
+{
+  return tls_import_buf(tls, (const uint8_t *)ex->buf().c_str(),
+                        ex->buf().size());
+}
@@ -5,22 +5,39 @@ enum psw_requests {
   PSW_REQ_DELETE,
   PSW_REQ_CHOWN,
   PSW_REQ_LOCK,
-  PSW_REQ_UNLOCK
+  PSW_REQ_UNLOCK,
+  PSW_REQ_BATCH
 };
 
+/*
+ * IPv6 address in network byte order. IPv4 addresses are mapped
+ * (::ffff:a.b.c.d) like in6_addr of the servers, so an IPv4 packet only
+ * matches the mapped entries.
+ */
+typedef struct psw_addr {
+  uint32_t w[4];
+} __attribute__((packed)) psw_addr_t;
+
+/*
+ * The switch replies by echoing the request back with status filled in.
+ * seq is opaque to the switch, the client uses it to match the reply to
+ * the pending request.
+ */
 typedef struct psw_req_base {
   uint8_t type;
   uint16_t status;
+  uint32_t seq;
 } __attribute__((packed)) psw_req_base_t;
 
 typedef struct psw_add_req {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
-  uint32_t virtual_addr;
+  psw_addr_t virtual_addr;
   uint16_t virtual_port;
-  uint32_t owner_addr;
+  psw_addr_t owner_addr;
   uint16_t owner_port;
   uint8_t owner_mac[6];
   uint8_t lock;
@@ -29,9 +46,10 @@ typedef struct psw_add_req {
 typedef struct psw_chown_req {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
-  uint32_t owner_addr;
+  psw_addr_t owner_addr;
   uint16_t owner_port;
   uint8_t owner_mac[6];
   uint8_t unlock;
@@ -40,26 +58,52 @@ typedef struct psw_chown_req {
 typedef struct psw_delete_req {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
 } __attribute__((packed)) psw_delete_req_t;
 
 typedef struct psw_lock_req {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
 } __attribute__((packed)) psw_lock_req_t;
 
+/*
+ * Batch of up to PSW_BATCH_MAX requests in one datagram. Entries are
+ * fixed size slots which can hold any request type, only the first count
+ * entries are sent. The switch processes them in order and returns the
+ * result of each entry in its status field.
+ */
+#define PSW_BATCH_MAX 8
+
+typedef union psw_batch_entry {
+  struct psw_req_base base;
+  struct psw_add_req add;
+  struct psw_chown_req chown;
+  struct psw_delete_req del;
+  struct psw_lock_req lock;
+} __attribute__((packed)) psw_batch_entry_t;
+
+typedef struct psw_batch_req {
+  uint8_t type;
+  uint16_t status;
+  uint32_t seq;
+  uint8_t count;
+  psw_batch_entry_t entries[PSW_BATCH_MAX];
+} __attribute__((packed)) psw_batch_req_t;
+
 typedef struct {
-  uint32_t addr;
+  psw_addr_t addr;
   uint32_t port;
 } prism_key_t;
 
 typedef struct {
-  uint32_t virtual_addr;
+  psw_addr_t virtual_addr;
   uint16_t virtual_port;
-  uint32_t owner_addr;
+  psw_addr_t owner_addr;
   uint16_t owner_port;
   uint8_t owner_mac[6];
   uint8_t locked;
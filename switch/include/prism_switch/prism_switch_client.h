@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <uv.h>
 
 struct prism_switch_client_s;
@@ -11,24 +12,44 @@ enum psw_requests {
   PSW_REQ_DELETE,
   PSW_REQ_CHOWN,
   PSW_REQ_LOCK,
-  PSW_REQ_UNLOCK
+  PSW_REQ_UNLOCK,
+  PSW_REQ_BATCH
 };
 
+/*
+ * IPv6 address in network byte order. IPv4 addresses are mapped
+ * (::ffff:a.b.c.d) like in6_addr of the servers, so an IPv4 packet only
+ * matches the mapped entries.
+ */
+typedef struct psw_addr {
+  uint32_t w[4];
+} __attribute__((packed)) psw_addr_t;
+
+/*
+ * The switch replies by echoing the request back with status filled in,
+ * 0 or an errno value. Requests the switch doesn't answer complete with
+ * ETIMEDOUT. EEXIST of ADD and ENOENT of DELETE are reported as success
+ * when the request was retransmitted, as they are what applying it again
+ * gives. seq is opaque to the switch, the client uses it to match the
+ * reply to the pending request.
+ */
 typedef struct psw_req_base {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
 } __attribute__((packed)) psw_req_base_t;
 
 typedef struct psw_add_req {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
-  uint32_t virtual_addr;
+  psw_addr_t virtual_addr;
   uint16_t virtual_port;
-  uint32_t owner_addr;
+  psw_addr_t owner_addr;
   uint16_t owner_port;
   uint8_t owner_mac[6];
   uint8_t lock;
@@ -37,9 +58,10 @@ typedef struct psw_add_req {
 typedef struct psw_chown_req {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
-  uint32_t owner_addr;
+  psw_addr_t owner_addr;
   uint16_t owner_port;
   uint8_t owner_mac[6];
   uint8_t unlock;
@@ -48,22 +70,87 @@ typedef struct psw_chown_req {
 typedef struct psw_delete_req {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
 } __attribute__((packed)) psw_delete_req_t;
 
 typedef struct psw_lock_req {
   uint8_t type;
   uint16_t status;
-  uint32_t peer_addr;
+  uint32_t seq;
+  psw_addr_t peer_addr;
   uint16_t peer_port;
 } __attribute__((packed)) psw_lock_req_t;
 
+/*
+ * Batch of up to PSW_BATCH_MAX requests in one datagram. Entries are
+ * fixed size slots which can hold any request type, only the first count
+ * entries are sent. The switch processes them in order and returns the
+ * result of each entry in its status field.
+ */
+#define PSW_BATCH_MAX 8
+
+typedef union psw_batch_entry {
+  struct psw_req_base base;
+  struct psw_add_req add;
+  struct psw_chown_req chown;
+  struct psw_delete_req del;
+  struct psw_lock_req lock;
+} __attribute__((packed)) psw_batch_entry_t;
+
+typedef struct psw_batch_req {
+  uint8_t type;
+  uint16_t status;
+  uint32_t seq;
+  uint8_t count;
+  psw_batch_entry_t entries[PSW_BATCH_MAX];
+} __attribute__((packed)) psw_batch_req_t;
+
 typedef void (*psw_config_cb)(struct psw_req_base *req, void *data);
+typedef void (*psw_batch_cb)(struct psw_batch_req *req, void *data);
 
 extern prism_switch_client_t *prism_switch_client_create(uv_loop_t *loop,
                                                          const char *host);
 extern int prism_switch_client_queue_task(prism_switch_client_t *client,
                                           struct psw_req_base *req,
                                           psw_config_cb cb, void *data);
+
+/*
+ * Build a batch with psw_batch_init/psw_batch_add and submit it with
+ * prism_switch_client_queue_batch. The callback is called once with the
+ * reply, per-entry results are in entries[i].base.status.
+ */
+extern void psw_batch_init(struct psw_batch_req *batch);
+extern int psw_batch_add(struct psw_batch_req *batch,
+                         const struct psw_req_base *req);
+extern int prism_switch_client_queue_batch(prism_switch_client_t *client,
+                                           struct psw_batch_req *batch,
+                                           psw_batch_cb cb, void *data);
+
+/*
+ * When enabled, requests submitted with prism_switch_client_queue_task
+ * within one loop iteration are sent as batches. Each request still gets
+ * its own callback with its own entry of the reply.
+ */
+extern void prism_switch_client_set_coalesce(prism_switch_client_t *client,
+                                             bool enable);
+
+struct psw_client_stats {
+  uint32_t ninflight;   /* datagrams waiting for the reply */
+  uint32_t nbacklog;    /* requests waiting for the window */
+  uint32_t max_backlog; /* high watermark of nbacklog */
+  uint64_t nsent;
+  uint64_t nretrans;
+};
+
+/*
+ * Limit of the datagrams on the wire, the rest wait in the client in the
+ * submission order. 0 sets the default.
+ */
+extern void
+prism_switch_client_set_max_inflight(prism_switch_client_t *client,
+                                     uint32_t max_inflight);
+extern void prism_switch_client_get_stats(prism_switch_client_t *client,
+                                          struct psw_client_stats *stats);
 extern void prism_switch_client_destroy(prism_switch_client_t *client);
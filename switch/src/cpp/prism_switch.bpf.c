@@ -15,6 +15,7 @@ struct eth {
 };
 
 #define ETH_P_IP 0x0800
+#define ETH_P_IPV6 0x86DD
 
 struct ip {
   uint16_t hl:4;
@@ -30,6 +31,19 @@ struct ip {
   uint32_t dst;
 };
 
+/*
+ * Fixed header only, packets with the extension headers go to the l2
+ * switch
+ */
+struct ip6 {
+  uint32_t flow;
+  uint16_t plen;
+  uint8_t nxt;
+  uint8_t hlim;
+  uint32_t src[4];
+  uint32_t dst[4];
+};
+
 #define IPPROTO_TCP 6
 #define IPPROTO_UDP 17
 #define IPPROTO_ICMP 1
@@ -60,14 +74,22 @@ struct udp {
   uint16_t csum;
 };
 
+/*
+ * saddr and daddr point to the addresses in the IPv4 or IPv6 header,
+ * naddr is their length in words. ip is NULL for IPv6.
+ */
 struct prism_switch_headers {
   struct eth *eth;
   struct ip *ip;
+  struct ip6 *ip6;
   union {
     struct tcp *tcp;
     struct udp *udp;
   };
   struct psw_req_base *prb;
+  uint32_t *saddr;
+  uint32_t *daddr;
+  int naddr;
 };
 
 struct prism_switch_metadata {
@@ -97,6 +119,68 @@ csum16_sub(uint16_t csum, uint16_t addend)
   return csum16_add(csum, ~addend);
 }
 
+/*
+ * Replaces the address words in the checksum, the IPv4 header checksum
+ * or the TCP one, whose pseudo-header covers the addresses of both
+ * families
+ */
+static __attribute__((always_inline)) uint16_t
+csum_replace_addr(uint16_t csum, const uint32_t *from, const uint32_t *to,
+    int naddr)
+{
+  #pragma unroll
+  for (int i = 0; i < 4; i++) {
+    if (i >= naddr) {
+      break;
+    }
+
+    csum = csum16_sub(csum, ~(from[i] >> 16));
+    csum = csum16_sub(csum, ~(from[i] & 0xffff));
+    csum = csum16_add(csum, ~(to[i] >> 16));
+    csum = csum16_add(csum, ~(to[i] & 0xffff));
+  }
+
+  return csum;
+}
+
+static __attribute__((always_inline)) void
+addr_copy(uint32_t *dst, const uint32_t *src, int naddr)
+{
+  #pragma unroll
+  for (int i = 0; i < 4; i++) {
+    if (i >= naddr) {
+      break;
+    }
+
+    dst[i] = src[i];
+  }
+}
+
+/*
+ * Table key of the packet address, IPv4 ones are mapped
+ */
+static __attribute__((always_inline)) void
+addr_to_key(psw_addr_t *key, const uint32_t *addr, int naddr)
+{
+  if (naddr == 1) {
+    key->w[0] = 0;
+    key->w[1] = 0;
+    key->w[2] = bpf_htonl(0xffff);
+    key->w[3] = addr[0];
+  } else {
+    addr_copy(key->w, addr, 4);
+  }
+}
+
+/*
+ * Address of the table value in the packet address format
+ */
+static __attribute__((always_inline)) const uint32_t *
+addr_from_val(const psw_addr_t *val, int naddr)
+{
+  return naddr == 1 ? val->w + 3 : val->w;
+}
+
 static __attribute__((always_inline)) void
 config_prepare_response(struct prism_switch_metadata *metadata,
     struct prism_switch_headers *headers, int status)
@@ -129,10 +213,23 @@ config_prepare_response(struct prism_switch_metadata *metadata,
   headers->udp->src = headers->udp->dst;
   headers->udp->dst = tmp_port;
 
+  /*
+   * Batch reply has many status fields updated. Rather than updating
+   * the checksum for each of them, omit it (allowed for UDP over IPv4).
+   */
+  if (headers->prb->type == PSW_REQ_BATCH) {
+    headers->udp->csum = 0;
+    return;
+  }
+
+  /*
+   * Status of the single request, the same as the batch entries get
+   */
   uint16_t udp_csum;
   udp_csum = csum16_sub(headers->udp->csum, ~(headers->prb->status));
   udp_csum = csum16_add(udp_csum, ~((uint16_t)-status));
   headers->udp->csum = udp_csum;
+  headers->prb->status = (uint16_t)-status;
 }
 
 static __attribute__((always_inline)) int
@@ -202,7 +299,6 @@ config_handle_chown_req(struct prism_switch_metadata *metadata,
   int error;
   struct psw_chown_req *pcr = (struct psw_chown_req *)metadata->cur;
   if (!((metadata->cur + sizeof(*pcr) <= metadata->data_end))) {
-    metadata->abort = 1;
     return -EINVAL;
   }
 
@@ -239,7 +335,6 @@ config_handle_lock_req(struct prism_switch_metadata *metadata,
   int error;
   struct psw_lock_req *plr = (struct psw_lock_req *)metadata->cur;
   if (!((metadata->cur + sizeof(*plr) <= metadata->data_end))) {
-    metadata->abort = 1;
     return -EINVAL;
   }
 
@@ -274,7 +369,6 @@ config_handle_unlock_req(struct prism_switch_metadata *metadata,
   int error;
   struct psw_lock_req *pur = (struct psw_lock_req *)metadata->cur;
   if (!((metadata->cur + sizeof(*pur) <= metadata->data_end))) {
-    metadata->abort = 1;
     return -EINVAL;
   }
 
@@ -302,53 +396,120 @@ config_handle_unlock_req(struct prism_switch_metadata *metadata,
   return 0;
 }
 
-static __attribute__((always_inline)) void
-configure_switch(struct prism_switch_metadata *metadata,
-    struct prism_switch_headers *headers)
+static __attribute__((always_inline)) int
+config_handle_one(struct prism_switch_metadata *metadata,
+    struct prism_switch_headers *headers, uint8_t type)
 {
-  int error;
-  struct psw_req_base *prb = (struct psw_req_base *)metadata->cur;
-  if (!((metadata->cur + sizeof(*prb) <= metadata->data_end))) {
-    metadata->abort = 1;
-    return;
-  }
-
-  headers->prb = prb;
-
-  switch (prb->type) {
+  switch (type) {
     case PSW_REQ_ADD:
 #ifdef DEBUG
       bpf_trace_printk("ADD\n");
 #endif
-      error = config_handle_add_req(metadata, headers);
-      break;
+      return config_handle_add_req(metadata, headers);
     case PSW_REQ_DELETE:
 #ifdef DEBUG
       bpf_trace_printk("DELETE\n");
 #endif
-      error = config_handle_delete_req(metadata, headers);
-      break;
+      return config_handle_delete_req(metadata, headers);
     case PSW_REQ_CHOWN:
 #ifdef DEBUG
       bpf_trace_printk("CHOWN\n");
 #endif
-      error = config_handle_chown_req(metadata, headers);
-      break;
+      return config_handle_chown_req(metadata, headers);
     case PSW_REQ_LOCK:
 #ifdef DEBUG
       bpf_trace_printk("LOCK\n");
 #endif
-      error = config_handle_lock_req(metadata, headers);
-      break;
+      return config_handle_lock_req(metadata, headers);
     case PSW_REQ_UNLOCK:
 #ifdef DEBUG
       bpf_trace_printk("UNLOCK\n");
 #endif
-      error = config_handle_unlock_req(metadata, headers);
-      break;
+      return config_handle_unlock_req(metadata, headers);
     default:
-      metadata->abort = 1;
+      return -EINVAL;
+  }
+}
+
+/*
+ * Process the entries of the batch in order and write the result of each
+ * entry into its status. Loop is bounded by PSW_BATCH_MAX and unrolled.
+ * Malformed entries get EINVAL like the single requests. The reply is cut
+ * (count) before an entry whose header is past the end of the packet,
+ * and a batch with too many entries comes back empty with EINVAL in the
+ * status of the batch.
+ */
+static __attribute__((always_inline)) void
+config_handle_batch_req(struct prism_switch_metadata *metadata,
+    struct prism_switch_headers *headers)
+{
+  int error;
+  struct psw_batch_req *pbr = (struct psw_batch_req *)metadata->cur;
+  uint8_t *entries = metadata->cur + __builtin_offsetof(struct psw_batch_req,
+      entries);
+  if (!((entries <= metadata->data_end))) {
+    metadata->abort = 1;
+    return;
+  }
+
+  if (pbr->count > PSW_BATCH_MAX) {
+    pbr->status = EINVAL;
+    pbr->count = 0;
+    return;
+  }
+
+#ifdef DEBUG
+  bpf_trace_printk("BATCH\n");
+#endif
+
+  #pragma unroll
+  for (int i = 0; i < PSW_BATCH_MAX; i++) {
+    if (i >= pbr->count) {
+      break;
+    }
+
+    union psw_batch_entry *ent = (union psw_batch_entry *)(entries +
+        i * sizeof(union psw_batch_entry));
+    if (!(((uint8_t *)ent + sizeof(ent->base) <= metadata->data_end))) {
+      pbr->count = i;
       return;
+    }
+
+    metadata->cur = (uint8_t *)ent;
+    error = config_handle_one(metadata, headers, ent->base.type);
+    if (metadata->abort == 1) {
+      return;
+    }
+
+    ent->base.status = (uint16_t)-error;
+  }
+}
+
+static __attribute__((always_inline)) void
+configure_switch(struct prism_switch_metadata *metadata,
+    struct prism_switch_headers *headers)
+{
+  int error;
+  struct psw_req_base *prb = (struct psw_req_base *)metadata->cur;
+  if (!((metadata->cur + sizeof(*prb) <= metadata->data_end))) {
+    metadata->abort = 1;
+    return;
+  }
+
+  headers->prb = prb;
+
+  if (prb->type == PSW_REQ_BATCH) {
+    config_handle_batch_req(metadata, headers);
+    if (metadata->abort == 1) {
+      return;
+    }
+
+    error = 0;
+  } else {
+    error = config_handle_one(metadata, headers, prb->type);
+    if (metadata->abort == 1) {
+      return;
+    }
   }
 
   config_prepare_response(metadata, headers, error);
@@ -359,7 +520,7 @@ prism_out_lookup(struct prism_switch_metadata *metadata,
     struct prism_switch_headers *headers)
 {
   prism_key_t key;
-  key.addr = headers->ip->dst;
+  addr_to_key(&key.addr, headers->daddr, headers->naddr);
   key.port = headers->tcp->dst;
 
   prism_value_t *val = prism.lookup(&key);
@@ -372,24 +533,24 @@ prism_out_lookup(struct prism_switch_metadata *metadata,
     return;
   }
 
-  uint16_t ip_csum;
-  ip_csum = csum16_sub(headers->ip->csum, ~(headers->ip->src >> 16));
-  ip_csum = csum16_sub(ip_csum, ~(headers->ip->src & 0xffff));
-  ip_csum = csum16_add(ip_csum, ~(val->virtual_addr >> 16));
-  ip_csum = csum16_add(ip_csum, ~(val->virtual_addr & 0xffff));
-  headers->ip->csum = ip_csum;
+  const uint32_t *virtual_addr = addr_from_val(&val->virtual_addr,
+      headers->naddr);
+
+  // IPv6 has no header checksum
+  if (headers->ip != NULL) {
+    headers->ip->csum = csum_replace_addr(headers->ip->csum, headers->saddr,
+        virtual_addr, 1);
+  }
 
   uint16_t tcp_csum;
-  tcp_csum = csum16_sub(headers->tcp->csum, ~(headers->ip->src >> 16));
-  tcp_csum = csum16_sub(tcp_csum, ~(headers->ip->src & 0xffff));
-  tcp_csum = csum16_add(tcp_csum, ~(val->virtual_addr >> 16));
-  tcp_csum = csum16_add(tcp_csum, ~(val->virtual_addr & 0xffff));
+  tcp_csum = csum_replace_addr(headers->tcp->csum, headers->saddr,
+      virtual_addr, headers->naddr);
   tcp_csum = csum16_sub(tcp_csum, ~(headers->tcp->src));
   tcp_csum = csum16_add(tcp_csum, ~(val->virtual_port));
   headers->tcp->csum = tcp_csum;
 
   headers->tcp->src = val->virtual_port;
-  headers->ip->src = val->virtual_addr;
+  addr_copy(headers->saddr, virtual_addr, headers->naddr);
 
   metadata->matched = 1;
 }
@@ -399,7 +560,7 @@ prism_in_lookup(struct prism_switch_metadata *metadata,
     struct prism_switch_headers *headers)
 {
   prism_key_t key;
-  key.addr = headers->ip->src;
+  addr_to_key(&key.addr, headers->saddr, headers->naddr);
   key.port = headers->tcp->src;
 
   prism_value_t *val = prism.lookup(&key);
@@ -421,25 +582,24 @@ prism_in_lookup(struct prism_switch_metadata *metadata,
   headers->eth->dst[5] = val->owner_mac[5];
   
 
-  // Rewrite destination IP address
-  uint16_t ip_csum;
-  ip_csum = csum16_sub(headers->ip->csum, ~(headers->ip->dst >> 16));
-  ip_csum = csum16_sub(ip_csum, ~(headers->ip->dst & 0xffff));
-  ip_csum = csum16_add(ip_csum, ~(val->owner_addr >> 16));
-  ip_csum = csum16_add(ip_csum, ~(val->owner_addr & 0xffff));
-  headers->ip->csum = ip_csum;
+  const uint32_t *owner_addr = addr_from_val(&val->owner_addr,
+      headers->naddr);
+
+  // Rewrite destination IP address, IPv6 has no header checksum
+  if (headers->ip != NULL) {
+    headers->ip->csum = csum_replace_addr(headers->ip->csum, headers->daddr,
+        owner_addr, 1);
+  }
 
   // Rewrite destination TCP port
   uint16_t tcp_csum;
-  tcp_csum = csum16_sub(headers->tcp->csum, ~(headers->ip->dst >> 16));
-  tcp_csum = csum16_sub(tcp_csum, ~(headers->ip->dst & 0xffff));
-  tcp_csum = csum16_add(tcp_csum, ~(val->owner_addr >> 16));
-  tcp_csum = csum16_add(tcp_csum, ~(val->owner_addr & 0xffff));
+  tcp_csum = csum_replace_addr(headers->tcp->csum, headers->daddr,
+      owner_addr, headers->naddr);
   tcp_csum = csum16_sub(tcp_csum, ~(headers->tcp->dst));
   tcp_csum = csum16_add(tcp_csum, ~(val->owner_port));
   headers->tcp->csum = tcp_csum;
 
-  headers->ip->dst = val->owner_addr;
+  addr_copy(headers->daddr, owner_addr, headers->naddr);
   headers->tcp->dst = val->owner_port;
 
   metadata->matched = 1;
@@ -497,6 +657,7 @@ vale_lookup(struct xdp_md *md)
 
   headers.eth = NULL;
   headers.ip = NULL;
+  headers.ip6 = NULL;
   headers.tcp = NULL;
 
   /*
@@ -509,6 +670,11 @@ vale_lookup(struct xdp_md *md)
     return VALE_BPF_DROP;
   }
 
+  if (bpf_ntohs(headers.eth->type) == ETH_P_IPV6) {
+    metadata.cur += sizeof(struct eth);
+    goto ipv6;
+  }
+
   if (bpf_ntohs(headers.eth->type) != ETH_P_IP) {
     goto l2; // fallback to l2 switch
   }
@@ -526,7 +692,7 @@ vale_lookup(struct xdp_md *md)
   metadata.cur += sizeof(struct ip);
 
   /*
-   * Possibly switch configuration packet
+   * Possibly switch configuration packet. It comes over IPv4 only.
    */
   if (headers.ip->proto == IPPROTO_UDP) {
     headers.udp = (struct udp *)metadata.cur;
@@ -554,32 +720,56 @@ vale_lookup(struct xdp_md *md)
     return metadata.sport;
   }
 
+  if (headers.ip->proto != IPPROTO_TCP) {
+    goto l2;
+  }
+
+  headers.saddr = &headers.ip->src;
+  headers.daddr = &headers.ip->dst;
+  headers.naddr = 1;
+  goto tcp;
+
+ipv6:
+  //Parse IPv6
+  headers.ip6 = (struct ip6 *)metadata.cur;
+  if (!((metadata.cur + sizeof(struct ip6)) <= data_end)) {
+    goto l2; // fallback to l2 switch
+  }
+
+  if (headers.ip6->nxt != IPPROTO_TCP) {
+    goto l2; // extension headers or not TCP
+  }
+  metadata.cur += sizeof(struct ip6);
+
+  headers.saddr = headers.ip6->src;
+  headers.daddr = headers.ip6->dst;
+  headers.naddr = 4;
+
   /*
    * Prism logic
    */
-  if (headers.ip->proto == IPPROTO_TCP) {
-    headers.tcp = (struct tcp *)metadata.cur;
-    if (!((metadata.cur + sizeof(struct tcp)) <= data_end)) {
-      goto l2;
-    }
-    metadata.cur += sizeof(struct tcp);
+tcp:
+  headers.tcp = (struct tcp *)metadata.cur;
+  if (!((metadata.cur + sizeof(struct tcp)) <= data_end)) {
+    goto l2;
+  }
+  metadata.cur += sizeof(struct tcp);
 
-    /*
-     * Table lookups
-     */
-    prism_out_lookup(&metadata, &headers);
-    if (metadata.matched == 1) {
-      goto l2;
-    }
+  /*
+   * Table lookups
+   */
+  prism_out_lookup(&metadata, &headers);
+  if (metadata.matched == 1) {
+    goto l2;
+  }
 
-    if (metadata.abort == 1) {
-      return VALE_BPF_DROP;
-    }
+  if (metadata.abort == 1) {
+    return VALE_BPF_DROP;
+  }
 
-    prism_in_lookup(&metadata, &headers);
-    if (metadata.abort == 1) {
-      return VALE_BPF_DROP;
-    }
+  prism_in_lookup(&metadata, &headers);
+  if (metadata.abort == 1) {
+    return VALE_BPF_DROP;
   }
 
 l2:
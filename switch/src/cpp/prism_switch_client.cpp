@@ -5,22 +5,99 @@
 #include <cassert>
 #include <netinet/ip.h>
 #include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <cerrno>
 
 #include <prism_switch/prism_switch_client.h>
 
+/*
+ * All requests of a loop go through one persistent UDP socket. In-flight
+ * requests live in a slot table and are matched with the replies by seq.
+ * The lower 16 bits of seq is the slot index, upper bits are the
+ * generation of the slot, so late replies to the retransmitted requests
+ * are ignored after the slot is reused.
+ *
+ * Retransmission is driven by a single timer wheel ticking every
+ * PSW_TICK_MS while anything is in flight. Requests not answered after
+ * PSW_MAX_RETRIES retransmissions complete with ETIMEDOUT.
+ *
+ * At most max_inflight datagrams are on the wire at a time. Requests
+ * beyond that wait in the backlog in the submission order and are sent
+ * as the replies come back, so a burst doesn't overrun the switch (or
+ * the socket buffer) and get recovered only by the retransmission.
+ */
+#define PSW_RTO_MS 100
+#define PSW_TICK_MS 10
+#define PSW_WHEEL_SLOTS 16 /* must be larger than PSW_RTO_MS / PSW_TICK_MS */
+#define PSW_MAX_RETRIES 10
+
+#define PSW_SLOT_BITS 16
+#define PSW_SLOT_MASK ((1U << PSW_SLOT_BITS) - 1)
+#define PSW_CHUNK_SLOTS 256
+#define PSW_MAX_CHUNKS ((1U << PSW_SLOT_BITS) / PSW_CHUNK_SLOTS)
+
+#define PSW_REQ_MAX_SIZE sizeof(psw_batch_req_t)
+
+#define PSW_DEFAULT_MAX_INFLIGHT 256
+
 struct psw_config_req {
-  uv_udp_t super;
-  uv_buf_t sbuf;
+  uint32_t seq;
+  uint32_t idx;
+  bool in_use;
+  uint8_t sbuf[PSW_REQ_MAX_SIZE];
+  uint32_t len;
   psw_config_cb user_cb;
   void *user_data;
-  uv_timer_t retry_timer;
   uint32_t retry_count;
-  prism_switch_client_t *client;
+
+  /*
+   * Batch made of the requests coalesced by the client. Each entry has
+   * its own callback.
+   */
+  bool coalesced;
+  psw_config_cb entry_cb[PSW_BATCH_MAX];
+  void *entry_data[PSW_BATCH_MAX];
+
+  /*
+   * Timer wheel linkage while on the wire, backlog or freelist linkage
+   * otherwise
+   */
+  struct psw_config_req *next;
+  struct psw_config_req **pprev;
 };
 
 struct prism_switch_client_s {
   uv_loop_t *loop;
   struct sockaddr_in sw_addr;
+  uv_udp_t udp;
+  uv_timer_t timer;
+  int nclosing;
+
+  struct psw_config_req *chunks[PSW_MAX_CHUNKS];
+  uint32_t nchunks;
+  struct psw_config_req *free_reqs;
+  uint32_t ninflight; /* slots in use, including the backlog */
+
+  uint32_t max_inflight;
+  uint32_t nwire;
+  struct psw_config_req *backlog_head;
+  struct psw_config_req *backlog_tail;
+  struct psw_client_stats stats;
+
+  struct psw_config_req *wheel[PSW_WHEEL_SLOTS];
+  uint64_t tick;
+
+  /*
+   * Batch being filled by the coalescing, sent when it is full or at
+   * the end of the loop iteration.
+   */
+  bool coalesce;
+  uv_check_t check;
+  struct psw_config_req *open_batch;
+
+  char rbuf[PSW_REQ_MAX_SIZE * 2];
 };
 
 static std::vector<std::string>
@@ -47,40 +124,491 @@ split(std::string str, char del)
   return result;
 }
 
+static int
+psw_batch_size(uint8_t count)
+{
+  return offsetof(psw_batch_req_t, entries) +
+         count * sizeof(psw_batch_entry_t);
+}
+
+static int
+psw_req_size(const struct psw_req_base *req)
+{
+  switch (req->type) {
+  case PSW_REQ_ADD:
+    return sizeof(psw_add_req_t);
+  case PSW_REQ_DELETE:
+    return sizeof(psw_delete_req_t);
+  case PSW_REQ_CHOWN:
+    return sizeof(psw_chown_req_t);
+  case PSW_REQ_LOCK:
+    return sizeof(psw_lock_req_t);
+  case PSW_REQ_UNLOCK:
+    return sizeof(psw_lock_req_t);
+  case PSW_REQ_BATCH:
+    if (((const psw_batch_req_t *)req)->count > PSW_BATCH_MAX) {
+      return -EINVAL;
+    }
+    return psw_batch_size(((const psw_batch_req_t *)req)->count);
+  default:
+    return -EINVAL;
+  }
+}
+
+void
+psw_batch_init(struct psw_batch_req *batch)
+{
+  batch->type = PSW_REQ_BATCH;
+  batch->status = 0;
+  batch->count = 0;
+}
+
+int
+psw_batch_add(struct psw_batch_req *batch, const struct psw_req_base *req)
+{
+  int len;
+
+  if (req->type == PSW_REQ_BATCH) {
+    return -EINVAL;
+  }
+
+  if (batch->count == PSW_BATCH_MAX) {
+    return -ENOSPC;
+  }
+
+  len = psw_req_size(req);
+  if (len < 0) {
+    return len;
+  }
+
+  memcpy(batch->entries + batch->count, req, len);
+  batch->count++;
+
+  return 0;
+}
+
+static struct psw_config_req *
+lookup_req(prism_switch_client_t *client, uint32_t seq)
+{
+  uint32_t idx = seq & PSW_SLOT_MASK;
+  struct psw_config_req *req;
+
+  if (idx >= client->nchunks * PSW_CHUNK_SLOTS) {
+    return NULL;
+  }
+
+  req = client->chunks[idx / PSW_CHUNK_SLOTS] + idx % PSW_CHUNK_SLOTS;
+  if (!req->in_use || req->seq != seq) {
+    return NULL;
+  }
+
+  return req;
+}
+
+static int
+add_chunk(prism_switch_client_t *client)
+{
+  struct psw_config_req *chunk;
+  uint32_t base;
+
+  if (client->nchunks == PSW_MAX_CHUNKS) {
+    return -ENOMEM;
+  }
+
+  chunk = (struct psw_config_req *)calloc(PSW_CHUNK_SLOTS, sizeof(*chunk));
+  if (chunk == NULL) {
+    return -ENOMEM;
+  }
+
+  base = client->nchunks * PSW_CHUNK_SLOTS;
+  for (int i = PSW_CHUNK_SLOTS - 1; i >= 0; i--) {
+    chunk[i].idx = base + i;
+    chunk[i].next = client->free_reqs;
+    client->free_reqs = chunk + i;
+  }
+
+  client->chunks[client->nchunks++] = chunk;
+
+  return 0;
+}
+
+static struct psw_config_req *
+alloc_req(prism_switch_client_t *client)
+{
+  struct psw_config_req *req;
+
+  if (client->free_reqs == NULL && add_chunk(client) != 0) {
+    return NULL;
+  }
+
+  req = client->free_reqs;
+  client->free_reqs = req->next;
+
+  /*
+   * Bump the generation so that the replies for the previous user of
+   * the slot don't match.
+   */
+  req->seq = ((req->seq & ~PSW_SLOT_MASK) + (1U << PSW_SLOT_BITS)) | req->idx;
+  req->in_use = true;
+  req->coalesced = false;
+  client->ninflight++;
+
+  return req;
+}
+
+static void
+free_req(prism_switch_client_t *client, struct psw_config_req *req)
+{
+  req->in_use = false;
+  req->next = client->free_reqs;
+  req->pprev = NULL;
+  client->free_reqs = req;
+  client->ninflight--;
+}
+
+static void
+wheel_insert(prism_switch_client_t *client, struct psw_config_req *req)
+{
+  struct psw_config_req **head =
+      client->wheel + (client->tick + PSW_RTO_MS / PSW_TICK_MS) %
+                          PSW_WHEEL_SLOTS;
+
+  req->next = *head;
+  if (*head != NULL) {
+    (*head)->pprev = &req->next;
+  }
+  req->pprev = head;
+  *head = req;
+}
+
+static void
+wheel_remove(struct psw_config_req *req)
+{
+  *req->pprev = req->next;
+  if (req->next != NULL) {
+    req->next->pprev = req->pprev;
+  }
+}
+
+static void start_req(prism_switch_client_t *client,
+                      struct psw_config_req *conf_req);
+
+/*
+ * Request is done and off the wheel. Frees its slot and sends the
+ * waiting requests into the window.
+ */
+static void
+release_req(prism_switch_client_t *client, struct psw_config_req *req)
+{
+  struct psw_config_req *next;
+
+  free_req(client, req);
+  client->nwire--;
+
+  while (client->backlog_head != NULL &&
+         client->nwire < client->max_inflight) {
+    next = client->backlog_head;
+    client->backlog_head = next->next;
+    if (client->backlog_head == NULL) {
+      client->backlog_tail = NULL;
+    }
+    client->stats.nbacklog--;
+    start_req(client, next);
+  }
+}
+
+/*
+ * Request is answered
+ */
+static void
+finish_req(prism_switch_client_t *client, struct psw_config_req *req)
+{
+  wheel_remove(req);
+  release_req(client, req);
+}
+
+/*
+ * Gives up on the request, which is already off the wheel. Callbacks
+ * get the request back with ETIMEDOUT in status, in every entry for the
+ * batches.
+ */
+static void
+expire_req(prism_switch_client_t *client, struct psw_config_req *req)
+{
+  uint8_t buf[PSW_REQ_MAX_SIZE];
+  struct psw_req_base *prb = (struct psw_req_base *)buf;
+  psw_batch_req_t *batch = (psw_batch_req_t *)buf;
+  psw_config_cb user_cb = req->user_cb;
+  void *user_data = req->user_data;
+  bool coalesced = req->coalesced;
+  psw_config_cb entry_cb[PSW_BATCH_MAX];
+  void *entry_data[PSW_BATCH_MAX];
+  uint8_t count = 0;
+
+  memcpy(buf, req->sbuf, req->len);
+  prb->status = ETIMEDOUT;
+
+  if (prb->type == PSW_REQ_BATCH) {
+    count = batch->count;
+    for (uint8_t i = 0; i < count; i++) {
+      batch->entries[i].base.status = ETIMEDOUT;
+    }
+  }
+
+  if (coalesced) {
+    memcpy(entry_cb, req->entry_cb, sizeof(entry_cb[0]) * count);
+    memcpy(entry_data, req->entry_data, sizeof(entry_data[0]) * count);
+  }
+
+  release_req(client, req);
+
+  if (!coalesced) {
+    if (user_cb) {
+      user_cb(prb, user_data);
+    }
+    return;
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (entry_cb[i]) {
+      entry_cb[i](&batch->entries[i].base, entry_data[i]);
+    }
+  }
+}
+
+/*
+ * Queued send with its own copy of the datagram. The request may be
+ * answered (by an earlier transmission) and its slot reused before the
+ * send completes.
+ */
+struct psw_send {
+  uv_udp_send_t req;
+  uint8_t buf[PSW_REQ_MAX_SIZE];
+};
+
+static void
+after_send(uv_udp_send_t *req, int status)
+{
+  if (status != 0) {
+    fprintf(stderr, "prism_switch_client: send: %s\n", uv_strerror(status));
+  }
+  free(req);
+}
+
+/*
+ * Try to send without allocating a send request, fall back to queueing
+ * a copy when the socket buffer is full. Lost packets are recovered by
+ * the retransmission.
+ */
+static void
+send_req(prism_switch_client_t *client, struct psw_config_req *req)
+{
+  int error;
+  uv_buf_t buf = uv_buf_init((char *)req->sbuf, req->len);
+
+  error = uv_udp_try_send(&client->udp, &buf, 1,
+                          (const struct sockaddr *)&client->sw_addr);
+  if (error >= 0) {
+    return;
+  }
+
+  if (error != UV_EAGAIN) {
+    fprintf(stderr, "prism_switch_client: send: %s\n", uv_strerror(error));
+    return;
+  }
+
+  struct psw_send *sreq = (struct psw_send *)malloc(sizeof(*sreq));
+  assert(sreq != NULL);
+
+  memcpy(sreq->buf, req->sbuf, req->len);
+  buf = uv_buf_init((char *)sreq->buf, req->len);
+
+  error = uv_udp_send(&sreq->req, &client->udp, &buf, 1,
+                      (const struct sockaddr *)&client->sw_addr, after_send);
+  assert(error == 0);
+}
+
+static void
+on_tick(uv_timer_t *timer)
+{
+  int error;
+  prism_switch_client_t *client = (prism_switch_client_t *)timer->data;
+  struct psw_config_req *req, *expired;
+
+  client->tick++;
+
+  expired = client->wheel[client->tick % PSW_WHEEL_SLOTS];
+  client->wheel[client->tick % PSW_WHEEL_SLOTS] = NULL;
+
+  while (expired != NULL) {
+    req = expired;
+    expired = req->next;
+
+    if (req->retry_count == PSW_MAX_RETRIES) {
+      expire_req(client, req);
+      continue;
+    }
+
+    req->retry_count++;
+    client->stats.nretrans++;
+    send_req(client, req);
+    wheel_insert(client, req);
+  }
+
+  if (client->ninflight == 0) {
+    error = uv_timer_stop(&client->timer);
+    assert(error == 0);
+  }
+}
+
 static void
 on_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
 {
-  buf->base = (char *)malloc(1024);
-  assert(buf->base != NULL);
-  buf->len = 1024;
+  prism_switch_client_t *client = (prism_switch_client_t *)handle->data;
+
+  /*
+   * Replies are consumed within on_recv, so one buffer is enough
+   */
+  buf->base = client->rbuf;
+  buf->len = sizeof(client->rbuf);
 }
 
+/*
+ * Replies to the retransmitted requests may carry the result of applying
+ * them again after the reply to the earlier transmission was lost. ADD
+ * then finds its own entry and DELETE finds none, which is success.
+ */
 static void
-on_recv(uv_udp_t *_client, ssize_t nread, const uv_buf_t *buf,
+fixup_status(struct psw_req_base *prb, bool retransmitted)
+{
+  if (!retransmitted) {
+    return;
+  }
+
+  if ((prb->type == PSW_REQ_ADD && prb->status == EEXIST) ||
+      (prb->type == PSW_REQ_DELETE && prb->status == ENOENT)) {
+    prb->status = 0;
+  }
+}
+
+/*
+ * Entries the switch cut from the batch reply (unparseable) are put back
+ * with EINVAL, so the callbacks see every entry they sent. The reply
+ * buffer has room for the full batch.
+ */
+static int
+fixup_reply(struct psw_config_req *req, struct psw_req_base *prb)
+{
+  psw_batch_req_t *sent = (psw_batch_req_t *)req->sbuf;
+  psw_batch_req_t *batch = (psw_batch_req_t *)prb;
+  bool retransmitted = req->retry_count != 0;
+
+  if (prb->type != sent->type) {
+    return -EINVAL;
+  }
+
+  if (prb->type != PSW_REQ_BATCH) {
+    fixup_status(prb, retransmitted);
+    return 0;
+  }
+
+  if (batch->count > sent->count) {
+    return -EINVAL;
+  }
+
+  for (uint8_t i = batch->count; i < sent->count; i++) {
+    memcpy(batch->entries + i, sent->entries + i, sizeof(batch->entries[i]));
+    batch->entries[i].base.status = EINVAL;
+  }
+
+  batch->count = sent->count;
+
+  for (uint8_t i = 0; i < batch->count; i++) {
+    fixup_status(&batch->entries[i].base, retransmitted);
+  }
+
+  return 0;
+}
+
+static void
+complete_coalesced(prism_switch_client_t *client, struct psw_config_req *req,
+                   struct psw_req_base *prb)
+{
+  psw_batch_req_t *batch = (psw_batch_req_t *)prb;
+  psw_config_cb entry_cb[PSW_BATCH_MAX];
+  void *entry_data[PSW_BATCH_MAX];
+  uint8_t count = batch->count;
+
+  memcpy(entry_cb, req->entry_cb, sizeof(entry_cb[0]) * count);
+  memcpy(entry_data, req->entry_data, sizeof(entry_data[0]) * count);
+
+  finish_req(client, req);
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (entry_cb[i]) {
+      entry_cb[i](&batch->entries[i].base, entry_data[i]);
+    }
+  }
+}
+
+static void
+on_recv(uv_udp_t *udp, ssize_t nread, const uv_buf_t *buf,
         const struct sockaddr *addr, unsigned flags)
 {
-  int error;
-  struct psw_config_req *req = (struct psw_config_req *)_client;
+  prism_switch_client_t *client = (prism_switch_client_t *)udp->data;
+  struct psw_config_req *req;
   struct psw_req_base *prb;
+  psw_config_cb user_cb;
+  void *user_data;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    fprintf(stderr, "prism_switch_client: recv: %s\n", uv_strerror(nread));
+    return;
+  }
 
   assert(flags != UV_UDP_PARTIAL);
-  assert(nread > 0);
+
+  if ((size_t)nread < sizeof(*prb)) {
+    return;
+  }
 
   prb = (struct psw_req_base *)buf->base;
 
-  if (req->user_cb) {
-    req->user_cb(prb, req->user_data);
+  if (prb->type == PSW_REQ_BATCH &&
+      (nread < psw_batch_size(0) ||
+       nread < psw_batch_size(((psw_batch_req_t *)prb)->count))) {
+    return;
   }
 
-  error = uv_timer_stop(&req->retry_timer);
-  assert(error == 0);
+  /*
+   * Duplicated replies of the retransmitted requests don't match
+   */
+  req = lookup_req(client, prb->seq);
+  if (req == NULL) {
+    return;
+  }
+
+  if (fixup_reply(req, prb) != 0) {
+    return;
+  }
+
+  if (req->coalesced) {
+    complete_coalesced(client, req, prb);
+    return;
+  }
 
-  free(req->sbuf.base);
+  user_cb = req->user_cb;
+  user_data = req->user_data;
 
-  uv_close((uv_handle_t *)&req->retry_timer, NULL);
-  uv_close((uv_handle_t *)req, (uv_close_cb)free);
+  finish_req(client, req);
 
-  free(buf->base);
+  if (user_cb) {
+    user_cb(prb, user_data);
+  }
 }
 
 prism_switch_client_t *
@@ -88,7 +616,7 @@ prism_switch_client_create(uv_loop_t *loop, const char *host)
 {
   int error;
   prism_switch_client_t *client =
-      (prism_switch_client_t *)malloc(sizeof(*client));
+      (prism_switch_client_t *)calloc(1, sizeof(*client));
   assert(client != NULL);
 
   auto spl_host = split(host, ':');
@@ -97,31 +625,141 @@ prism_switch_client_create(uv_loop_t *loop, const char *host)
   client->sw_addr.sin_port = htons((uint16_t)atoi(spl_host[1].c_str()));
 
   client->loop = loop;
+  client->max_inflight = PSW_DEFAULT_MAX_INFLIGHT;
+
+  error = uv_udp_init(loop, &client->udp);
+  assert(error == 0);
+
+  struct sockaddr_in baddr;
+  baddr.sin_family = AF_INET;
+  baddr.sin_addr.s_addr = 0;
+  baddr.sin_port = 0;
+  error = uv_udp_bind(&client->udp, (struct sockaddr *)&baddr, 0);
+  assert(error == 0);
+
+  client->udp.data = client;
+
+  error = uv_udp_recv_start(&client->udp, on_alloc, on_recv);
+  assert(error == 0);
+
+  /*
+   * Socket alone shouldn't keep the loop alive. Timer does while
+   * requests are in flight.
+   */
+  uv_unref((uv_handle_t *)&client->udp);
+
+  error = uv_timer_init(loop, &client->timer);
+  assert(error == 0);
+
+  client->timer.data = client;
+
+  error = uv_check_init(loop, &client->check);
+  assert(error == 0);
+
+  client->check.data = client;
 
   return client;
 }
 
 static void
-after_send(uv_udp_send_t *req, int status)
+start_req(prism_switch_client_t *client, struct psw_config_req *conf_req)
 {
-  assert(status == 0);
-  free(req);
+  int error;
+
+  if (client->nwire >= client->max_inflight) {
+    conf_req->next = NULL;
+    if (client->backlog_tail != NULL) {
+      client->backlog_tail->next = conf_req;
+    } else {
+      client->backlog_head = conf_req;
+    }
+    client->backlog_tail = conf_req;
+
+    client->stats.nbacklog++;
+    if (client->stats.nbacklog > client->stats.max_backlog) {
+      client->stats.max_backlog = client->stats.nbacklog;
+    }
+    return;
+  }
+
+  client->nwire++;
+  client->stats.nsent++;
+
+  if (!uv_is_active((uv_handle_t *)&client->timer)) {
+    error = uv_timer_start(&client->timer, on_tick, PSW_TICK_MS, PSW_TICK_MS);
+    assert(error == 0);
+  }
+
+  wheel_insert(client, conf_req);
+  send_req(client, conf_req);
 }
 
 static void
-retry_send(uv_timer_t *timer)
+send_open_batch(prism_switch_client_t *client)
 {
   int error;
-  struct psw_config_req *conf_req = (struct psw_config_req *)timer->data;
-  prism_switch_client_t *client = (prism_switch_client_t*)conf_req->client;
+  struct psw_config_req *conf_req = client->open_batch;
 
-  uv_udp_send_t *req = (uv_udp_send_t *)malloc(sizeof(*req));
-  assert(req != NULL);
+  client->open_batch = NULL;
 
-  error = uv_udp_send(req, &conf_req->super, &conf_req->sbuf,
-      1, (const struct sockaddr *)&client->sw_addr, after_send);
+  error = uv_check_stop(&client->check);
   assert(error == 0);
-  conf_req->retry_count++;
+
+  conf_req->len = psw_req_size((struct psw_req_base *)conf_req->sbuf);
+  start_req(client, conf_req);
+}
+
+static void
+on_check(uv_check_t *check)
+{
+  prism_switch_client_t *client = (prism_switch_client_t *)check->data;
+
+  if (client->open_batch != NULL) {
+    send_open_batch(client);
+  }
+}
+
+static int
+coalesce_task(prism_switch_client_t *client, struct psw_req_base *req,
+              psw_config_cb cb, void *data)
+{
+  int error;
+  struct psw_config_req *conf_req = client->open_batch;
+  psw_batch_req_t *batch;
+
+  if (conf_req == NULL) {
+    conf_req = alloc_req(client);
+    if (conf_req == NULL) {
+      return -ENOMEM;
+    }
+
+    batch = (psw_batch_req_t *)conf_req->sbuf;
+    psw_batch_init(batch);
+    batch->seq = conf_req->seq;
+    conf_req->coalesced = true;
+    conf_req->user_cb = NULL;
+    conf_req->user_data = NULL;
+    conf_req->retry_count = 0;
+    client->open_batch = conf_req;
+
+    error = uv_check_start(&client->check, on_check);
+    assert(error == 0);
+  }
+
+  batch = (psw_batch_req_t *)conf_req->sbuf;
+  conf_req->entry_cb[batch->count] = cb;
+  conf_req->entry_data[batch->count] = data;
+
+  error = psw_batch_add(batch, req);
+  if (error) {
+    return error;
+  }
+
+  if (batch->count == PSW_BATCH_MAX) {
+    send_open_batch(client);
+  }
+
+  return 0;
 }
 
 int
@@ -129,69 +767,120 @@ prism_switch_client_queue_task(prism_switch_client_t *client,
                                struct psw_req_base *req, psw_config_cb cb,
                                void *data)
 {
-  int error;
-  struct psw_config_req *conf_req =
-      (struct psw_config_req *)malloc(sizeof(*conf_req));
-  assert(conf_req != NULL);
+  int len;
+  struct psw_config_req *conf_req;
 
-  switch (req->type) {
-  case PSW_REQ_ADD:
-    conf_req->sbuf.len = sizeof(psw_add_req_t);
-    break;
-  case PSW_REQ_DELETE:
-    conf_req->sbuf.len = sizeof(psw_delete_req_t);
-    break;
-  case PSW_REQ_CHOWN:
-    conf_req->sbuf.len = sizeof(psw_chown_req_t);
-    break;
-  case PSW_REQ_LOCK:
-    conf_req->sbuf.len = sizeof(psw_lock_req_t);
-    break;
-  case PSW_REQ_UNLOCK:
-    conf_req->sbuf.len = sizeof(psw_lock_req_t);
-    break;
-  default:
-    return -EINVAL;
+  len = psw_req_size(req);
+  if (len < 0) {
+    return len;
   }
 
-  error = uv_udp_init(client->loop, &conf_req->super);
-  assert(error == 0);
-
-  struct sockaddr_in baddr;
-  baddr.sin_family = AF_INET;
-  baddr.sin_addr.s_addr = 0;
-  baddr.sin_port = 0;
-  error = uv_udp_bind(&conf_req->super, (struct sockaddr *)&baddr, 0);
-  assert(error == 0);
+  if (client->coalesce && req->type != PSW_REQ_BATCH) {
+    return coalesce_task(client, req, cb, data);
+  }
 
-  error = uv_udp_recv_start(&conf_req->super, on_alloc, on_recv);
-  assert(error == 0);
+  conf_req = alloc_req(client);
+  if (conf_req == NULL) {
+    return -ENOMEM;
+  }
 
-  conf_req->sbuf.base = (char *)malloc(conf_req->sbuf.len);
-  assert(conf_req->sbuf.base != NULL);
-  memcpy(conf_req->sbuf.base, req, conf_req->sbuf.len);
+  memcpy(conf_req->sbuf, req, len);
+  ((struct psw_req_base *)conf_req->sbuf)->seq = conf_req->seq;
+  conf_req->len = len;
   conf_req->user_cb = cb;
   conf_req->user_data = data;
-  uv_timer_t *retry_timer = &conf_req->retry_timer;
-  error = uv_timer_init(client->loop, retry_timer);
-  assert(error == 0);
-  error = uv_timer_start(retry_timer, retry_send, 100, 100);
-  assert(error == 0);
-
   conf_req->retry_count = 0;
-  conf_req->client = client;
 
-  retry_timer->data = conf_req;
+  start_req(client, conf_req);
 
-  uv_udp_send_t *sreq = (uv_udp_send_t *)malloc(sizeof(*sreq));
-  assert(sreq != NULL);
+  return 0;
+}
+
+int
+prism_switch_client_queue_batch(prism_switch_client_t *client,
+                                struct psw_batch_req *batch, psw_batch_cb cb,
+                                void *data)
+{
+  if (batch->type != PSW_REQ_BATCH || batch->count == 0) {
+    return -EINVAL;
+  }
 
-  return uv_udp_send(sreq, &conf_req->super, &conf_req->sbuf, 1,
-                     (const struct sockaddr *)&client->sw_addr, after_send);
+  return prism_switch_client_queue_task(client, (struct psw_req_base *)batch,
+                                        (psw_config_cb)cb, data);
+}
+
+void
+prism_switch_client_set_coalesce(prism_switch_client_t *client, bool enable)
+{
+  if (!enable && client->open_batch != NULL) {
+    send_open_batch(client);
+  }
+
+  client->coalesce = enable;
+}
+
+void
+prism_switch_client_set_max_inflight(prism_switch_client_t *client,
+                                     uint32_t max_inflight)
+{
+  client->max_inflight =
+      max_inflight == 0 ? PSW_DEFAULT_MAX_INFLIGHT : max_inflight;
+}
+
+void
+prism_switch_client_get_stats(prism_switch_client_t *client,
+                              struct psw_client_stats *stats)
+{
+  *stats = client->stats;
+  stats->ninflight = client->nwire;
+}
+
+static void
+on_close(uv_handle_t *handle)
+{
+  prism_switch_client_t *client = (prism_switch_client_t *)handle->data;
+
+  if (--client->nclosing == 0) {
+    free(client);
+  }
 }
 
 void
 prism_switch_client_destroy(prism_switch_client_t *client)
 {
-  free(client);
+  if (client == NULL) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < client->nchunks; i++) {
+    free(client->chunks[i]);
+  }
+
+  client->nchunks = 0;
+
+  /*
+   * Handles may already be closed by the application (e.g. uv_walk on
+   * shutdown), in that case the loop is not going to run again.
+   */
+  if (uv_is_closing((uv_handle_t *)&client->udp) &&
+      uv_is_closing((uv_handle_t *)&client->timer) &&
+      uv_is_closing((uv_handle_t *)&client->check)) {
+    free(client);
+    return;
+  }
+
+  if (!uv_is_closing((uv_handle_t *)&client->udp)) {
+    client->nclosing++;
+    uv_close((uv_handle_t *)&client->udp, on_close);
+  }
+
+  if (!uv_is_closing((uv_handle_t *)&client->timer)) {
+    client->nclosing++;
+    uv_close((uv_handle_t *)&client->timer, on_close);
+  }
+
+  if (!uv_is_closing((uv_handle_t *)&client->check)) {
+    client->nclosing++;
+    uv_close((uv_handle_t *)&client->check, on_close);
+  }
 }